@@ -39,8 +39,10 @@ use std::os::unix::io::{AsRawFd, FromRawFd};
 use anyhow::{bail, Context, Result};
 use log::{debug, error};
 
+use authfs_aidl_interface::aidl::com::android::virt::fs::FileChunks::FileChunks;
 use authfs_aidl_interface::aidl::com::android::virt::fs::IVirtFdService::{
-    BnVirtFdService, IVirtFdService, ERROR_IO, ERROR_UNKNOWN_FD, MAX_REQUESTING_DATA,
+    BnVirtFdService, IVirtFdService, ERROR_IO, ERROR_UNKNOWN_FD, MAX_REQUESTING_CHUNKS_DATA,
+    MAX_REQUESTING_DATA, MAX_REQUESTING_MERKLE_TREE_PAGES,
 };
 use authfs_aidl_interface::binder::{
     add_service, BinderFeatures, ExceptionCode, Interface, ProcessState, Result as BinderResult,
@@ -60,7 +62,11 @@ fn validate_and_cast_offset(offset: i64) -> Result<u64, Status> {
 }
 
 fn validate_and_cast_size(size: i32) -> Result<usize, Status> {
-    if size > MAX_REQUESTING_DATA {
+    validate_and_cast_size_up_to(size, MAX_REQUESTING_DATA)
+}
+
+fn validate_and_cast_size_up_to(size: i32, max_size: i32) -> Result<usize, Status> {
+    if size > max_size {
         Err(new_binder_exception(
             ExceptionCode::ILLEGAL_ARGUMENT,
             format!("Unexpectedly large size: {}", size),
@@ -156,6 +162,61 @@ impl IVirtFdService for FdService {
         }
     }
 
+    fn readFileChunks(
+        &self,
+        id: i32,
+        offset: i64,
+        size: i32,
+        merkle_tree_offsets: &[i64],
+        merkle_tree_page_size: i32,
+    ) -> BinderResult<FileChunks> {
+        let size: usize = validate_and_cast_size_up_to(size, MAX_REQUESTING_CHUNKS_DATA)?;
+        let offset: u64 = validate_and_cast_offset(offset)?;
+        if merkle_tree_offsets.len() > MAX_REQUESTING_MERKLE_TREE_PAGES as usize {
+            return Err(new_binder_exception(
+                ExceptionCode::ILLEGAL_ARGUMENT,
+                format!("Too many Merkle tree pages: {}", merkle_tree_offsets.len()),
+            ));
+        }
+        let page_size: usize = validate_and_cast_size(merkle_tree_page_size)?;
+
+        let (file, merkle_tree_source) = match self.get_file_config(id)? {
+            FdConfig::Readonly { file, alt_merkle_tree, .. } => {
+                (file, Some((file, alt_merkle_tree.as_ref())))
+            }
+            FdConfig::ReadWrite(file) => (file, None),
+        };
+        let data = read_into_buf(&file, size, offset).map_err(|e| {
+            error!("readFileChunks: read error: {}", e);
+            Status::from(ERROR_IO)
+        })?;
+
+        // The pages are padded so that the client can tell them apart.
+        let mut merkle_tree = vec![0; merkle_tree_offsets.len() * page_size];
+        if !merkle_tree_offsets.is_empty() {
+            if page_size == 0 {
+                return Err(new_binder_exception(
+                    ExceptionCode::ILLEGAL_ARGUMENT,
+                    "Invalid Merkle tree page size: 0",
+                ));
+            }
+            // As in readFsverityMerkleTree, the Merkle tree of a writable file is not served.
+            let (file, alt_merkle_tree) = merkle_tree_source.ok_or_else(|| {
+                new_binder_exception(ExceptionCode::UNSUPPORTED_OPERATION, "Unsupported")
+            })?;
+            for (&page_offset, page) in
+                merkle_tree_offsets.iter().zip(merkle_tree.chunks_exact_mut(page_size))
+            {
+                let page_offset: u64 = validate_and_cast_offset(page_offset)?;
+                read_merkle_tree_page(file, alt_merkle_tree, page_offset, page).map_err(|e| {
+                    error!("readFileChunks: failed to retrieve merkle tree: {}", e);
+                    Status::from(e.raw_os_error().unwrap_or(ERROR_IO))
+                })?;
+            }
+        }
+        Ok(FileChunks { data, merkleTree: merkle_tree })
+    }
+
     fn readFsveritySignature(&self, id: i32) -> BinderResult<Vec<u8>> {
         match &self.get_file_config(id)? {
             FdConfig::Readonly { file, alt_signature, .. } => {
@@ -234,6 +295,29 @@ fn read_into_buf(file: &File, max_size: usize, offset: u64) -> io::Result<Vec<u8
     Ok(buf)
 }
 
+/// Reads a page of the Merkle tree of `file` at `offset`, from `alt_merkle_tree` if provided. Fewer
+/// bytes than the page size are only read at the end of the tree.
+fn read_merkle_tree_page(
+    file: &File,
+    alt_merkle_tree: Option<&File>,
+    offset: u64,
+    page: &mut [u8],
+) -> io::Result<usize> {
+    let mut total = 0;
+    while total < page.len() {
+        let size = if let Some(tree_file) = alt_merkle_tree {
+            tree_file.read_at(&mut page[total..], offset + total as u64)?
+        } else {
+            fsverity::read_merkle_tree(file.as_raw_fd(), offset + total as u64, &mut page[total..])?
+        };
+        if size == 0 {
+            break;
+        }
+        total += size;
+    }
+    Ok(total)
+}
+
 fn is_fd_valid(fd: i32) -> bool {
     // SAFETY: a query-only syscall
     let retval = unsafe { libc::fcntl(fd, libc::F_GETFD) };
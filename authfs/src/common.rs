@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+use std::collections::{BTreeMap, HashMap};
+
 /// Common block and page size in Linux.
 pub const CHUNK_SIZE: u64 = 4096;
 
@@ -53,6 +55,59 @@ impl Iterator for ChunkedSizeIter {
     }
 }
 
+/// A map from chunk index to `V` that holds up to a fixed number of entries, evicting the least
+/// recently used one when full.
+pub struct LruCache<V> {
+    capacity: usize,
+    /// The entries and the time they were last used.
+    entries: HashMap<u64, (u64, V)>,
+    /// The keys of the entries, ordered by the time they were last used.
+    usage: BTreeMap<u64, u64>,
+    clock: u64,
+}
+
+impl<V> LruCache<V> {
+    pub fn new(capacity: usize) -> Self {
+        LruCache { capacity, entries: HashMap::new(), usage: BTreeMap::new(), clock: 0 }
+    }
+
+    /// Returns the entry of `key` if present, and marks it as the most recently used.
+    pub fn get(&mut self, key: u64) -> Option<&V> {
+        let clock = self.clock;
+        let (last_used, value) = self.entries.get_mut(&key)?;
+        self.usage.remove(last_used);
+        self.usage.insert(clock, key);
+        *last_used = clock;
+        self.clock += 1;
+        Some(value)
+    }
+
+    /// Inserts or replaces the entry of `key`, evicting the least recently used entry if needed.
+    pub fn put(&mut self, key: u64, value: V) {
+        if self.capacity == 0 {
+            return;
+        }
+        if let Some((last_used, _)) = self.entries.remove(&key) {
+            self.usage.remove(&last_used);
+        } else if self.entries.len() == self.capacity {
+            if let Some((&oldest, &evicted)) = self.usage.iter().next() {
+                self.usage.remove(&oldest);
+                self.entries.remove(&evicted);
+            }
+        }
+        self.entries.insert(key, (self.clock, value));
+        self.usage.insert(self.clock, key);
+        self.clock += 1;
+    }
+
+    /// Removes the entry of `key` and returns it if present.
+    pub fn remove(&mut self, key: u64) -> Option<V> {
+        let (last_used, value) = self.entries.remove(&key)?;
+        self.usage.remove(&last_used);
+        Some(value)
+    }
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -75,4 +130,24 @@ mod tests {
         assert_eq!(collect_chunk_read_iter(0, 0), []);
         assert_eq!(collect_chunk_read_iter(0, 100), []);
     }
+
+    #[test]
+    fn test_lru_cache() {
+        let mut cache = LruCache::new(2);
+        cache.put(1, "a");
+        cache.put(2, "b");
+        assert_eq!(cache.get(1), Some(&"a"));
+
+        // 2 is the least recently used entry.
+        cache.put(3, "c");
+        assert_eq!(cache.get(2), None);
+        assert_eq!(cache.get(1), Some(&"a"));
+        assert_eq!(cache.get(3), Some(&"c"));
+
+        // Replacing an entry doesn't evict another one.
+        cache.put(3, "d");
+        assert_eq!(cache.get(1), Some(&"a"));
+        assert_eq!(cache.remove(3), Some("d"));
+        assert_eq!(cache.remove(3), None);
+    }
 }
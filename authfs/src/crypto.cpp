@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "crypto.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+namespace {
+
+constexpr size_t kPageSize = AUTHFS_SHA256_PAGE_SIZE;
+constexpr uint8_t kZeros[kPageSize] = {};
+constexpr size_t kMaxThreads = 16;
+
+size_t NumCpus() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? cpus : 1;
+}
+
+struct HashBatch;
+
+struct HashTask {
+    const uint8_t* data;
+    size_t data_size;
+    uint8_t* hashes;
+    HashBatch* batch;
+    int retval;
+};
+
+// The tasks of one authfs_sha256_pages_parallel call.
+struct HashBatch {
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t remaining;
+};
+
+void RunHashTask(HashTask* task) {
+    task->retval = authfs_sha256_pages(task->data, task->data_size, task->hashes);
+    HashBatch* batch = task->batch;
+    std::lock_guard<std::mutex> lock(batch->mutex);
+    if (--batch->remaining == 0) {
+        batch->done.notify_one();
+    }
+}
+
+// Worker threads hashing the tasks of all the calls. They are started on first use and live as
+// long as the process, so that a call doesn't pay for creating threads.
+class HashThreadPool {
+public:
+    static HashThreadPool& Get() {
+        // Never destroyed, since the workers never exit.
+        static HashThreadPool* pool = new HashThreadPool(std::min(NumCpus(), kMaxThreads) - 1);
+        return *pool;
+    }
+
+    // Runs `tasks` and returns when they are all done. The calling thread runs some of them too,
+    // so they are done even when there are no workers.
+    void Run(HashTask* tasks, size_t num_tasks) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (size_t i = 1; i < num_tasks; i++) {
+                queue_.push_back(&tasks[i]);
+            }
+        }
+        queued_.notify_all();
+        RunHashTask(&tasks[0]);
+        while (HashTask* task = TryPop()) {
+            RunHashTask(task);
+        }
+        HashBatch* batch = tasks[0].batch;
+        std::unique_lock<std::mutex> lock(batch->mutex);
+        batch->done.wait(lock, [batch] { return batch->remaining == 0; });
+    }
+
+private:
+    explicit HashThreadPool(size_t num_workers) {
+        for (size_t i = 0; i < num_workers; i++) {
+            try {
+                std::thread(&HashThreadPool::Work, this).detach();
+            } catch (const std::system_error&) {
+                // The calling threads do the work of the missing workers.
+                break;
+            }
+        }
+    }
+
+    HashTask* TryPop() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (queue_.empty()) {
+            return nullptr;
+        }
+        HashTask* task = queue_.front();
+        queue_.pop_front();
+        return task;
+    }
+
+    void Work() {
+        while (true) {
+            HashTask* task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                queued_.wait(lock, [this] { return !queue_.empty(); });
+                task = queue_.front();
+                queue_.pop_front();
+            }
+            RunHashTask(task);
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable queued_;
+    std::deque<HashTask*> queue_;
+};
+
+}  // namespace
+
+int authfs_sha256_pages(const uint8_t* data, size_t data_size, uint8_t* hashes) {
+    const size_t full_pages = data_size / kPageSize;
+    for (size_t i = 0; i < full_pages; i++) {
+        // A full page is hashed in one call, so that all of its blocks go through BoringSSL's
+        // block function at once, which uses the SHA extensions of the CPU when there are any.
+        if (SHA256(data + i * kPageSize, kPageSize, hashes + i * SHA256_DIGEST_LENGTH) == nullptr) {
+            return 0;
+        }
+    }
+
+    const size_t remaining = data_size % kPageSize;
+    if (remaining > 0) {
+        SHA256_CTX ctx;
+        if (!SHA256_Init(&ctx) || !SHA256_Update(&ctx, data + full_pages * kPageSize, remaining) ||
+            !SHA256_Update(&ctx, kZeros, kPageSize - remaining) ||
+            !SHA256_Final(hashes + full_pages * SHA256_DIGEST_LENGTH, &ctx)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int authfs_sha256_pages_parallel(const uint8_t* data, size_t data_size, uint8_t* hashes,
+                                 size_t max_threads) {
+    if (max_threads == 0) {
+        max_threads = NumCpus();
+    }
+    const size_t num_pages = (data_size + kPageSize - 1) / kPageSize;
+    const size_t num_tasks =
+            std::min({num_pages / AUTHFS_SHA256_MIN_PAGES_PER_THREAD, max_threads, kMaxThreads});
+    if (num_tasks <= 1) {
+        return authfs_sha256_pages(data, data_size, hashes);
+    }
+
+    // Only the last task may have an incomplete page.
+    HashBatch batch;
+    HashTask tasks[kMaxThreads];
+    const size_t pages_per_task = (num_pages + num_tasks - 1) / num_tasks;
+    size_t n = 0;
+    for (size_t page = 0; page < num_pages; page += pages_per_task) {
+        const size_t offset = page * kPageSize;
+        const size_t size = std::min(data_size - offset, pages_per_task * kPageSize);
+        tasks[n++] = {data + offset, size, hashes + page * SHA256_DIGEST_LENGTH, &batch, 0};
+    }
+    batch.remaining = n;
+    HashThreadPool::Get().Run(tasks, n);
+
+    int retval = 1;
+    for (size_t i = 0; i < n; i++) {
+        retval &= tasks[i].retval;
+    }
+    return retval;
+}
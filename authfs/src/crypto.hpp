@@ -18,5 +18,30 @@
 #define AUTHFS_OPENSSL_WRAPPER_H
 
 #include <openssl/sha.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AUTHFS_SHA256_PAGE_SIZE 4096
+#define AUTHFS_SHA256_MIN_PAGES_PER_THREAD 256
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Hashes `data` page by page with SHA-256, padding the last page with zeros if it is incomplete.
+// `hashes` must have room for a SHA256_DIGEST_LENGTH-byte hash for each page. Returns 1 on success
+// and 0 on failure, like the rest of BoringSSL.
+int authfs_sha256_pages(const uint8_t* data, size_t data_size, uint8_t* hashes);
+
+// Like authfs_sha256_pages, but splits the pages between up to `max_threads` threads (or as many
+// as there are CPUs if 0), and at most 16. Each thread gets at least
+// AUTHFS_SHA256_MIN_PAGES_PER_THREAD pages, so small inputs are hashed on the calling thread. The
+// other threads are workers started on the first call and kept for the life of the process.
+int authfs_sha256_pages_parallel(const uint8_t* data, size_t data_size, uint8_t* hashes,
+                                 size_t max_threads);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
 
 #endif  // AUTHFS_OPENSSL_WRAPPER_H
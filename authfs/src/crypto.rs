@@ -24,7 +24,10 @@ pub enum CryptoError {
     Unexpected(&'static str),
 }
 
-use authfs_crypto_bindgen::{SHA256_Final, SHA256_Init, SHA256_Update, SHA256_CTX};
+use authfs_crypto_bindgen::{
+    authfs_sha256_pages, authfs_sha256_pages_parallel, SHA256_Final, SHA256_Init, SHA256_Update,
+    AUTHFS_SHA256_PAGE_SIZE, SHA256_CTX,
+};
 
 pub type Sha256Hash = [u8; Sha256Hasher::HASH_SIZE];
 
@@ -41,6 +44,47 @@ impl Sha256Hasher {
         0x2c, 0xa7,
     ];
 
+    /// The size of the pages hashed by `hash_pages`.
+    pub const PAGE_SIZE: usize = AUTHFS_SHA256_PAGE_SIZE as usize;
+
+    /// Hashes `data` page by page, as if the last page were padded with zeros, and writes the hash
+    /// of each page to `hashes`, which must have exactly one hash per page. Each page still gets
+    /// its own one-shot SHA-256; the only saving over hashing them one at a time with `update` is
+    /// the single FFI call for all of them.
+    pub fn hash_pages(data: &[u8], hashes: &mut [Sha256Hash]) -> Result<(), CryptoError> {
+        assert_eq!(hashes.len(), (data.len() + Self::PAGE_SIZE - 1) / Self::PAGE_SIZE);
+        // Safe assuming the crypto FFI only reads `data`, and writes one hash per page to
+        // `hashes`, which has room for them as asserted above.
+        let retval = unsafe {
+            authfs_sha256_pages(data.as_ptr(), data.len(), hashes.as_mut_ptr() as *mut u8)
+        };
+        if retval == 0 {
+            Err(CryptoError::Unexpected("authfs_sha256_pages"))
+        } else {
+            Ok(())
+        }
+    }
+
+    /// Like `hash_pages`, but large inputs are split between threads, one per CPU at most.
+    pub fn hash_pages_parallel(data: &[u8], hashes: &mut [Sha256Hash]) -> Result<(), CryptoError> {
+        assert_eq!(hashes.len(), (data.len() + Self::PAGE_SIZE - 1) / Self::PAGE_SIZE);
+        // Safe assuming the crypto FFI only reads `data`, and writes one hash per page to
+        // `hashes`, which has room for them as asserted above.
+        let retval = unsafe {
+            authfs_sha256_pages_parallel(
+                data.as_ptr(),
+                data.len(),
+                hashes.as_mut_ptr() as *mut u8,
+                0, // As many threads as CPUs.
+            )
+        };
+        if retval == 0 {
+            Err(CryptoError::Unexpected("authfs_sha256_pages_parallel"))
+        } else {
+            Ok(())
+        }
+    }
+
     pub fn new() -> Result<Sha256Hasher, CryptoError> {
         // Safe assuming the crypto FFI should initialize the uninitialized `ctx`, which is
         // currently a pure data struct.
@@ -119,4 +163,35 @@ mod tests {
         assert_eq!(hash, Sha256Hasher::HASH_OF_4096_ZEROS);
         Ok(())
     }
+
+    #[test]
+    fn hash_pages_matches_hashing_one_page_at_a_time() -> Result<(), CryptoError> {
+        for &size in &[0, 1, 4095, 4096, 4097, 3 * 4096, 5 * 4096 + 100] {
+            let data: Vec<u8> = (0..size).map(|i| (i % 251) as u8).collect();
+            let mut hashes = vec![[0u8; Sha256Hasher::HASH_SIZE]; (size + 4095) / 4096];
+            Sha256Hasher::hash_pages(&data, &mut hashes)?;
+
+            for (page, hash) in data.chunks(4096).zip(&hashes) {
+                let expected = Sha256Hasher::new()?
+                    .update(page)?
+                    .update(&vec![0u8; 4096 - page.len()])?
+                    .finalize()?;
+                assert_eq!(hash, &expected, "size {}", size);
+            }
+        }
+        Ok(())
+    }
+
+    #[test]
+    fn hash_pages_parallel_matches_hash_pages() -> Result<(), CryptoError> {
+        // Large enough to be split between threads.
+        let size = 1000 * 4096 + 1;
+        let data: Vec<u8> = (0..size).map(|i| (i % 251) as u8).collect();
+        let mut expected = vec![[0u8; Sha256Hasher::HASH_SIZE]; 1001];
+        Sha256Hasher::hash_pages(&data, &mut expected)?;
+        let mut hashes = vec![[0u8; Sha256Hasher::HASH_SIZE]; 1001];
+        Sha256Hasher::hash_pages_parallel(&data, &mut hashes)?;
+        assert_eq!(hashes, expected);
+        Ok(())
+    }
 }
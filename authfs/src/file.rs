@@ -26,6 +26,27 @@ pub trait ReadByChunk {
     /// `CHUNK_SIZE` except for the last incomplete chunk. Reading beyond the file size (including
     /// empty file) should return 0.
     fn read_chunk(&self, chunk_index: u64, buf: &mut ChunkBuffer) -> io::Result<usize>;
+
+    /// Reads consecutive chunks starting from the `start_index`-th one, one per buffer in `bufs`.
+    /// Returns the size read into each buffer, as `read_chunk` would. Implementations may override
+    /// this to fetch all the chunks at once.
+    fn read_chunks(&self, start_index: u64, bufs: &mut [ChunkBuffer]) -> io::Result<Vec<usize>> {
+        (start_index..)
+            .zip(bufs.iter_mut())
+            .map(|(index, buf)| self.read_chunk(index, buf))
+            .collect()
+    }
+    /// Like `read_chunks`, and also reads the `merkle_tree_indices`-th pages of the fs-verity
+    /// Merkle tree of the file if the implementation can fetch them along with the chunks. Returns
+    /// the pages in the same order, or `None` if they have to be read from the tree separately.
+    fn read_chunks_with_merkle_tree(
+        &self,
+        start_index: u64,
+        bufs: &mut [ChunkBuffer],
+        _merkle_tree_indices: &[u64],
+    ) -> io::Result<(Vec<usize>, Option<Vec<ChunkBuffer>>)> {
+        Ok((self.read_chunks(start_index, bufs)?, None))
+    }
 }
 
 /// A trait to write a buffer to the destination at a given offset. The implementation does not
@@ -22,19 +22,25 @@ use std::sync::{Arc, Mutex};
 use super::{ChunkBuffer, RandomWrite, ReadByChunk};
 use crate::common::CHUNK_SIZE;
 
-use authfs_aidl_interface::aidl::com::android::virt::fs::IVirtFdService;
+use authfs_aidl_interface::aidl::com::android::virt::fs::IVirtFdService::{
+    self, MAX_REQUESTING_CHUNKS_DATA, MAX_REQUESTING_MERKLE_TREE_PAGES,
+};
 use authfs_aidl_interface::binder::Strong;
 
 type VirtFdService = Strong<dyn IVirtFdService::IVirtFdService>;
 
+fn chunk_index_to_offset(chunk_index: u64) -> io::Result<i64> {
+    i64::try_from(chunk_index * CHUNK_SIZE)
+        .map_err(|_| io::Error::from_raw_os_error(libc::EOVERFLOW))
+}
+
 fn remote_read_chunk(
     service: &Arc<Mutex<VirtFdService>>,
     remote_fd: i32,
     chunk_index: u64,
     buf: &mut ChunkBuffer,
 ) -> io::Result<usize> {
-    let offset = i64::try_from(chunk_index * CHUNK_SIZE)
-        .map_err(|_| io::Error::from_raw_os_error(libc::EOVERFLOW))?;
+    let offset = chunk_index_to_offset(chunk_index)?;
 
     let chunk = service
         .lock()
@@ -46,6 +52,71 @@ fn remote_read_chunk(
     Ok(size)
 }
 
+/// Reads consecutive chunks with as few requests as possible. The Merkle tree pages are fetched
+/// with the first request if they fit in it.
+fn remote_read_chunks(
+    service: &Arc<Mutex<VirtFdService>>,
+    remote_fd: i32,
+    start_index: u64,
+    bufs: &mut [ChunkBuffer],
+    merkle_tree_indices: &[u64],
+) -> io::Result<(Vec<usize>, Option<Vec<ChunkBuffer>>)> {
+    let mut merkle_tree_offsets =
+        if merkle_tree_indices.len() <= MAX_REQUESTING_MERKLE_TREE_PAGES as usize {
+            Some(
+                merkle_tree_indices
+                    .iter()
+                    .map(|index| chunk_index_to_offset(*index))
+                    .collect::<io::Result<Vec<_>>>()?,
+            )
+        } else {
+            None
+        };
+    let mut merkle_tree_pages = None;
+    let mut sizes = Vec::with_capacity(bufs.len());
+    let chunks_per_request = MAX_REQUESTING_CHUNKS_DATA as usize / CHUNK_SIZE as usize;
+    for (request_index, request_bufs) in bufs.chunks_mut(chunks_per_request).enumerate() {
+        let chunk_index = start_index + (request_index * chunks_per_request) as u64;
+        let page_offsets = merkle_tree_offsets.take();
+        let chunks = service
+            .lock()
+            .unwrap()
+            .readFileChunks(
+                remote_fd,
+                chunk_index_to_offset(chunk_index)?,
+                (request_bufs.len() * CHUNK_SIZE as usize) as i32,
+                page_offsets.as_deref().unwrap_or(&[]),
+                CHUNK_SIZE as i32,
+            )
+            .map_err(|e| io::Error::new(io::ErrorKind::Other, e.get_description()))?;
+
+        if let Some(page_offsets) = page_offsets {
+            if chunks.merkleTree.len() != page_offsets.len() * CHUNK_SIZE as usize {
+                return Err(io::Error::from_raw_os_error(libc::EIO));
+            }
+            merkle_tree_pages = Some(
+                chunks
+                    .merkleTree
+                    .chunks_exact(CHUNK_SIZE as usize)
+                    .map(|page| {
+                        let mut buf = [0u8; CHUNK_SIZE as usize];
+                        buf.copy_from_slice(page);
+                        buf
+                    })
+                    .collect(),
+            );
+        }
+
+        let mut data = chunks.data.chunks(CHUNK_SIZE as usize);
+        for buf in request_bufs.iter_mut() {
+            let chunk = data.next().unwrap_or(&[]);
+            buf[..chunk.len()].copy_from_slice(chunk);
+            sizes.push(chunk.len());
+        }
+    }
+    Ok((sizes, merkle_tree_pages))
+}
+
 pub struct RemoteFileReader {
     // This needs to have Sync trait to be used in fuse::worker::start_message_loop.
     service: Arc<Mutex<VirtFdService>>,
@@ -62,6 +133,19 @@ impl ReadByChunk for RemoteFileReader {
     fn read_chunk(&self, chunk_index: u64, buf: &mut ChunkBuffer) -> io::Result<usize> {
         remote_read_chunk(&self.service, self.file_fd, chunk_index, buf)
     }
+
+    fn read_chunks(&self, start_index: u64, bufs: &mut [ChunkBuffer]) -> io::Result<Vec<usize>> {
+        Ok(remote_read_chunks(&self.service, self.file_fd, start_index, bufs, &[])?.0)
+    }
+
+    fn read_chunks_with_merkle_tree(
+        &self,
+        start_index: u64,
+        bufs: &mut [ChunkBuffer],
+        merkle_tree_indices: &[u64],
+    ) -> io::Result<(Vec<usize>, Option<Vec<ChunkBuffer>>)> {
+        remote_read_chunks(&self.service, self.file_fd, start_index, bufs, merkle_tree_indices)
+    }
 }
 
 pub struct RemoteMerkleTreeReader {
@@ -79,8 +163,7 @@ impl RemoteMerkleTreeReader {
 
 impl ReadByChunk for RemoteMerkleTreeReader {
     fn read_chunk(&self, chunk_index: u64, buf: &mut ChunkBuffer) -> io::Result<usize> {
-        let offset = i64::try_from(chunk_index * CHUNK_SIZE)
-            .map_err(|_| io::Error::from_raw_os_error(libc::EOVERFLOW))?;
+        let offset = chunk_index_to_offset(chunk_index)?;
 
         let chunk = self
             .service
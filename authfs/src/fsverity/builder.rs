@@ -14,7 +14,10 @@
  * limitations under the License.
  */
 
-use super::common::{build_fsverity_digest, merkle_tree_height, FsverityError};
+use std::cmp::{max, min};
+use std::collections::BTreeSet;
+
+use super::common::{build_fsverity_digest, FsverityError};
 use crate::common::{divide_roundup, CHUNK_SIZE};
 use crate::crypto::{CryptoError, Sha256Hash, Sha256Hasher};
 
@@ -26,28 +29,38 @@ const HASH_PER_PAGE: usize = CHUNK_SIZE as usize / HASH_SIZE;
 ///
 /// It's in-memory because for the initial use cases, we don't need to read back an existing file,
 /// and only need to deal with new files. Also, considering that the output file won't be large at
-/// the moment, it is sufficient to simply keep the Merkle tree in memory in the trusted world. To
-/// further simplify the initial implementation, we only need to keep the leaf nodes in memory, and
-/// generate the tree / root hash when requested.
+/// the moment, it is sufficient to simply keep the Merkle tree in memory in the trusted world.
+///
+/// The leaves are kept up to date by the customer. The upper levels of the tree are generated
+/// when the root hash is requested, and kept for the next request, so that only the pages that
+/// have changed since then, and their paths to the root, need to be hashed again.
 pub struct MerkleLeaves {
     leaves: Vec<Sha256Hash>,
     file_size: u64,
+    /// The levels of the tree above the leaves, the last one being the root hash. They are only
+    /// valid for the first `hashed_leaves` leaves, except for the pages in `dirty_pages`.
+    levels: Vec<Vec<Sha256Hash>>,
+    /// The number of leaves when `levels` were last updated.
+    hashed_leaves: usize,
+    /// Indices of the pages of leaves that have changed since `levels` were last updated.
+    dirty_pages: BTreeSet<usize>,
 }
 
-fn hash_all_pages(source: &[Sha256Hash]) -> Result<Vec<Sha256Hash>, CryptoError> {
-    source
-        .chunks(HASH_PER_PAGE)
-        .map(|chunk| {
-            let padding_bytes = (HASH_PER_PAGE - chunk.len()) * HASH_SIZE;
-            Sha256Hasher::new()?.update_from(chunk)?.update(&vec![0u8; padding_bytes])?.finalize()
-        })
-        .collect()
+fn hashes_as_bytes(hashes: &[Sha256Hash]) -> &[u8] {
+    // Safe because a slice of byte arrays has the same layout as a slice of all the bytes.
+    unsafe { std::slice::from_raw_parts(hashes.as_ptr() as *const u8, hashes.len() * HASH_SIZE) }
 }
 
 impl MerkleLeaves {
     /// Creates a `MerkleLeaves` instance with empty data.
     pub fn new() -> Self {
-        Self { leaves: Vec::new(), file_size: 0 }
+        Self {
+            leaves: Vec::new(),
+            file_size: 0,
+            levels: Vec::new(),
+            hashed_leaves: 0,
+            dirty_pages: BTreeSet::new(),
+        }
     }
 
     /// Gets size of the file represented by `MerkleLeaves`.
@@ -63,8 +76,10 @@ impl MerkleLeaves {
     /// the caller to fix the last leaf if needed.
     pub fn resize(&mut self, new_file_size: usize) {
         let new_file_size = new_file_size as u64;
-        let leaves_size = divide_roundup(new_file_size, CHUNK_SIZE);
-        self.leaves.resize(leaves_size as usize, Sha256Hasher::HASH_OF_4096_ZEROS);
+        let leaves_size = divide_roundup(new_file_size, CHUNK_SIZE) as usize;
+        let old_leaves_size = self.leaves.len();
+        self.leaves.resize(leaves_size, Sha256Hasher::HASH_OF_4096_ZEROS);
+        self.mark_dirty(min(old_leaves_size, leaves_size), max(old_leaves_size, leaves_size));
         self.file_size = new_file_size;
     }
 
@@ -75,9 +90,29 @@ impl MerkleLeaves {
         if self.leaves.len() < index + 1 {
             // When resizing, fill in hash of zeros by default. This makes it easy to handle holes
             // in a file.
+            let old_leaves_size = self.leaves.len();
             self.leaves.resize(index + 1, Sha256Hasher::HASH_OF_4096_ZEROS);
+            self.mark_dirty(old_leaves_size, index);
         }
         self.leaves[index].clone_from_slice(hash);
+        self.mark_dirty(index, index + 1);
+
+        if size_at_least > self.file_size {
+            self.file_size = size_at_least;
+        }
+    }
+
+    /// Updates the hashes of the consecutive leaves from the `start`-th one, like `update_hash`
+    /// does for each of them.
+    pub fn update_hashes(&mut self, start: usize, hashes: &[Sha256Hash], size_at_least: u64) {
+        let end = start + hashes.len();
+        if self.leaves.len() < end {
+            let old_leaves_size = self.leaves.len();
+            self.leaves.resize(end, Sha256Hasher::HASH_OF_4096_ZEROS);
+            self.mark_dirty(old_leaves_size, start);
+        }
+        self.leaves[start..end].copy_from_slice(hashes);
+        self.mark_dirty(start, end);
 
         if size_at_least > self.file_size {
             self.file_size = size_at_least;
@@ -98,7 +133,60 @@ impl MerkleLeaves {
         }
     }
 
-    fn calculate_root_hash(&self) -> Result<Sha256Hash, FsverityError> {
+    /// Marks the pages holding the leaves from `start` to `end` (excluded) as changed.
+    fn mark_dirty(&mut self, start: usize, end: usize) {
+        if start < end {
+            self.dirty_pages.extend(start / HASH_PER_PAGE..=(end - 1) / HASH_PER_PAGE);
+        }
+    }
+
+    /// Brings `levels` up to date with the leaves, hashing only the pages that have changed.
+    fn update_levels(&mut self) -> Result<(), CryptoError> {
+        let mut dirty = std::mem::take(&mut self.dirty_pages);
+        let mut old_below_len = self.hashed_leaves;
+        let mut below_len = self.leaves.len();
+        let mut level = 0;
+        while below_len > 1 {
+            let len = divide_roundup(below_len as u64, HASH_PER_PAGE as u64) as usize;
+            // When the level below has grown or shrunk, its last page has changed, and so have any
+            // new pages.
+            if old_below_len != below_len {
+                dirty.extend(min(old_below_len, below_len).saturating_sub(1) / HASH_PER_PAGE..len);
+            }
+            if level == self.levels.len() {
+                self.levels.push(Vec::new());
+            }
+            old_below_len = self.levels[level].len();
+            self.levels[level].resize(len, [0u8; HASH_SIZE]);
+
+            let (lower_levels, upper_levels) = self.levels.split_at_mut(level);
+            let below = if level == 0 { &self.leaves } else { &lower_levels[level - 1] };
+            let current = &mut upper_levels[0];
+            // Hash each run of consecutive dirty pages at once.
+            let mut pages = dirty.range(..len).copied().peekable();
+            while let Some(start) = pages.next() {
+                let mut end = start + 1;
+                while pages.peek() == Some(&end) {
+                    pages.next();
+                    end += 1;
+                }
+                let source = &below[start * HASH_PER_PAGE..min(end * HASH_PER_PAGE, below_len)];
+                Sha256Hasher::hash_pages_parallel(
+                    hashes_as_bytes(source),
+                    &mut current[start..end],
+                )?;
+            }
+
+            dirty = dirty.range(..len).map(|page| page / HASH_PER_PAGE).collect();
+            below_len = len;
+            level += 1;
+        }
+        self.levels.truncate(level);
+        self.hashed_leaves = self.leaves.len();
+        Ok(())
+    }
+
+    fn calculate_root_hash(&mut self) -> Result<Sha256Hash, FsverityError> {
         match self.leaves.len() {
             // Special cases per fs-verity digest definition.
             0 => {
@@ -111,25 +199,17 @@ impl MerkleLeaves {
             }
             n => {
                 debug_assert_eq!((self.file_size - 1) / CHUNK_SIZE, n as u64);
-                let size_for_equivalent = n as u64 * CHUNK_SIZE;
-                let level = merkle_tree_height(size_for_equivalent).unwrap(); // safe since n > 0
-
-                // `leaves` is owned and can't be the initial state below. Here we manually hash it
-                // first to avoid a copy and to get the type right.
-                let second_level = hash_all_pages(&self.leaves)?;
-                let hashes =
-                    (1..=level).try_fold(second_level, |source, _| hash_all_pages(&source))?;
-                if hashes.len() != 1 {
-                    Err(FsverityError::InvalidState)
-                } else {
-                    Ok(hashes.into_iter().next().unwrap())
+                self.update_levels()?;
+                match self.levels.last().map(|root| &root[..]) {
+                    Some([root_hash]) => Ok(*root_hash),
+                    _ => Err(FsverityError::InvalidState),
                 }
             }
         }
     }
 
     /// Returns the fs-verity digest based on the current tree and file size.
-    pub fn calculate_fsverity_digest(&self) -> Result<Sha256Hash, FsverityError> {
+    pub fn calculate_fsverity_digest(&mut self) -> Result<Sha256Hash, FsverityError> {
         let root_hash = self.calculate_root_hash()?;
         Ok(build_fsverity_digest(&root_hash, self.file_size)?)
     }
@@ -244,6 +324,41 @@ mod tests {
         Ok(())
     }
 
+    #[test]
+    fn merkle_tree_incremental_updates() -> Result<()> {
+        let hash = Sha256Hasher::new()?.update(&vec![1u8; CHUNK_SIZE as usize])?.finalize()?;
+        let mut tree = MerkleLeaves::new();
+        // Enough leaves for 3 levels.
+        let leaves = HASH_PER_PAGE * 3 + 1;
+        tree.resize(leaves * CHUNK_SIZE as usize);
+        tree.calculate_fsverity_digest()?;
+
+        // Change a leaf in the middle, then grow and shrink the tree, digesting after each step.
+        tree.update_hash(HASH_PER_PAGE + 5, &hash, 0);
+        assert_eq!(fresh_tree_digest(&tree)?, tree.calculate_fsverity_digest()?);
+
+        tree.update_hash(leaves + HASH_PER_PAGE, &hash, (leaves as u64 + 200) * CHUNK_SIZE);
+        tree.resize((leaves + 200) * CHUNK_SIZE as usize);
+        assert_eq!(fresh_tree_digest(&tree)?, tree.calculate_fsverity_digest()?);
+
+        tree.resize(HASH_PER_PAGE * CHUNK_SIZE as usize + 1);
+        assert_eq!(fresh_tree_digest(&tree)?, tree.calculate_fsverity_digest()?);
+
+        tree.resize(leaves * CHUNK_SIZE as usize);
+        tree.update_hash(0, &hash, 0);
+        assert_eq!(fresh_tree_digest(&tree)?, tree.calculate_fsverity_digest()?);
+        Ok(())
+    }
+
+    fn fresh_tree_digest(tree: &MerkleLeaves) -> Result<Sha256Hash> {
+        let mut fresh = MerkleLeaves::new();
+        for (index, hash) in tree.leaves.iter().enumerate() {
+            fresh.update_hash(index, hash, 0);
+        }
+        fresh.resize(tree.file_size as usize);
+        Ok(fresh.calculate_fsverity_digest()?)
+    }
+
     fn generate_fsverity_digest_sequentially(test_data: &[u8]) -> Result<Sha256Hash> {
         let mut tree = MerkleLeaves::new();
         for (index, chunk) in test_data.chunks(CHUNK_SIZE as usize).enumerate() {
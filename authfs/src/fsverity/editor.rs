@@ -51,12 +51,17 @@
 //!
 //! Rollback attack is another possible attack, but can be addressed with a rollback counter when
 //! possible.
+//!
+//! Writes at the end of the file, which is how outputs are usually generated, are buffered until
+//! they fill up the buffer or something else needs the file, e.g. a write elsewhere or a flush.
+//! Chunks are then hashed from the buffer only, without reading back what was previously written
+//! to them, and forwarded in one write to the untrusted storage.
 
 use std::io;
-use std::sync::{Arc, RwLock};
+use std::sync::{Arc, Mutex, RwLock};
 
 use super::builder::MerkleLeaves;
-use crate::common::{ChunkedSizeIter, CHUNK_SIZE};
+use crate::common::{divide_roundup, ChunkedSizeIter, CHUNK_SIZE};
 use crate::crypto::{CryptoError, Sha256Hash, Sha256Hasher};
 use crate::file::{ChunkBuffer, RandomWrite, ReadByChunk};
 
@@ -75,49 +80,180 @@ fn debug_assert_usize_is_u64() {
     debug_assert!(usize::MAX as u64 == u64::MAX, "Only 64-bit arch is supported");
 }
 
+/// The maximum size of the buffered writes. It is the maximum size of a FUSE write, so that
+/// sequential small writes end up in as few writes to the file as the largest writes would.
+const MAX_BUFFERED_WRITE_SIZE: usize = 65536;
+
+/// Writes which have been accepted but not hashed nor forwarded to the file yet. They start at a
+/// chunk boundary, and hold the whole content of their chunks, so that the hashes of the chunks
+/// can be calculated from the buffer only.
+struct WriteBuffer {
+    /// The offset of the first byte in the file, which is a multiple of `CHUNK_SIZE`.
+    start: u64,
+    data: Vec<u8>,
+}
+
+impl WriteBuffer {
+    fn end(&self) -> u64 {
+        self.start + self.data.len() as u64
+    }
+
+    /// Returns whether a write of `size` bytes at `offset` can be merged into the buffer, i.e. it
+    /// overlaps or extends the buffer, and fits in it.
+    fn can_merge(&self, offset: u64, size: usize) -> bool {
+        offset >= self.start
+            && offset <= self.end()
+            && offset - self.start + size as u64 <= MAX_BUFFERED_WRITE_SIZE as u64
+    }
+
+    fn merge(&mut self, buf: &[u8], offset: u64) {
+        let begin = (offset - self.start) as usize;
+        let end = begin + buf.len();
+        if end > self.data.len() {
+            self.data.resize(end, 0);
+        }
+        self.data[begin..end].copy_from_slice(buf);
+    }
+
+    /// Returns the content of the `chunk_index`-th chunk of the file if it is in the buffer.
+    fn chunk(&self, chunk_index: u64) -> Option<&[u8]> {
+        let begin = chunk_index.checked_mul(CHUNK_SIZE)?.checked_sub(self.start)?;
+        self.data.chunks(CHUNK_SIZE as usize).nth((begin / CHUNK_SIZE) as usize)
+    }
+}
+
 /// VerifiedFileEditor provides an integrity layer to an underlying read-writable file, which may
 /// not be stored in a trusted environment. Only new, empty files are currently supported.
 pub struct VerifiedFileEditor<F: ReadByChunk + RandomWrite> {
     file: F,
     merkle_tree: Arc<RwLock<MerkleLeaves>>,
+    /// The buffered writes at the end of the file, if any. When both are needed, this is locked
+    /// before `merkle_tree`.
+    write_buffer: Mutex<Option<WriteBuffer>>,
 }
 
 impl<F: ReadByChunk + RandomWrite> VerifiedFileEditor<F> {
     /// Wraps a supposedly new file for integrity protection.
     pub fn new(file: F) -> Self {
-        Self { file, merkle_tree: Arc::new(RwLock::new(MerkleLeaves::new())) }
+        Self {
+            file,
+            merkle_tree: Arc::new(RwLock::new(MerkleLeaves::new())),
+            write_buffer: Mutex::new(None),
+        }
     }
 
     /// Calculates the fs-verity digest of the current file.
     #[allow(dead_code)]
     pub fn calculate_fsverity_digest(&self) -> io::Result<Sha256Hash> {
-        let merkle_tree = self.merkle_tree.read().unwrap();
+        self.flush()?;
+        let mut merkle_tree = self.merkle_tree.write().unwrap();
         merkle_tree.calculate_fsverity_digest().map_err(|e| io::Error::new(io::ErrorKind::Other, e))
     }
 
-    fn new_hash_for_incomplete_write(
+    /// Writes the buffered writes to the file.
+    pub fn flush(&self) -> io::Result<()> {
+        let mut write_buffer = self.write_buffer.lock().unwrap();
+        self.flush_buffer(&mut write_buffer, false)
+    }
+
+    /// Hashes the buffered writes and forwards them to the file in one write. If
+    /// `complete_chunks_only`, the last chunk is kept in the buffer unless it is complete. The
+    /// writes are dropped if they fail, as the content of the file is then unknown.
+    fn flush_buffer(
         &self,
-        source: &[u8],
-        offset_from_alignment: usize,
-        output_chunk_index: usize,
-        merkle_tree: &mut MerkleLeaves,
-    ) -> io::Result<Sha256Hash> {
+        write_buffer: &mut Option<WriteBuffer>,
+        complete_chunks_only: bool,
+    ) -> io::Result<()> {
+        let buffer = match write_buffer {
+            Some(buffer) => buffer,
+            None => return Ok(()),
+        };
+        let size = if complete_chunks_only {
+            buffer.data.len() - buffer.data.len() % CHUNK_SIZE as usize
+        } else {
+            buffer.data.len()
+        };
+        if size > 0 {
+            let mut merkle_tree = self.merkle_tree.write().unwrap();
+            let data = &buffer.data[..size];
+            let mut hashes = vec![
+                [0u8; Sha256Hasher::HASH_SIZE];
+                divide_roundup(size as u64, CHUNK_SIZE) as usize
+            ];
+            let result = Sha256Hasher::hash_pages(data, &mut hashes)
+                .map_err(io::Error::from)
+                .and_then(|_| self.file.write_all_at(data, buffer.start));
+            if let Err(e) = result {
+                *write_buffer = None;
+                return Err(e);
+            }
+            let size_at_least = buffer.start + size as u64;
+            merkle_tree.update_hashes((buffer.start / CHUNK_SIZE) as usize, &hashes, size_at_least);
+        }
+        if complete_chunks_only {
+            buffer.data.drain(..size);
+            buffer.start += size as u64;
+        } else {
+            *write_buffer = None;
+        }
+        Ok(())
+    }
+
+    /// Starts to buffer the writes from `offset` if it is at or beyond the end of the file, and a
+    /// write of `size` bytes there fits in the buffer. The buffer starts with the current content
+    /// of the chunk at `offset`, if any, once verified.
+    fn start_buffer(&self, offset: u64, size: usize) -> io::Result<Option<WriteBuffer>> {
+        let merkle_tree = self.merkle_tree.read().unwrap();
+        let offset_from_alignment = offset % CHUNK_SIZE;
+        if offset < merkle_tree.file_size()
+            || offset_from_alignment as usize + size > MAX_BUFFERED_WRITE_SIZE
+        {
+            return Ok(None);
+        }
+        let start = offset - offset_from_alignment;
+        let mut data = vec![0u8; offset_from_alignment as usize];
+        let chunk_index = (start / CHUNK_SIZE) as usize;
+        if offset_from_alignment > 0 && merkle_tree.is_index_valid(chunk_index) {
+            let orig_data = self.read_verified_chunk(chunk_index, &merkle_tree)?;
+            data.copy_from_slice(&orig_data[..offset_from_alignment as usize]);
+        }
+        Ok(Some(WriteBuffer { start, data }))
+    }
+
+    /// Reads back the `chunk_index`-th chunk, padded with zeros, and verifies it against the known
+    /// hash (since the storage / remote server is not trusted).
+    fn read_verified_chunk(
+        &self,
+        chunk_index: usize,
+        merkle_tree: &MerkleLeaves,
+    ) -> io::Result<ChunkBuffer> {
         // The buffer is initialized to 0 purposely. To calculate the block hash, the data is
         // 0-padded to the block size. When a chunk read is less than a chunk, the initial value
         // conveniently serves the padding purpose.
         let mut orig_data = [0u8; CHUNK_SIZE as usize];
+        self.file.read_chunk(chunk_index as u64, &mut orig_data)?;
 
-        // If previous data exists, read back and verify against the known hash (since the
-        // storage / remote server is not trusted).
-        if merkle_tree.is_index_valid(output_chunk_index) {
-            self.read_chunk(output_chunk_index as u64, &mut orig_data)?;
-
-            // Verify original content
-            let hash = Sha256Hasher::new()?.update(&orig_data)?.finalize()?;
-            if !merkle_tree.is_consistent(output_chunk_index, &hash) {
-                return Err(io::Error::new(io::ErrorKind::InvalidData, "Inconsistent hash"));
-            }
+        // Verify original content
+        let hash = Sha256Hasher::new()?.update(&orig_data)?.finalize()?;
+        if !merkle_tree.is_consistent(chunk_index, &hash) {
+            return Err(io::Error::new(io::ErrorKind::InvalidData, "Inconsistent hash"));
         }
+        Ok(orig_data)
+    }
+
+    fn new_hash_for_incomplete_write(
+        &self,
+        source: &[u8],
+        offset_from_alignment: usize,
+        output_chunk_index: usize,
+        merkle_tree: &mut MerkleLeaves,
+    ) -> io::Result<Sha256Hash> {
+        // If previous data exists, read it back. Otherwise, the chunk is all zeros.
+        let orig_data = if merkle_tree.is_index_valid(output_chunk_index) {
+            self.read_verified_chunk(output_chunk_index, merkle_tree)?
+        } else {
+            [0u8; CHUNK_SIZE as usize]
+        };
 
         Ok(Sha256Hasher::new()?
             .update(&orig_data[..offset_from_alignment])?
@@ -151,14 +287,16 @@ impl<F: ReadByChunk + RandomWrite> VerifiedFileEditor<F> {
     }
 
     pub fn size(&self) -> u64 {
-        self.merkle_tree.read().unwrap().file_size()
+        let write_buffer = self.write_buffer.lock().unwrap();
+        let size = self.merkle_tree.read().unwrap().file_size();
+        match &*write_buffer {
+            Some(buffer) => size.max(buffer.end()),
+            None => size,
+        }
     }
-}
-
-impl<F: ReadByChunk + RandomWrite> RandomWrite for VerifiedFileEditor<F> {
-    fn write_at(&self, buf: &[u8], offset: u64) -> io::Result<usize> {
-        debug_assert_usize_is_u64();
 
+    /// Writes `buf` at `offset` directly, chunk by chunk. The writes must have been flushed.
+    fn write_through(&self, buf: &[u8], offset: u64) -> io::Result<usize> {
         // The write range may not be well-aligned with the chunk boundary. There are various cases
         // to deal with:
         //  1. A write of a full 4K chunk.
@@ -216,10 +354,39 @@ impl<F: ReadByChunk + RandomWrite> RandomWrite for VerifiedFileEditor<F> {
         }
         Ok(buf.len())
     }
+}
+
+impl<F: ReadByChunk + RandomWrite> RandomWrite for VerifiedFileEditor<F> {
+    fn write_at(&self, buf: &[u8], offset: u64) -> io::Result<usize> {
+        debug_assert_usize_is_u64();
+
+        let mut write_buffer = self.write_buffer.lock().unwrap();
+        if let Some(buffer) = &*write_buffer {
+            if !buffer.can_merge(offset, buf.len())
+                && (buffer.start..=buffer.end()).contains(&offset)
+            {
+                // Make room for the write, keeping the last chunk to merge it into if incomplete.
+                self.flush_buffer(&mut write_buffer, true)?;
+            }
+        }
+        if !matches!(&*write_buffer, Some(buffer) if buffer.can_merge(offset, buf.len())) {
+            self.flush_buffer(&mut write_buffer, false)?;
+            *write_buffer = self.start_buffer(offset, buf.len())?;
+        }
+        match &mut *write_buffer {
+            Some(buffer) => {
+                buffer.merge(buf, offset);
+                Ok(buf.len())
+            }
+            None => self.write_through(buf, offset),
+        }
+    }
 
     fn resize(&self, size: u64) -> io::Result<()> {
         debug_assert_usize_is_u64();
 
+        let mut write_buffer = self.write_buffer.lock().unwrap();
+        self.flush_buffer(&mut write_buffer, false)?;
         let mut merkle_tree = self.merkle_tree.write().unwrap();
         // In case when we are truncating the file, we may need to recalculate the hash of the (new)
         // last chunk. Since the content is provided by the untrusted backend, we need to read the
@@ -235,7 +402,7 @@ impl<F: ReadByChunk + RandomWrite> RandomWrite for VerifiedFileEditor<F> {
             let chunk_index = size / CHUNK_SIZE;
             if new_tail_size > 0 {
                 let mut buf: ChunkBuffer = [0; CHUNK_SIZE as usize];
-                let s = self.read_chunk(chunk_index, &mut buf)?;
+                let s = self.file.read_chunk(chunk_index, &mut buf)?;
                 debug_assert!(new_tail_size <= s);
 
                 let zeros = vec![0; CHUNK_SIZE as usize - new_tail_size];
@@ -256,6 +423,11 @@ impl<F: ReadByChunk + RandomWrite> RandomWrite for VerifiedFileEditor<F> {
 
 impl<F: ReadByChunk + RandomWrite> ReadByChunk for VerifiedFileEditor<F> {
     fn read_chunk(&self, chunk_index: u64, buf: &mut ChunkBuffer) -> io::Result<usize> {
+        let write_buffer = self.write_buffer.lock().unwrap();
+        if let Some(chunk) = write_buffer.as_ref().and_then(|buffer| buffer.chunk(chunk_index)) {
+            buf[..chunk.len()].copy_from_slice(chunk);
+            return Ok(chunk.len());
+        }
         self.file.read_chunk(chunk_index, buf)
     }
 }
@@ -268,22 +440,30 @@ mod tests {
     //  $ fsverity digest foo
     use super::*;
     use anyhow::Result;
-    use std::cell::RefCell;
+    use std::cell::{Cell, RefCell};
     use std::convert::TryInto;
 
     struct InMemoryEditor {
         data: RefCell<Vec<u8>>,
         fail_read: bool,
+        write_count: Cell<usize>,
+        read_count: Cell<usize>,
     }
 
     impl InMemoryEditor {
         pub fn new() -> InMemoryEditor {
-            InMemoryEditor { data: RefCell::new(Vec::new()), fail_read: false }
+            InMemoryEditor {
+                data: RefCell::new(Vec::new()),
+                fail_read: false,
+                write_count: Cell::new(0),
+                read_count: Cell::new(0),
+            }
         }
     }
 
     impl RandomWrite for InMemoryEditor {
         fn write_at(&self, buf: &[u8], offset: u64) -> io::Result<usize> {
+            self.write_count.set(self.write_count.get() + 1);
             let begin: usize =
                 offset.try_into().map_err(|e| io::Error::new(io::ErrorKind::Other, e))?;
             let end = begin + buf.len();
@@ -304,6 +484,7 @@ mod tests {
 
     impl ReadByChunk for InMemoryEditor {
         fn read_chunk(&self, chunk_index: u64, buf: &mut ChunkBuffer) -> io::Result<usize> {
+            self.read_count.set(self.read_count.get() + 1);
             if self.fail_read {
                 return Err(io::Error::new(io::ErrorKind::Other, "test!"));
             }
@@ -479,6 +660,7 @@ mod tests {
     fn test_verified_writer_inconsistent_read() -> Result<()> {
         let file = VerifiedFileEditor::new(InMemoryEditor::new());
         assert_eq!(file.write_at(&[1; 8192], 0)?, 8192);
+        file.flush()?;
 
         // Replace the expected hash of the first/0-th chunk. An incomplete write will fail when it
         // detects the inconsistent read.
@@ -511,12 +693,93 @@ mod tests {
         writer.fail_read = true;
         let file = VerifiedFileEditor::new(writer);
         assert_eq!(file.write_at(&[1; 8192], 0)?, 8192);
+        file.flush()?;
 
         // When a read back is needed, a read failure will fail to write.
         assert!(file.write_at(&[1; 1], 2048).is_err());
         Ok(())
     }
 
+    #[test]
+    fn test_verified_writer_coalesces_sequential_writes() -> Result<()> {
+        let data: Vec<u8> = (0..20000).map(|i| i as u8).collect();
+        let expected = VerifiedFileEditor::new(InMemoryEditor::new());
+        assert_eq!(expected.write_at(&data, 0)?, data.len());
+
+        let file = VerifiedFileEditor::new(InMemoryEditor::new());
+        for (i, piece) in data.chunks(100).enumerate() {
+            assert_eq!(file.write_at(piece, i as u64 * 100)?, piece.len());
+        }
+        // The buffered writes are visible before they are flushed.
+        assert_eq!(file.size(), data.len() as u64);
+        let mut buf = [0; CHUNK_SIZE as usize];
+        assert_eq!(file.read_chunk(4, &mut buf)?, 20000 - 4 * 4096);
+        assert_eq!(&buf[..20000 - 4 * 4096], &data[4 * 4096..]);
+        assert_eq!(file.file.write_count.get(), 0);
+
+        assert_eq!(file.calculate_fsverity_digest()?, expected.calculate_fsverity_digest()?);
+        // Nothing was read back, and everything was forwarded at once.
+        assert_eq!(file.file.read_count.get(), 0);
+        assert_eq!(file.file.write_count.get(), 1);
+        assert_eq!(*file.file.data.borrow(), data);
+        Ok(())
+    }
+
+    #[test]
+    fn test_verified_writer_buffer_overflow() -> Result<()> {
+        let data: Vec<u8> = (0..MAX_BUFFERED_WRITE_SIZE * 3 + 1000).map(|i| i as u8).collect();
+        let expected = VerifiedFileEditor::new(InMemoryEditor::new());
+        assert_eq!(expected.write_at(&data, 0)?, data.len());
+
+        // Unaligned pieces which don't fill up the buffer exactly.
+        let file = VerifiedFileEditor::new(InMemoryEditor::new());
+        for (i, piece) in data.chunks(3000).enumerate() {
+            assert_eq!(file.write_at(piece, i as u64 * 3000)?, piece.len());
+        }
+        assert_eq!(file.calculate_fsverity_digest()?, expected.calculate_fsverity_digest()?);
+        assert_eq!(file.file.read_count.get(), 0);
+        assert_eq!(file.file.write_count.get(), 4);
+        assert_eq!(*file.file.data.borrow(), data);
+        Ok(())
+    }
+
+    #[test]
+    fn test_verified_writer_append_after_flush() -> Result<()> {
+        let data: Vec<u8> = (0..10000).map(|i| i as u8).collect();
+        let expected = VerifiedFileEditor::new(InMemoryEditor::new());
+        assert_eq!(expected.write_at(&data, 0)?, data.len());
+
+        // Appending to an incomplete chunk that was already written reads it back once.
+        let file = VerifiedFileEditor::new(InMemoryEditor::new());
+        assert_eq!(file.write_at(&data[..5000], 0)?, 5000);
+        file.flush()?;
+        assert_eq!(file.write_at(&data[5000..6000], 5000)?, 1000);
+        assert_eq!(file.write_at(&data[6000..], 6000)?, 4000);
+        assert_eq!(file.calculate_fsverity_digest()?, expected.calculate_fsverity_digest()?);
+        assert_eq!(file.file.read_count.get(), 1);
+        assert_eq!(*file.file.data.borrow(), data);
+        Ok(())
+    }
+
+    #[test]
+    fn test_verified_writer_non_sequential_writes() -> Result<()> {
+        let expected = VerifiedFileEditor::new(InMemoryEditor::new());
+        assert_eq!(expected.write_at(&[1; 2048], 0)?, 2048);
+        expected.flush()?;
+        assert_eq!(expected.write_at(&[2; 100], 1000)?, 100);
+        expected.flush()?;
+        assert_eq!(expected.write_at(&[3; 100], 20000)?, 100);
+
+        // A write before the buffered ones flushes them first, and so does one after a gap.
+        let file = VerifiedFileEditor::new(InMemoryEditor::new());
+        assert_eq!(file.write_at(&[1; 2048], 0)?, 2048);
+        assert_eq!(file.write_at(&[2; 100], 1000)?, 100);
+        assert_eq!(file.write_at(&[3; 100], 20000)?, 100);
+        assert_eq!(file.calculate_fsverity_digest()?, expected.calculate_fsverity_digest()?);
+        assert_eq!(*file.file.data.borrow(), *expected.file.data.borrow());
+        Ok(())
+    }
+
     #[test]
     fn test_resize_to_same_size() -> Result<()> {
         let file = VerifiedFileEditor::new(InMemoryEditor::new());
@@ -15,68 +15,45 @@
  */
 
 use libc::EIO;
+use std::cmp::min;
+use std::collections::{BTreeMap, BTreeSet};
 use std::io;
+use std::iter;
+use std::sync::Mutex;
 
 use super::common::{build_fsverity_digest, merkle_tree_height, FsverityError};
 use super::sys::{FS_VERITY_HASH_ALG_SHA256, FS_VERITY_MAGIC};
 use crate::auth::Authenticator;
-use crate::common::{divide_roundup, CHUNK_SIZE};
+use crate::common::{divide_roundup, LruCache, CHUNK_SIZE};
 use crate::crypto::{CryptoError, Sha256Hasher};
 use crate::file::{ChunkBuffer, ReadByChunk};
 
-const ZEROS: [u8; CHUNK_SIZE as usize] = [0u8; CHUNK_SIZE as usize];
-
 // The size of `struct fsverity_formatted_digest` in Linux with SHA-256.
 const SIZE_OF_FSVERITY_FORMATTED_DIGEST_SHA256: usize = 12 + Sha256Hasher::HASH_SIZE;
 
-type HashBuffer = [u8; Sha256Hasher::HASH_SIZE];
+/// The number of verified Merkle tree nodes kept in memory for each file, besides the root node.
+const VERIFIED_NODE_CACHE_SIZE: usize = 256;
 
-fn hash_with_padding(chunk: &[u8], pad_to: usize) -> Result<HashBuffer, CryptoError> {
-    let padding_size = pad_to - chunk.len();
-    Sha256Hasher::new()?.update(&chunk)?.update(&ZEROS[..padding_size])?.finalize()
-}
+/// The number of chunks fetched and verified at once when a file is read sequentially.
+const READAHEAD_CHUNKS: usize = 16;
 
-fn verity_check<T: ReadByChunk>(
-    chunk: &[u8],
-    chunk_index: u64,
-    file_size: u64,
-    merkle_tree: &T,
-) -> Result<HashBuffer, FsverityError> {
-    // The caller should not be able to produce a chunk at the first place if `file_size` is 0. The
-    // current implementation expects to crash when a `ReadByChunk` implementation reads
-    // beyond the file size, including empty file.
-    assert_ne!(file_size, 0);
-
-    let chunk_hash = hash_with_padding(&chunk, CHUNK_SIZE as usize)?;
-
-    fsverity_walk(chunk_index, file_size, merkle_tree)?.try_fold(
-        chunk_hash,
-        |actual_hash, result| {
-            let (merkle_chunk, hash_offset_in_chunk) = result?;
-            let expected_hash =
-                &merkle_chunk[hash_offset_in_chunk..hash_offset_in_chunk + Sha256Hasher::HASH_SIZE];
-            if actual_hash != expected_hash {
-                return Err(FsverityError::CannotVerify);
-            }
-            Ok(hash_with_padding(&merkle_chunk, CHUNK_SIZE as usize)?)
-        },
-    )
+type HashBuffer = [u8; Sha256Hasher::HASH_SIZE];
+
+fn chunks_as_bytes(chunks: &[ChunkBuffer]) -> &[u8] {
+    // Safe because a slice of byte arrays has the same layout as a slice of all the bytes.
+    unsafe {
+        std::slice::from_raw_parts(chunks.as_ptr() as *const u8, chunks.len() * CHUNK_SIZE as usize)
+    }
 }
 
-/// Given a chunk index and the size of the file, returns an iterator that walks the Merkle tree
-/// from the leaf to the root. The iterator carries the slice of the chunk/node as well as the
-/// offset of the child node's hash. It is up to the iterator user to use the node and hash,
-/// e.g. for the actual verification.
-#[allow(clippy::needless_collect)]
-fn fsverity_walk<T: ReadByChunk>(
-    chunk_index: u64,
-    file_size: u64,
-    merkle_tree: &T,
-) -> Result<impl Iterator<Item = Result<([u8; 4096], usize), FsverityError>> + '_, FsverityError> {
+/// Given a chunk index and the size of the file, returns the path in the Merkle tree from the leaf
+/// to the root. Each step carries the index of the node in the tree, as well as the offset of the
+/// child node's hash in it.
+fn merkle_path(chunk_index: u64, file_size: u64) -> Vec<(u64, usize)> {
     let hashes_per_node = CHUNK_SIZE / Sha256Hasher::HASH_SIZE as u64;
     debug_assert_eq!(hashes_per_node, 128u64);
     let max_level = merkle_tree_height(file_size).expect("file should not be empty") as u32;
-    let root_to_leaf_steps = (0..=max_level)
+    let mut root_to_leaf_steps = (0..=max_level)
         .rev()
         .map(|x| {
             let leaves_per_hash = hashes_per_node.pow(x);
@@ -98,16 +75,9 @@ fn fsverity_walk<T: ReadByChunk>(
             let hash_offset_in_chunk = (global_hash_offset % CHUNK_SIZE) as usize;
             (chunk_index, hash_offset_in_chunk)
         })
-        .collect::<Vec<_>>(); // Needs to collect first to be able to reverse below.
-
-    Ok(root_to_leaf_steps.into_iter().rev().map(move |(chunk_index, hash_offset_in_chunk)| {
-        let mut merkle_chunk = [0u8; 4096];
-        // read_chunk is supposed to return a full chunk, or an incomplete one at the end of the
-        // file. In the incomplete case, the hash is calculated with 0-padding to the chunk size.
-        // Therefore, we don't need to check the returned size here.
-        let _ = merkle_tree.read_chunk(chunk_index, &mut merkle_chunk)?;
-        Ok((merkle_chunk, hash_offset_in_chunk))
-    }))
+        .collect::<Vec<_>>();
+    root_to_leaf_steps.reverse();
+    root_to_leaf_steps
 }
 
 fn build_fsverity_formatted_digest(
@@ -129,7 +99,19 @@ pub struct VerifiedFileReader<F: ReadByChunk, M: ReadByChunk> {
     chunked_file: F,
     file_size: u64,
     merkle_tree: M,
-    root_hash: HashBuffer,
+    /// The root node of the Merkle tree, verified against the signature.
+    root_node: ChunkBuffer,
+    /// Merkle tree nodes that have already been verified, so that paths from the leaves don't
+    /// need to be fetched and hashed up to the root each time.
+    verified_nodes: Mutex<LruCache<Box<ChunkBuffer>>>,
+    readahead: Mutex<Readahead>,
+}
+
+struct Readahead {
+    /// Verified chunks that were fetched ahead of the reader, and their sizes.
+    chunks: LruCache<(usize, Box<ChunkBuffer>)>,
+    /// The index of the chunk to be read next if the file is read sequentially.
+    next_index: u64,
 }
 
 impl<F: ReadByChunk, M: ReadByChunk> VerifiedFileReader<F, M> {
@@ -140,32 +122,177 @@ impl<F: ReadByChunk, M: ReadByChunk> VerifiedFileReader<F, M> {
         sig: Vec<u8>,
         merkle_tree: M,
     ) -> Result<VerifiedFileReader<F, M>, FsverityError> {
-        let mut buf = [0u8; CHUNK_SIZE as usize];
-        let size = merkle_tree.read_chunk(0, &mut buf)?;
-        if buf.len() != size {
+        let mut root_node = [0u8; CHUNK_SIZE as usize];
+        let size = merkle_tree.read_chunk(0, &mut root_node)?;
+        if root_node.len() != size {
             return Err(FsverityError::InsufficientData(size));
         }
-        let root_hash = Sha256Hasher::new()?.update(&buf[..])?.finalize()?;
+        let root_hash = Sha256Hasher::new()?.update(&root_node[..])?.finalize()?;
         let formatted_digest = build_fsverity_formatted_digest(&root_hash, file_size)?;
         let valid = authenticator.verify(&sig, &formatted_digest)?;
         if valid {
-            Ok(VerifiedFileReader { chunked_file, file_size, merkle_tree, root_hash })
+            Ok(VerifiedFileReader {
+                chunked_file,
+                file_size,
+                merkle_tree,
+                root_node,
+                verified_nodes: Mutex::new(LruCache::new(VERIFIED_NODE_CACHE_SIZE)),
+                readahead: Mutex::new(Readahead {
+                    chunks: LruCache::new(READAHEAD_CHUNKS * 2),
+                    next_index: 0,
+                }),
+            })
         } else {
             Err(FsverityError::BadSignature)
         }
     }
+
+    /// Returns the indices of the Merkle tree nodes needed to verify the chunks from `start_index`
+    /// to `end_index` (excluded) that have not been verified yet.
+    fn unverified_nodes(&self, start_index: u64, end_index: u64) -> Vec<u64> {
+        let mut verified_nodes = self.verified_nodes.lock().unwrap();
+        let mut unverified_nodes = BTreeSet::new();
+        for chunk_index in start_index..end_index {
+            for (node_index, _) in merkle_path(chunk_index, self.file_size) {
+                // The nodes above are either verified or already in the set too.
+                if node_index == 0
+                    || unverified_nodes.contains(&node_index)
+                    || verified_nodes.get(node_index).is_some()
+                {
+                    break;
+                }
+                unverified_nodes.insert(node_index);
+            }
+        }
+        unverified_nodes.into_iter().collect()
+    }
+
+    /// Checks that `hash` is the hash of the `chunk_index`-th chunk in the Merkle tree. Only the
+    /// nodes below the first verified one on the path to the root are hashed. They are taken from
+    /// `fetched_nodes` if present, or else fetched from the Merkle tree.
+    fn verify_hash(
+        &self,
+        chunk_index: u64,
+        hash: &HashBuffer,
+        fetched_nodes: &BTreeMap<u64, ChunkBuffer>,
+    ) -> Result<(), FsverityError> {
+        let path = merkle_path(chunk_index, self.file_size);
+        let mut nodes = Vec::new();
+        let verified_node = loop {
+            // The root node is the last one on the path, so this ends at the latest there.
+            let (node_index, _) = path[nodes.len()];
+            if node_index == 0 {
+                break self.root_node;
+            }
+            if let Some(node) = self.verified_nodes.lock().unwrap().get(node_index) {
+                break **node;
+            }
+            if let Some(node) = fetched_nodes.get(&node_index) {
+                nodes.push(*node);
+                continue;
+            }
+            // read_chunk is supposed to return a full chunk, or an incomplete one at the end of
+            // the file. In the incomplete case, the hash is calculated with 0-padding to the chunk
+            // size. Therefore, we don't need to check the returned size here.
+            let mut node = [0u8; CHUNK_SIZE as usize];
+            let _ = self.merkle_tree.read_chunk(node_index, &mut node)?;
+            nodes.push(node);
+        };
+        let mut node_hashes = vec![[0u8; Sha256Hasher::HASH_SIZE]; nodes.len()];
+        Sha256Hasher::hash_pages(chunks_as_bytes(&nodes), &mut node_hashes)?;
+
+        // The hash of the chunk must be in the first node at the given offset, the hash of that
+        // node in the next one, and so on up to the verified node.
+        let hashes = iter::once(hash).chain(node_hashes.iter());
+        let parents = nodes.iter().chain(iter::once(&verified_node));
+        for ((hash, parent), &(_, offset)) in hashes.zip(parents).zip(path.iter()) {
+            if hash[..] != parent[offset..offset + Sha256Hasher::HASH_SIZE] {
+                return Err(FsverityError::CannotVerify);
+            }
+        }
+
+        let mut verified_nodes = self.verified_nodes.lock().unwrap();
+        for (&(node_index, _), node) in path.iter().zip(nodes.into_iter()) {
+            verified_nodes.put(node_index, Box::new(node));
+        }
+        Ok(())
+    }
+
+    /// Reads and verifies consecutive chunks from `start_index`, one per buffer in `bufs`. Returns
+    /// the result of each chunk.
+    fn read_verified_chunks(
+        &self,
+        start_index: u64,
+        bufs: &mut [ChunkBuffer],
+    ) -> io::Result<Vec<Result<usize, FsverityError>>> {
+        // Fetch the Merkle tree nodes along with the chunks if the file can.
+        let end_index = start_index + bufs.len() as u64;
+        let unverified_nodes = self.unverified_nodes(start_index, end_index);
+        let (sizes, nodes) =
+            self.chunked_file.read_chunks_with_merkle_tree(start_index, bufs, &unverified_nodes)?;
+        let fetched_nodes: BTreeMap<_, _> =
+            unverified_nodes.into_iter().zip(nodes.into_iter().flatten()).collect();
+        for (buf, &size) in bufs.iter_mut().zip(sizes.iter()) {
+            // The hash is calculated with 0-padding to the chunk size.
+            buf[size..].fill(0);
+        }
+        let mut hashes = vec![[0u8; Sha256Hasher::HASH_SIZE]; bufs.len()];
+        Sha256Hasher::hash_pages(chunks_as_bytes(bufs), &mut hashes)
+            .map_err(|e| io::Error::new(io::ErrorKind::Other, e))?;
+
+        Ok((start_index..)
+            .zip(sizes.into_iter())
+            .zip(hashes.iter())
+            .map(|((chunk_index, size), hash)| {
+                let expected_size = min(self.file_size - chunk_index * CHUNK_SIZE, CHUNK_SIZE);
+                if size as u64 != expected_size {
+                    return Err(FsverityError::InsufficientData(size));
+                }
+                self.verify_hash(chunk_index, hash, &fetched_nodes)?;
+                Ok(size)
+            })
+            .collect())
+    }
 }
 
 impl<F: ReadByChunk, M: ReadByChunk> ReadByChunk for VerifiedFileReader<F, M> {
     fn read_chunk(&self, chunk_index: u64, buf: &mut ChunkBuffer) -> io::Result<usize> {
-        let size = self.chunked_file.read_chunk(chunk_index, buf)?;
-        let root_hash = verity_check(&buf[..size], chunk_index, self.file_size, &self.merkle_tree)
+        let num_chunks = divide_roundup(self.file_size, CHUNK_SIZE);
+        if chunk_index >= num_chunks {
+            return Ok(0);
+        }
+
+        let sequential = {
+            let mut readahead = self.readahead.lock().unwrap();
+            if let Some((size, chunk)) = readahead.chunks.remove(chunk_index) {
+                buf.copy_from_slice(&chunk[..]);
+                readahead.next_index = chunk_index + 1;
+                return Ok(size);
+            }
+            let sequential = chunk_index == readahead.next_index;
+            readahead.next_index = chunk_index + 1;
+            sequential
+        };
+
+        // When the file is read sequentially, fetch and verify the next chunks as well. Only the
+        // failure of the requested chunk is reported, the others are simply not kept.
+        let count =
+            if sequential { min(READAHEAD_CHUNKS as u64, num_chunks - chunk_index) } else { 1 };
+        let mut bufs = vec![[0u8; CHUNK_SIZE as usize]; count as usize];
+        let mut results = self.read_verified_chunks(chunk_index, &mut bufs)?.into_iter();
+        let size = results
+            .next()
+            .unwrap_or(Err(FsverityError::InvalidState))
             .map_err(|_| io::Error::from_raw_os_error(EIO))?;
-        if root_hash != self.root_hash {
-            Err(io::Error::from_raw_os_error(EIO))
-        } else {
-            Ok(size)
+        buf.copy_from_slice(&bufs[0]);
+
+        let mut readahead = self.readahead.lock().unwrap();
+        for ((index, chunk), result) in (chunk_index..).zip(bufs.iter()).zip(results).skip(1) {
+            if let Ok(size) = result {
+                readahead.chunks.put(index, (size, Box::new(*chunk)));
+            }
         }
+        Ok(size)
     }
 }
 
@@ -175,6 +302,7 @@ mod tests {
     use crate::auth::FakeAuthenticator;
     use crate::file::{LocalFileReader, ReadByChunk};
     use anyhow::Result;
+    use std::cell::Cell;
     use std::fs::{self, File};
     use std::io::Read;
 
@@ -247,6 +375,114 @@ mod tests {
         Ok(())
     }
 
+    #[test]
+    fn fsverity_verify_backward_read_4m() -> Result<()> {
+        let (file_reader, file_size) = new_reader_with_fsverity(
+            "testdata/input.4m",
+            "testdata/input.4m.merkle_dump",
+            "testdata/input.4m.fsv_sig",
+        )?;
+
+        for i in (0..total_chunk_number(file_size)).rev() {
+            let mut buf = [0u8; 4096];
+            assert!(file_reader.read_chunk(i, &mut buf).is_ok());
+        }
+        Ok(())
+    }
+
+    #[test]
+    fn fsverity_sequential_read_fetches_each_node_once() -> Result<()> {
+        struct CountingReader {
+            reader: LocalFileReader,
+            reads: Cell<usize>,
+        }
+
+        impl ReadByChunk for CountingReader {
+            fn read_chunk(&self, chunk_index: u64, buf: &mut ChunkBuffer) -> io::Result<usize> {
+                self.reads.set(self.reads.get() + 1);
+                self.reader.read_chunk(chunk_index, buf)
+            }
+        }
+
+        let file_reader = LocalFileReader::new(File::open("testdata/input.4m")?)?;
+        let file_size = file_reader.len();
+        let merkle_tree = CountingReader {
+            reader: LocalFileReader::new(File::open("testdata/input.4m.merkle_dump")?)?,
+            reads: Cell::new(0),
+        };
+        let sig = fs::read("testdata/input.4m.fsv_sig")?;
+        let authenticator = FakeAuthenticator::always_succeed();
+        let file_reader =
+            VerifiedFileReader::new(&authenticator, file_reader, file_size, sig, merkle_tree)?;
+
+        let mut expected = vec![0u8; 4096];
+        let mut content = File::open("testdata/input.4m")?;
+        for i in 0..total_chunk_number(file_size) {
+            let mut buf = [0u8; 4096];
+            assert_eq!(file_reader.read_chunk(i, &mut buf)?, 4096);
+            content.read_exact(&mut expected)?;
+            assert_eq!(&buf[..], &expected[..]);
+        }
+        // The root node and the 8 leaf nodes.
+        assert_eq!(file_reader.merkle_tree.reads.get(), 9);
+        Ok(())
+    }
+
+    #[test]
+    fn fsverity_reads_merkle_tree_along_with_chunks() -> Result<()> {
+        // A file that serves the Merkle tree pages along with its chunks.
+        struct FileWithMerkleTree {
+            file: LocalFileReader,
+            merkle_tree: LocalFileReader,
+        }
+
+        impl ReadByChunk for FileWithMerkleTree {
+            fn read_chunk(&self, chunk_index: u64, buf: &mut ChunkBuffer) -> io::Result<usize> {
+                self.file.read_chunk(chunk_index, buf)
+            }
+
+            fn read_chunks_with_merkle_tree(
+                &self,
+                start_index: u64,
+                bufs: &mut [ChunkBuffer],
+                merkle_tree_indices: &[u64],
+            ) -> io::Result<(Vec<usize>, Option<Vec<ChunkBuffer>>)> {
+                let mut pages = vec![[0u8; 4096]; merkle_tree_indices.len()];
+                for (&index, page) in merkle_tree_indices.iter().zip(pages.iter_mut()) {
+                    self.merkle_tree.read_chunk(index, page)?;
+                }
+                Ok((self.read_chunks(start_index, bufs)?, Some(pages)))
+            }
+        }
+
+        struct RootNodeOnly(LocalFileReader);
+
+        impl ReadByChunk for RootNodeOnly {
+            fn read_chunk(&self, chunk_index: u64, buf: &mut ChunkBuffer) -> io::Result<usize> {
+                assert_eq!(chunk_index, 0, "Merkle tree nodes should come with the chunks");
+                self.0.read_chunk(chunk_index, buf)
+            }
+        }
+
+        let file = FileWithMerkleTree {
+            file: LocalFileReader::new(File::open("testdata/input.4m")?)?,
+            merkle_tree: LocalFileReader::new(File::open("testdata/input.4m.merkle_dump")?)?,
+        };
+        let file_size = file.file.len();
+        let merkle_tree =
+            RootNodeOnly(LocalFileReader::new(File::open("testdata/input.4m.merkle_dump")?)?);
+        let sig = fs::read("testdata/input.4m.fsv_sig")?;
+        let authenticator = FakeAuthenticator::always_succeed();
+        let file_reader =
+            VerifiedFileReader::new(&authenticator, file, file_size, sig, merkle_tree)?;
+
+        for i in 0..total_chunk_number(file_size) {
+            let mut buf = [0u8; 4096];
+            assert!(file_reader.read_chunk(i, &mut buf).is_ok());
+        }
+        Ok(())
+    }
+
     #[test]
     fn fsverity_verify_bad_merkle_tree() -> Result<()> {
         let (file_reader, _) = new_reader_with_fsverity(
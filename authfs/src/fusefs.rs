@@ -89,6 +89,14 @@ impl AuthFs {
     fn get_file_config(&self, inode: &Inode) -> io::Result<&FileConfig> {
         self.file_pool.get(&inode).ok_or_else(|| io::Error::from_raw_os_error(libc::ENOENT))
     }
+
+    /// Writes the buffered writes to the file at `inode`, if it is writable.
+    fn flush_file(&self, inode: &Inode) -> io::Result<()> {
+        match self.get_file_config(inode)? {
+            FileConfig::RemoteVerifiedNewFile { editor } => editor.flush(),
+            _ => Ok(()),
+        }
+    }
 }
 
 fn check_access_mode(flags: u32, mode: libc::c_int) -> io::Result<()> {
@@ -327,6 +335,40 @@ impl FileSystem for AuthFs {
         }
     }
 
+    fn flush(
+        &self,
+        _ctx: Context,
+        inode: Self::Inode,
+        _handle: Self::Handle,
+        _lock_owner: u64,
+    ) -> io::Result<()> {
+        // Called on each close(2), so that errors of the buffered writes can be reported there.
+        self.flush_file(&inode)
+    }
+
+    fn fsync(
+        &self,
+        _ctx: Context,
+        inode: Self::Inode,
+        _datasync: bool,
+        _handle: Self::Handle,
+    ) -> io::Result<()> {
+        self.flush_file(&inode)
+    }
+
+    fn release(
+        &self,
+        _ctx: Context,
+        inode: Self::Inode,
+        _flags: u32,
+        _handle: Self::Handle,
+        _flush: bool,
+        _flock_release: bool,
+        _lock_owner: Option<u64>,
+    ) -> io::Result<()> {
+        self.flush_file(&inode)
+    }
+
     fn setattr(
         &self,
         _ctx: Context,
@@ -22,21 +22,34 @@
 //! Example:
 //! $ compsvc /system/bin/sleep
 //!
+//! Several instances can be running at once with different `--service-name`s, for pvm_exec_batch
+//! to spread tasks across them.
+//!
 //! The current architecture / process hierarchy looks like:
 //! - compsvc (handle requests)
 //!   - compsvc_worker (for environment setup)
 //!     - authfs (fd translation)
 //!     - actual task
+//!
+//! A batch of tasks is run by a single worker, one task after another, with one authfs for all of
+//! them.
 
 use anyhow::{bail, Context, Result};
 use log::error;
 use minijail::{self, Minijail};
+use nix::unistd::pipe;
+use std::collections::{BTreeMap, BTreeSet};
+use std::fs::File;
+use std::io::Read;
+use std::os::unix::io::{FromRawFd, RawFd};
 use std::path::PathBuf;
 
 use compos_aidl_interface::aidl::com::android::compos::ICompService::{
     BnCompService, ICompService,
 };
-use compos_aidl_interface::aidl::com::android::compos::Metadata::Metadata;
+use compos_aidl_interface::aidl::com::android::compos::{
+    Job::Job, JobResult::JobResult, Metadata::Metadata,
+};
 use compos_aidl_interface::binder::{
     add_service, BinderFeatures, Interface, ProcessState, Result as BinderResult, Status,
     StatusCode, Strong,
@@ -49,6 +62,7 @@ const WORKER_BIN: &str = "/system/bin/compsvc_worker";
 const AUTHFS_MOUNTPOINT: &str = "/data/local/tmp/authfs_mnt";
 
 struct CompService {
+    service_name: String,
     worker_bin: PathBuf,
     task_bin: String,
     debuggable: bool,
@@ -59,20 +73,84 @@ impl CompService {
         BnCompService::new_binder(service, BinderFeatures::default())
     }
 
-    fn run_worker_in_jail_and_wait(&self, args: &[String]) -> Result<(), minijail::Error> {
+    fn spawn_worker_in_jail(
+        &self,
+        args: &[String],
+        extra_fds: &[RawFd],
+    ) -> Result<Minijail, minijail::Error> {
         let mut jail = Minijail::new()?;
 
         // TODO(b/185175567): New user and uid namespace when supported. Run as nobody.
         // New mount namespace to isolate the FUSE mount.
         jail.namespace_vfs();
 
-        let inheritable_fds = if self.debuggable {
+        let mut inheritable_fds = if self.debuggable {
             vec![1, 2] // inherit/redirect stdout/stderr for debugging
         } else {
             vec![]
         };
+        inheritable_fds.extend_from_slice(extra_fds);
         let _pid = jail.run(&self.worker_bin, &inheritable_fds, &args)?;
-        jail.wait()
+        Ok(jail)
+    }
+
+    fn run_worker_in_jail_and_wait(&self, args: &[String]) -> Result<(), minijail::Error> {
+        self.spawn_worker_in_jail(args, &[])?.wait()
+    }
+
+    /// Runs the jobs in one worker, and returns the result of each.
+    fn run_batch_in_jail_and_wait(&self, jobs: &[Job]) -> Result<Vec<JobResult>> {
+        let (read_fd, write_fd) = pipe()?;
+        // Safe because the FDs were just created, and nothing else owns them.
+        let (mut results, result_writer) =
+            unsafe { (File::from_raw_fd(read_fd), File::from_raw_fd(write_fd)) };
+
+        let worker_args = self.build_batch_worker_args(jobs, write_fd);
+        let jail = self.spawn_worker_in_jail(&worker_args, &[write_fd])?;
+        // Only the worker writes the results, so the reading ends when it exits.
+        drop(result_writer);
+        let mut output = String::new();
+        let read_result = results.read_to_string(&mut output);
+        let wait_result = jail.wait();
+        read_result.context("Failed to read the results")?;
+        if let Err(e) = wait_result {
+            bail!("Worker failed: {}", e);
+        }
+
+        // See run_tasks in compsvc_worker.rs for the format.
+        let results: Result<Vec<_>> = output
+            .lines()
+            .map(|line| {
+                let mut fields = line.splitn(3, ' ');
+                let (duration_nanos, kind, value) =
+                    match (fields.next(), fields.next(), fields.next()) {
+                        (Some(duration_nanos), Some(kind), Some(value)) => {
+                            (duration_nanos, kind, value)
+                        }
+                        _ => bail!("Invalid result: {}", line),
+                    };
+                let duration_nanos = duration_nanos.parse()?;
+                match kind {
+                    "exit" => Ok(JobResult {
+                        // The exit code is reported as is, within 0..=255.
+                        exit_code: value.parse::<u8>()? as i8,
+                        duration_nanos,
+                        launch_error: None,
+                    }),
+                    "error" => Ok(JobResult {
+                        exit_code: 0,
+                        duration_nanos,
+                        launch_error: Some(value.to_string()),
+                    }),
+                    _ => bail!("Invalid result: {}", line),
+                }
+            })
+            .collect();
+        let results = results?;
+        if results.len() != jobs.len() {
+            bail!("Got {} results for {} jobs", results.len(), jobs.len());
+        }
+        Ok(results)
     }
 
     fn build_worker_args(&self, args: &[String], metadata: &Metadata) -> Vec<String> {
@@ -100,6 +178,62 @@ impl CompService {
         worker_args.extend_from_slice(&args[1..]);
         worker_args
     }
+
+    fn build_batch_worker_args(&self, jobs: &[Job], result_fd: RawFd) -> Vec<String> {
+        let mut worker_args = vec![
+            WORKER_BIN.to_string(),
+            "--authfs-root".to_string(),
+            AUTHFS_MOUNTPOINT.to_string(),
+        ];
+        // Serve each FD once, even if several jobs use it.
+        let mut in_fds = BTreeMap::new();
+        let mut out_fds = BTreeSet::new();
+        for job in jobs {
+            for annotation in &job.metadata.input_fd_annotations {
+                in_fds.insert(annotation.fd, annotation.file_size);
+            }
+            for annotation in &job.metadata.output_fd_annotations {
+                out_fds.insert(annotation.fd);
+            }
+        }
+        for (fd, file_size) in in_fds {
+            worker_args.push("--in-fd".to_string());
+            worker_args.push(format!("{}:{}", fd, file_size));
+        }
+        for fd in out_fds {
+            worker_args.push("--out-fd".to_string());
+            worker_args.push(fd.to_string());
+        }
+        for job in jobs {
+            let metadata = &job.metadata;
+            let fds: Vec<_> = metadata
+                .input_fd_annotations
+                .iter()
+                .map(|annotation| annotation.fd.to_string())
+                .chain(
+                    metadata
+                        .output_fd_annotations
+                        .iter()
+                        .map(|annotation| annotation.fd.to_string()),
+                )
+                .collect();
+            worker_args.push("--task".to_string());
+            worker_args.push(format!("{}:{}", job.args.len(), fds.join(",")));
+        }
+        worker_args.push("--result-fd".to_string());
+        worker_args.push(result_fd.to_string());
+        if self.debuggable {
+            worker_args.push("--debug".to_string());
+        }
+        worker_args.push("--".to_string());
+
+        // As for a single task, only the associated executable is run.
+        for job in jobs {
+            worker_args.push(self.task_bin.clone());
+            worker_args.extend_from_slice(&job.args[1..]);
+        }
+        worker_args
+    }
 }
 
 impl Interface for CompService {}
@@ -120,6 +254,19 @@ impl ICompService for CompService {
             }
         }
     }
+
+    fn executeBatch(&self, jobs: &[Job]) -> BinderResult<Vec<JobResult>> {
+        if jobs.iter().any(|job| job.args.is_empty()) {
+            return Err(Status::from(StatusCode::BAD_VALUE));
+        }
+        if jobs.is_empty() {
+            return Ok(vec![]);
+        }
+        self.run_batch_in_jail_and_wait(jobs).map_err(|e| {
+            error!("Failed to run the batch: {:?}", e);
+            Status::from(StatusCode::UNKNOWN_ERROR)
+        })
+    }
 }
 
 fn parse_args() -> Result<CompService> {
@@ -127,11 +274,16 @@ fn parse_args() -> Result<CompService> {
     let matches = clap::App::new("compsvc")
         .arg(clap::Arg::with_name("debug")
              .long("debug"))
+        .arg(clap::Arg::with_name("service_name")
+             .long("service-name")
+             .value_name("NAME")
+             .takes_value(true))
         .arg(clap::Arg::with_name("task_bin")
              .required(true))
         .get_matches();
 
     Ok(CompService {
+        service_name: matches.value_of("service_name").unwrap_or(SERVICE_NAME).to_string(),
         task_bin: matches.value_of("task_bin").unwrap().to_string(),
         worker_bin: PathBuf::from(WORKER_BIN),
         debuggable: matches.is_present("debug"),
@@ -144,11 +296,12 @@ fn main() -> Result<()> {
     );
 
     let service = parse_args()?;
+    let service_name = service.service_name.clone();
 
     ProcessState::start_thread_pool();
     // TODO: switch to remote binder
-    add_service(SERVICE_NAME, CompService::new_binder(service).as_binder())
-        .with_context(|| format!("Failed to register service {}", SERVICE_NAME))?;
+    add_service(&service_name, CompService::new_binder(service).as_binder())
+        .with_context(|| format!("Failed to register service {}", service_name))?;
     ProcessState::join_thread_pool();
     bail!("Unexpected exit after join_thread_pool")
 }
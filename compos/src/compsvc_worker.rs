@@ -17,14 +17,17 @@
 //! This executable works as a child/worker for the main compsvc service. This worker is mainly
 //! responsible for setting up the execution environment, e.g. to create file descriptors for
 //! remote file access via an authfs mount.
+//!
+//! The worker can also run several tasks one after another with the same authfs mount, and write
+//! the result of each to a file descriptor.
 
-use anyhow::{bail, Result};
+use anyhow::{bail, Context, Result};
 use log::warn;
 use minijail::Minijail;
 use nix::sys::statfs::{statfs, FsType};
 use std::fs::{File, OpenOptions};
-use std::io;
-use std::os::unix::io::AsRawFd;
+use std::io::{self, Write};
+use std::os::unix::io::{AsRawFd, FromRawFd, RawFd};
 use std::path::Path;
 use std::process::exit;
 use std::thread::sleep;
@@ -87,27 +90,27 @@ fn open_authfs_file(authfs_root: &str, basename: PseudoRawFd, writable: bool) ->
     OpenOptions::new().read(true).write(writable).open(format!("{}/{}", authfs_root, basename))
 }
 
-fn open_authfs_files_for_mapping(config: &Config) -> io::Result<Vec<(File, PseudoRawFd)>> {
-    let mut fd_mapping = Vec::with_capacity(config.in_fds.len() + config.out_fds.len());
-
-    let results: io::Result<Vec<_>> = config
-        .in_fds
-        .iter()
-        .map(|conf| Ok((open_authfs_file(&config.authfs_root, conf.fd, false)?, conf.fd)))
-        .collect();
-    fd_mapping.append(&mut results?);
-
-    let results: io::Result<Vec<_>> = config
-        .out_fds
+fn open_authfs_files_for_mapping(config: &Config, task: &Task) -> Result<Vec<(File, PseudoRawFd)>> {
+    task.fds
         .iter()
-        .map(|conf| Ok((open_authfs_file(&config.authfs_root, conf.fd, true)?, conf.fd)))
-        .collect();
-    fd_mapping.append(&mut results?);
-
-    Ok(fd_mapping)
+        .map(|&fd| {
+            let writable = if config.in_fds.iter().any(|conf| conf.fd == fd) {
+                false
+            } else if config.out_fds.iter().any(|conf| conf.fd == fd) {
+                true
+            } else {
+                bail!("FD {} of the task isn't annotated", fd);
+            };
+            Ok((open_authfs_file(&config.authfs_root, fd, writable)?, fd))
+        })
+        .collect()
 }
 
-fn spawn_jailed_task(config: &Config, fd_mapping: Vec<(File, PseudoRawFd)>) -> Result<Minijail> {
+fn spawn_jailed_task(
+    config: &Config,
+    task: &Task,
+    fd_mapping: Vec<(File, PseudoRawFd)>,
+) -> Result<Minijail> {
     // TODO(b/185175567): Run in a more restricted sandbox.
     let jail = Minijail::new()?;
     let mut preserve_fds: Vec<_> = fd_mapping.iter().map(|(f, id)| (f.as_raw_fd(), *id)).collect();
@@ -116,11 +119,40 @@ fn spawn_jailed_task(config: &Config, fd_mapping: Vec<(File, PseudoRawFd)>) -> R
         preserve_fds.push((1, 1));
         preserve_fds.push((2, 2));
     }
-    let _pid =
-        jail.run_remap(&Path::new(&config.args[0]), preserve_fds.as_slice(), &config.args)?;
+    let _pid = jail.run_remap(&Path::new(&task.args[0]), preserve_fds.as_slice(), &task.args)?;
     Ok(jail)
 }
 
+/// Runs `task` and waits for it. Returns its exit code.
+fn run_task(config: &Config, task: &Task) -> Result<u8> {
+    let fd_mapping = open_authfs_files_for_mapping(config, task)?;
+    let jail = spawn_jailed_task(config, task, fd_mapping)?;
+    match jail.wait() {
+        Ok(_) => Ok(0),
+        Err(minijail::Error::ReturnCode(exit_code)) => Ok(exit_code),
+        Err(e) => bail!("Unexpected minijail error: {}", e),
+    }
+}
+
+/// Runs the tasks one after another, and writes a line for each to `results`: how long it took in
+/// nanoseconds, then either `exit` and its exit code, or `error` and why it couldn't be run.
+fn run_tasks(config: &Config, mut results: File) -> Result<()> {
+    for task in &config.tasks {
+        let start_time = Instant::now();
+        let outcome = match run_task(config, task) {
+            Ok(exit_code) => format!("exit {}", exit_code),
+            Err(e) => {
+                warn!("Failed to run {:?}: {:?}", task.args, e);
+                // The results are line-based.
+                format!("error {}", format!("{:#}", e).replace('\n', " "))
+            }
+        };
+        writeln!(results, "{} {}", start_time.elapsed().as_nanos(), outcome)
+            .context("Failed to write the result")?;
+    }
+    Ok(())
+}
+
 struct InFdAnnotation {
     fd: PseudoRawFd,
     file_size: u64,
@@ -130,11 +162,19 @@ struct OutFdAnnotation {
     fd: PseudoRawFd,
 }
 
+/// A task to run, and the file descriptors to pass to it.
+struct Task {
+    args: Vec<String>,
+    fds: Vec<PseudoRawFd>,
+}
+
 struct Config {
     authfs_root: String,
     in_fds: Vec<InFdAnnotation>,
     out_fds: Vec<OutFdAnnotation>,
-    args: Vec<String>,
+    tasks: Vec<Task>,
+    /// Where to write the results of the tasks. If not given, there is a single task.
+    result_fd: Option<RawFd>,
     debuggable: bool,
 }
 
@@ -156,6 +196,18 @@ fn parse_args() -> Result<Config> {
              .multiple(true)
              .takes_value(true)
              .requires("authfs-root"))
+        .arg(clap::Arg::with_name("task")
+             .long("task")
+             .value_name("ARGC:FD,...")
+             .takes_value(true)
+             .multiple(true)
+             .number_of_values(1)
+             .requires("result-fd"))
+        .arg(clap::Arg::with_name("result-fd")
+             .long("result-fd")
+             .value_name("FD")
+             .takes_value(true)
+             .requires("task"))
         .arg(clap::Arg::with_name("debug")
              .long("debug"))
         .arg(clap::Arg::with_name("args")
@@ -191,9 +243,42 @@ fn parse_args() -> Result<Config> {
     let out_fds = results?;
 
     let args: Vec<_> = matches.values_of("args").unwrap().map(|s| s.to_string()).collect();
+    let tasks = match matches.values_of("task") {
+        // Each task takes the next ARGC args, and is given the listed FDs.
+        Some(specs) => {
+            let mut remaining = &args[..];
+            let results: Result<Vec<_>> = specs
+                .map(|spec| {
+                    let (argc, fds) = match spec.find(':') {
+                        Some(index) => (&spec[..index], &spec[index + 1..]),
+                        None => bail!("Invalid task: {}", spec),
+                    };
+                    let argc: usize = argc.parse()?;
+                    if argc == 0 || argc > remaining.len() {
+                        bail!("Invalid number of args for the task: {}", spec);
+                    }
+                    let (task_args, rest) = remaining.split_at(argc);
+                    remaining = rest;
+                    let fds: Result<Vec<_>, _> =
+                        fds.split(',').filter(|fd| !fd.is_empty()).map(str::parse).collect();
+                    Ok(Task { args: task_args.to_vec(), fds: fds? })
+                })
+                .collect();
+            let tasks = results?;
+            if !remaining.is_empty() {
+                bail!("Args left after the last task: {:?}", remaining);
+            }
+            tasks
+        }
+        None => {
+            let fds = in_fds.iter().map(|conf| conf.fd).chain(out_fds.iter().map(|conf| conf.fd));
+            vec![Task { args, fds: fds.collect() }]
+        }
+    };
+    let result_fd = matches.value_of("result-fd").map(str::parse).transpose()?;
     let debuggable = matches.is_present("debug");
 
-    Ok(Config { authfs_root, in_fds, out_fds, args, debuggable })
+    Ok(Config { authfs_root, in_fds, out_fds, tasks, result_fd, debuggable })
 }
 
 fn main() -> Result<()> {
@@ -215,9 +300,20 @@ fn main() -> Result<()> {
     });
 
     wait_until_authfs_ready(&config.authfs_root)?;
-    let fd_mapping = open_authfs_files_for_mapping(&config)?;
 
-    let jail = spawn_jailed_task(&config, fd_mapping)?;
+    if let Some(result_fd) = config.result_fd {
+        // Safe because the FD is passed to this process to write the results to, and nothing
+        // else owns it.
+        let results = unsafe { File::from_raw_fd(result_fd) };
+        let tasks_result = run_tasks(&config, results);
+        drop(authfs_lifetime);
+        return tasks_result;
+    }
+
+    let task = &config.tasks[0];
+    let fd_mapping = open_authfs_files_for_mapping(&config, task)?;
+
+    let jail = spawn_jailed_task(&config, task, fd_mapping)?;
     let jail_result = jail.wait();
 
     // Be explicit about the lifetime, which should last at least until the task is finished.
@@ -24,13 +24,11 @@
 //! Note the immediate argument right after "--" (e.g. "sleep" in the example above) is not really
 //! used. It is only for ergonomics.
 
-use anyhow::{bail, Context, Result};
+mod fd_server;
+
+use anyhow::{Context, Result};
 use log::{error, warn};
-use minijail::Minijail;
-use nix::fcntl::{fcntl, FcntlArg::F_GETFD};
 use nix::sys::stat::fstat;
-use std::os::unix::io::RawFd;
-use std::path::Path;
 use std::process::exit;
 
 use compos_aidl_interface::aidl::com::android::compos::{
@@ -38,51 +36,14 @@ use compos_aidl_interface::aidl::com::android::compos::{
     OutputFdAnnotation::OutputFdAnnotation,
 };
 use compos_aidl_interface::binder::Strong;
+use fd_server::{parse_arg_fd, spawn_fd_server};
 
 static SERVICE_NAME: &str = "compsvc";
-static FD_SERVER_BIN: &str = "/apex/com.android.virt/bin/fd_server";
 
 fn get_local_service() -> Strong<dyn ICompService> {
     compos_aidl_interface::binder::get_interface(SERVICE_NAME).expect("Cannot reach compsvc")
 }
 
-fn spawn_fd_server(metadata: &Metadata, debuggable: bool) -> Result<Minijail> {
-    let mut inheritable_fds = if debuggable {
-        vec![1, 2] // inherit/redirect stdout/stderr for debugging
-    } else {
-        vec![]
-    };
-
-    let mut args = vec![FD_SERVER_BIN.to_string()];
-    for metadata in &metadata.input_fd_annotations {
-        args.push("--ro-fds".to_string());
-        args.push(metadata.fd.to_string());
-        inheritable_fds.push(metadata.fd);
-    }
-    for metadata in &metadata.output_fd_annotations {
-        args.push("--rw-fds".to_string());
-        args.push(metadata.fd.to_string());
-        inheritable_fds.push(metadata.fd);
-    }
-
-    let jail = Minijail::new()?;
-    let _pid = jail.run(Path::new(FD_SERVER_BIN), &inheritable_fds, &args)?;
-    Ok(jail)
-}
-
-fn is_fd_valid(fd: RawFd) -> Result<bool> {
-    let retval = fcntl(fd, F_GETFD)?;
-    Ok(retval >= 0)
-}
-
-fn parse_arg_fd(arg: &str) -> Result<RawFd> {
-    let fd = arg.parse::<RawFd>()?;
-    if !is_fd_valid(fd)? {
-        bail!("Bad FD: {}", fd);
-    }
-    Ok(fd)
-}
-
 struct Config {
     args: Vec<String>,
     metadata: Metadata,
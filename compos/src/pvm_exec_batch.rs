@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//! pvm_exec_batch runs a set of jobs remotely, as pvm_exec does for a single command, spread
+//! across several compsvc instances, e.g. in different PVMs. A single `fd_server` serves the file
+//! descriptors of all the jobs, and the jobs are sent to the instances in batches, each of which
+//! has its file descriptors set up once for all its jobs.
+//!
+//! Each line of the job file is a job: its input FDs, its output FDs, and its command line
+//! arguments, separated by spaces. The FDs are comma-separated, or "-" if there are none.
+//!
+//! Example:
+//! $ cat /data/local/tmp/jobs
+//! 3 4 sleep 10
+//! 5 6 sleep 5
+//! $ adb shell exec 3</dev/zero 4<>/dev/null 5</dev/zero 6<>/dev/null pvm_exec_batch \
+//!     --instance compsvc --instance compsvc_1 --jobs /data/local/tmp/jobs
+//!
+//! The latency of each job is printed once all of them have run.
+
+mod fd_server;
+mod scheduler;
+
+use anyhow::{bail, Context, Result};
+use log::warn;
+use nix::sys::stat::fstat;
+use std::collections::BTreeMap;
+use std::fs;
+use std::process::exit;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use compos_aidl_interface::aidl::com::android::compos::{
+    ICompService::ICompService, InputFdAnnotation::InputFdAnnotation, Job::Job,
+    JobResult::JobResult, Metadata::Metadata, OutputFdAnnotation::OutputFdAnnotation,
+};
+use compos_aidl_interface::binder::{get_interface, Strong};
+use fd_server::{parse_arg_fd, spawn_fd_server};
+
+static DEFAULT_INSTANCE: &str = "compsvc";
+
+/// The default number of jobs sent to an instance at once. The FDs are set up once per batch, but
+/// larger batches leave fewer jobs to steal by the instances that are done first.
+const DEFAULT_BATCH_SIZE: usize = 4;
+
+struct Config {
+    jobs: Vec<Job>,
+    instances: Vec<String>,
+    /// How many batches each instance runs at once.
+    concurrency: usize,
+    batch_size: usize,
+    debuggable: bool,
+}
+
+fn parse_fds(arg: &str) -> Result<Vec<i32>> {
+    if arg == "-" {
+        return Ok(vec![]);
+    }
+    arg.split(',').map(parse_arg_fd).collect()
+}
+
+fn parse_job(line: &str) -> Result<Job> {
+    let mut fields = line.split_whitespace();
+    let (in_fds, out_fds) = match (fields.next(), fields.next()) {
+        (Some(in_fds), Some(out_fds)) => (parse_fds(in_fds)?, parse_fds(out_fds)?),
+        _ => bail!("Missing the FDs of the job"),
+    };
+    let args: Vec<_> = fields.map(|s| s.to_string()).collect();
+    if args.is_empty() {
+        bail!("Missing the args of the job");
+    }
+
+    let results: Result<Vec<_>> = in_fds
+        .into_iter()
+        .map(|fd| Ok(InputFdAnnotation { fd, file_size: fstat(fd)?.st_size }))
+        .collect();
+    let input_fd_annotations = results?;
+    let output_fd_annotations = out_fds.into_iter().map(|fd| OutputFdAnnotation { fd }).collect();
+    Ok(Job { args, metadata: Metadata { input_fd_annotations, output_fd_annotations } })
+}
+
+fn parse_args() -> Result<Config> {
+    #[rustfmt::skip]
+    let matches = clap::App::new("pvm_exec_batch")
+        .arg(clap::Arg::with_name("jobs")
+             .long("jobs")
+             .value_name("FILE")
+             .required(true)
+             .takes_value(true))
+        .arg(clap::Arg::with_name("instance")
+             .long("instance")
+             .value_name("SERVICE")
+             .takes_value(true)
+             .multiple(true)
+             .number_of_values(1))
+        .arg(clap::Arg::with_name("concurrency")
+             .long("concurrency")
+             .value_name("N")
+             .takes_value(true))
+        .arg(clap::Arg::with_name("batch-size")
+             .long("batch-size")
+             .value_name("N")
+             .takes_value(true))
+        .arg(clap::Arg::with_name("debug")
+             .long("debug"))
+        .get_matches();
+
+    // Safe to unwrap since the arg is required by the clap rule
+    let path = matches.value_of("jobs").unwrap();
+    let content = fs::read_to_string(path).with_context(|| format!("Failed to read {}", path))?;
+    let results: Result<Vec<_>> = content
+        .lines()
+        .enumerate()
+        .filter(|(_, line)| !line.trim().is_empty())
+        .map(|(index, line)| parse_job(line).with_context(|| format!("Invalid job {}", index + 1)))
+        .collect();
+    let jobs = results?;
+
+    let instances = match matches.values_of("instance") {
+        Some(values) => values.map(|s| s.to_string()).collect(),
+        None => vec![DEFAULT_INSTANCE.to_string()],
+    };
+    let concurrency = matches.value_of("concurrency").map(str::parse).transpose()?.unwrap_or(1);
+    let batch_size =
+        matches.value_of("batch-size").map(str::parse).transpose()?.unwrap_or(DEFAULT_BATCH_SIZE);
+    if concurrency == 0 || batch_size == 0 {
+        bail!("The concurrency and batch size can't be 0");
+    }
+    let debuggable = matches.is_present("debug");
+
+    Ok(Config { jobs, instances, concurrency, batch_size, debuggable })
+}
+
+/// Returns the annotations of all the FDs of `jobs`, once each.
+fn merge_metadata(jobs: &[Job]) -> Metadata {
+    let mut input_fds = BTreeMap::new();
+    let mut output_fds = BTreeMap::new();
+    for job in jobs {
+        for annotation in &job.metadata.input_fd_annotations {
+            input_fds.insert(annotation.fd, annotation.file_size);
+        }
+        for annotation in &job.metadata.output_fd_annotations {
+            output_fds.insert(annotation.fd, ());
+        }
+    }
+    Metadata {
+        input_fd_annotations: input_fds
+            .into_iter()
+            .map(|(fd, file_size)| InputFdAnnotation { fd, file_size })
+            .collect(),
+        output_fd_annotations: output_fds
+            .into_iter()
+            .map(|(fd, _)| OutputFdAnnotation { fd })
+            .collect(),
+    }
+}
+
+/// Runs `jobs` on `service`. Returns the result of each job, or why it couldn't be run.
+fn execute_batch(service: &dyn ICompService, jobs: &[Job]) -> Vec<Result<JobResult, String>> {
+    let error = match service.executeBatch(jobs) {
+        Ok(results) if results.len() == jobs.len() => return results.into_iter().map(Ok).collect(),
+        Ok(results) => format!("Got {} results for {} jobs", results.len(), jobs.len()),
+        Err(e) => format!("Binder call failed: {}", e),
+    };
+    jobs.iter().map(|_| Err(error.clone())).collect()
+}
+
+fn main() -> Result<()> {
+    // 1. Parse the command line arguments and the jobs.
+    let Config { jobs, instances, concurrency, batch_size, debuggable } = parse_args()?;
+
+    // 2. Spawn and configure a fd_server to serve remote read/write requests for all the jobs.
+    let fd_server_jail = spawn_fd_server(&merge_metadata(&jobs), debuggable)?;
+    let fd_server_lifetime = scopeguard::guard(fd_server_jail, |fd_server_jail| {
+        if let Err(e) = fd_server_jail.kill() {
+            if !matches!(e, minijail::Error::Killed(_)) {
+                warn!("Failed to kill fd_server: {}", e);
+            }
+        }
+    });
+
+    // 3. Spread the jobs across the instances, running `concurrency` batches on each at once.
+    let results: Result<Vec<Strong<dyn ICompService>>> = instances
+        .iter()
+        .map(|name| get_interface(name).with_context(|| format!("Cannot reach {}", name)))
+        .collect();
+    let services = Arc::new(results?);
+    let start_time = Instant::now();
+    let reports =
+        scheduler::run(jobs, instances.len() * concurrency, batch_size, move |worker, jobs| {
+            execute_batch(&*services[worker / concurrency], &jobs)
+        });
+    let total_time = start_time.elapsed();
+
+    // Be explicit about the lifetime, which should last at least until the jobs are finished.
+    drop(fd_server_lifetime);
+
+    // 4. Report the latency of each job.
+    let mut failed = 0;
+    for (index, report) in reports.iter().enumerate() {
+        let instance = &instances[report.worker / concurrency];
+        match &report.result {
+            Ok(JobResult { launch_error: Some(e), .. }) => {
+                println!("Job {} on {}: couldn't be run: {}", index + 1, instance, e);
+                failed += 1;
+            }
+            Ok(result) => {
+                println!(
+                    "Job {} on {}: exit code {}, batch started after {:?}, ran {:?}",
+                    index + 1,
+                    instance,
+                    result.exit_code as u8,
+                    report.batch_wait,
+                    Duration::from_nanos(result.duration_nanos as u64)
+                );
+                if result.exit_code != 0 {
+                    failed += 1;
+                }
+            }
+            Err(e) => {
+                println!("Job {} on {}: {}", index + 1, instance, e);
+                failed += 1;
+            }
+        }
+    }
+    println!("{} jobs, {} failed, in {:?}", reports.len(), failed, total_time);
+
+    if failed > 0 {
+        exit(1);
+    }
+    Ok(())
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//! Spreads a set of jobs across workers, e.g. the compsvc instances and how many jobs each of them
+//! runs at once. Each worker has its own queue of jobs, and once it is empty, steals from the
+//! longest queue of the others, so that the workers that get the quicker jobs take over the jobs
+//! of the others.
+
+use std::collections::VecDeque;
+use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::{Duration, Instant};
+
+/// A job and its index in the job set.
+type IndexedJob<J> = (usize, J);
+
+/// The report of a job that was run.
+pub struct JobReport<R> {
+    /// The worker which ran the job.
+    pub worker: usize,
+    /// From the start of the scheduling until the batch of the job was handed to the worker. The
+    /// jobs of a batch run one after another, so a job also waits for those before it in its
+    /// batch, which isn't included.
+    pub batch_wait: Duration,
+    /// What running the job returned.
+    pub result: R,
+}
+
+struct Queues<J> {
+    queues: Vec<Mutex<VecDeque<IndexedJob<J>>>>,
+}
+
+impl<J> Queues<J> {
+    /// Deals the jobs to the workers in turn.
+    fn new(jobs: Vec<J>, num_workers: usize) -> Self {
+        let mut queues: Vec<_> = (0..num_workers).map(|_| VecDeque::new()).collect();
+        for (index, job) in jobs.into_iter().enumerate() {
+            queues[index % num_workers].push_back((index, job));
+        }
+        Queues { queues: queues.into_iter().map(Mutex::new).collect() }
+    }
+
+    /// Takes up to `max` jobs for `worker` from the front of its queue. If its queue is empty, it
+    /// first steals half of the longest queue of the other workers, from the back. Returns no jobs
+    /// once all the queues are empty.
+    fn take(&self, worker: usize, max: usize) -> Vec<IndexedJob<J>> {
+        loop {
+            {
+                let mut queue = self.queues[worker].lock().unwrap();
+                if !queue.is_empty() {
+                    let size = max.min(queue.len());
+                    return queue.drain(..size).collect();
+                }
+            }
+            let victim = (0..self.queues.len())
+                .filter(|&other| other != worker)
+                .map(|other| (self.queues[other].lock().unwrap().len(), other))
+                .max();
+            let mut stolen = match victim {
+                Some((len, other)) if len > 0 => {
+                    let mut queue = self.queues[other].lock().unwrap();
+                    // The queue may have shrunk since it was measured.
+                    let at = queue.len() / 2;
+                    queue.split_off(at)
+                }
+                _ => return vec![],
+            };
+            let size = max.min(stolen.len());
+            let jobs = stolen.drain(..size).collect();
+            // The rest can be stolen again by the others.
+            self.queues[worker].lock().unwrap().extend(stolen);
+            if size > 0 {
+                return jobs;
+            }
+        }
+    }
+}
+
+/// Runs `jobs` on `num_workers` workers, each taking up to `batch_size` jobs at a time.
+/// `run_batch` runs the jobs of a batch on a worker, and returns the result of each of them in the
+/// same order. The reports are returned in the order of `jobs`.
+pub fn run<J, R, F>(
+    jobs: Vec<J>,
+    num_workers: usize,
+    batch_size: usize,
+    run_batch: F,
+) -> Vec<JobReport<R>>
+where
+    J: Send + 'static,
+    R: Send + 'static,
+    F: Fn(usize, Vec<J>) -> Vec<R> + Send + Sync + 'static,
+{
+    assert!(num_workers > 0 && batch_size > 0);
+    let num_jobs = jobs.len();
+    let start_time = Instant::now();
+    let queues = Arc::new(Queues::new(jobs, num_workers));
+    let run_batch = Arc::new(run_batch);
+    let reports = Arc::new(Mutex::new((0..num_jobs).map(|_| None).collect::<Vec<_>>()));
+
+    let threads: Vec<_> = (0..num_workers)
+        .map(|worker| {
+            let queues = queues.clone();
+            let run_batch = run_batch.clone();
+            let reports = reports.clone();
+            thread::spawn(move || loop {
+                let batch = queues.take(worker, batch_size);
+                if batch.is_empty() {
+                    break;
+                }
+                let batch_wait = start_time.elapsed();
+                let (indices, jobs): (Vec<_>, Vec<_>) = batch.into_iter().unzip();
+                let results = run_batch(worker, jobs);
+                assert_eq!(results.len(), indices.len(), "A result is needed for each job");
+                let mut reports = reports.lock().unwrap();
+                for (index, result) in indices.into_iter().zip(results) {
+                    reports[index] = Some(JobReport { worker, batch_wait, result });
+                }
+            })
+        })
+        .collect();
+    for thread in threads {
+        thread.join().expect("Worker panicked");
+    }
+
+    let reports = Arc::try_unwrap(reports).ok().unwrap().into_inner().unwrap();
+    reports.into_iter().map(|report| report.expect("Job not run")).collect()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::atomic::{AtomicUsize, Ordering};
+
+    /// Runs `num_jobs` jobs, which return their index, and checks that each job was run once and
+    /// in batches of at most `batch_size`. Returns the reports.
+    fn run_jobs(num_jobs: usize, num_workers: usize, batch_size: usize) -> Vec<JobReport<usize>> {
+        let runs = Arc::new((0..num_jobs).map(|_| AtomicUsize::new(0)).collect::<Vec<_>>());
+        let runs_clone = runs.clone();
+        let reports = run((0..num_jobs).collect(), num_workers, batch_size, move |worker, jobs| {
+            assert!(worker < num_workers);
+            assert!(!jobs.is_empty() && jobs.len() <= batch_size);
+            for &job in &jobs {
+                runs_clone[job].fetch_add(1, Ordering::SeqCst);
+            }
+            jobs
+        });
+        for (job, count) in runs.iter().enumerate() {
+            assert_eq!(count.load(Ordering::SeqCst), 1, "Job {} not run once", job);
+        }
+        reports
+    }
+
+    #[test]
+    fn runs_every_job_once() {
+        for &(num_jobs, num_workers, batch_size) in
+            &[(1, 1, 1), (10, 3, 1), (100, 4, 3), (7, 2, 10)]
+        {
+            let reports = run_jobs(num_jobs, num_workers, batch_size);
+            assert_eq!(reports.len(), num_jobs);
+        }
+    }
+
+    #[test]
+    fn reports_in_job_order() {
+        let reports = run_jobs(50, 4, 3);
+        let results: Vec<_> = reports.iter().map(|report| report.result).collect();
+        assert_eq!(results, (0..50).collect::<Vec<_>>());
+    }
+
+    #[test]
+    fn no_jobs() {
+        assert!(run_jobs(0, 3, 2).is_empty());
+    }
+
+    #[test]
+    fn more_workers_than_jobs() {
+        let reports = run_jobs(2, 8, 4);
+        assert_eq!(reports.len(), 2);
+        assert!(reports.iter().all(|report| report.worker < 8));
+    }
+
+    #[test]
+    fn steals_from_longest_queue() {
+        // 0: [0, 3, 6, 9], 1: [1, 4, 7], 2: [2, 5, 8]
+        let queues = Queues::new((0..10).collect::<Vec<_>>(), 3);
+        let indices = |jobs: Vec<IndexedJob<i32>>| jobs.into_iter().map(|(i, _)| i).collect();
+        let take = |worker, max| -> Vec<usize> { indices(queues.take(worker, max)) };
+        assert_eq!(take(2, 1), vec![2]);
+        assert_eq!(take(2, 10), vec![5, 8]);
+        // Worker 2 steals the back half of the queue of worker 0, and keeps what it doesn't take.
+        assert_eq!(take(2, 1), vec![6]);
+        assert_eq!(take(2, 1), vec![9]);
+        assert_eq!(take(0, 10), vec![0, 3]);
+        // The longest queue is now the one of worker 1.
+        assert_eq!(take(0, 10), vec![4, 7]);
+        assert_eq!(take(2, 10), vec![1]);
+        for worker in 0..3 {
+            assert!(take(worker, 10).is_empty());
+        }
+    }
+
+    #[test]
+    fn quick_workers_take_over() {
+        // Worker 0 is stuck on its first job, so worker 1 runs the rest of its queue.
+        let reports = run((0..10).collect(), 2, 1, |worker, jobs: Vec<usize>| {
+            if worker == 0 && jobs[0] == 0 {
+                thread::sleep(Duration::from_millis(500));
+            }
+            jobs
+        });
+        assert_eq!(reports[0].worker, 0);
+        assert!(reports[1..].iter().all(|report| report.worker == 1));
+    }
+}
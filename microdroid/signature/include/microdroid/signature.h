@@ -19,7 +19,7 @@
 #include <android-base/result.h>
 #include <microdroid_signature.pb.h>
 
-#include <iostream>
+#include <cstdint>
 #include <string>
 
 namespace android {
@@ -27,8 +27,15 @@ namespace microdroid {
 
 base::Result<MicrodroidSignature> ReadMicrodroidSignature(const std::string& path);
 
-base::Result<void> WriteMicrodroidSignature(const MicrodroidSignature& signature,
-                                            std::ostream& out);
+// Reads the signature from `fd`, which can be the signature partition itself. Only the length
+// prefix and the body are read, and the body is parsed directly from a mapping of the file.
+base::Result<MicrodroidSignature> ReadMicrodroidSignatureFromFd(int fd);
+
+// Writes the signature to `fd`, which should be an empty file. The body is serialized directly to
+// the file. If `padded_size` is larger than the signature, the file is then padded with zeros to
+// `padded_size` bytes so that it can be used as the signature partition as it is.
+base::Result<void> WriteMicrodroidSignature(const MicrodroidSignature& signature, int fd,
+                                            uint64_t padded_size = 0);
 
 } // namespace microdroid
 } // namespace android
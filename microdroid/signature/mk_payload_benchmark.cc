@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+#include <com_android_apex.h>
+#include <json/json.h>
+
+#include "payload.h"
+
+using android::base::ParseUint;
+using android::base::ReadFileToString;
+using android::base::Split;
+using android::base::unique_fd;
+
+using com::android::apex::readApexInfoList;
+
+namespace {
+
+constexpr uint64_t kMiB = 1024 * 1024;
+
+// A synthetic payload config with `num_apexes` apexes and optionally an apk, all of which are
+// sparse files of `payload_size` bytes. Everything lives in a temporary directory.
+class SyntheticPayload {
+public:
+    SyntheticPayload(int num_apexes, uint64_t payload_size, bool with_apk) {
+        Json::Value root;
+        for (int i = 0; i < num_apexes; i++) {
+            std::string name = "com.android.bench" + std::to_string(i);
+            Json::Value apex;
+            apex["name"] = name;
+            apex["path"] = name + ".apex";
+            root["apexes"].append(apex);
+            CreateSparseFile(name + ".apex", payload_size);
+        }
+        if (with_apk) {
+            root["apk"]["name"] = "com.android.bench";
+            root["apk"]["path"] = "bench.apk";
+            CreateSparseFile("bench.apk", payload_size);
+        }
+        std::ofstream(ConfigFile()) << Json::writeString(Json::StreamWriterBuilder(), root);
+    }
+
+    std::string ConfigFile() const { return Path("payload_config.json"); }
+    std::string SignatureFile() const { return Path("payload-signature.img"); }
+    std::string OutputFile() const { return Path("payload.img"); }
+
+private:
+    std::string Path(const std::string& name) const { return std::string(dir_.path) + "/" + name; }
+
+    void CreateSparseFile(const std::string& name, uint64_t size) {
+        unique_fd fd(open(Path(name).c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0600));
+        if (fd.get() == -1 || ftruncate(fd.get(), size) == -1) {
+            abort();
+        }
+    }
+
+    TemporaryDir dir_;
+};
+
+// I/O counters of this process from /proc/self/io. These include the threads which have exited.
+struct IoStats {
+    uint64_t syscalls;      // read/write syscalls
+    uint64_t bytes_written; // bytes passed to write syscalls
+};
+
+IoStats GetIoStats() {
+    IoStats stats = {};
+    std::string content;
+    if (!ReadFileToString("/proc/self/io", &content)) {
+        return stats;
+    }
+    for (const auto& line : Split(content, "\n")) {
+        auto fields = Split(line, ": ");
+        uint64_t value;
+        if (fields.size() != 3 || !ParseUint(fields[2], &value)) {
+            continue;
+        }
+        if (fields[0] == "syscr" || fields[0] == "syscw") {
+            stats.syscalls += value;
+        } else if (fields[0] == "wchar") {
+            stats.bytes_written += value;
+        }
+    }
+    return stats;
+}
+
+// Reports the I/O done since `start` as per-iteration counters.
+void ReportIoStats(benchmark::State& state, const IoStats& start) {
+    IoStats end = GetIoStats();
+    state.counters["syscalls"] = benchmark::Counter(end.syscalls - start.syscalls,
+                                                    benchmark::Counter::kAvgIterations);
+    state.counters["bytes_written"] = benchmark::Counter(end.bytes_written - start.bytes_written,
+                                                         benchmark::Counter::kAvgIterations);
+}
+
+// Args: number of apexes, payload size in MiB, with apk (0 or 1)
+void PayloadArgs(benchmark::internal::Benchmark* b) {
+    b->ArgNames({"apexes", "size_mb", "apk"});
+    for (int num_apexes : {1, 4, 16, 64}) {
+        for (int size_mb : {1, 64, 1024}) {
+            for (int with_apk : {0, 1}) {
+                b->Args({num_apexes, size_mb, with_apk});
+            }
+        }
+    }
+}
+
+SyntheticPayload CreatePayload(const benchmark::State& state) {
+    return SyntheticPayload(state.range(0), state.range(1) * kMiB, state.range(2) != 0);
+}
+
+// Returns false and skips the benchmark if `result` is an error.
+template <typename T>
+bool CheckResult(benchmark::State& state, const android::base::Result<T>& result) {
+    if (!result.ok()) {
+        state.SkipWithError(result.error().message().c_str());
+        return false;
+    }
+    return true;
+}
+
+void BM_LoadConfig(benchmark::State& state) {
+    auto payload = CreatePayload(state);
+    IoStats start = GetIoStats();
+    for (auto _ : state) {
+        auto config = LoadConfig(payload.ConfigFile());
+        if (!CheckResult(state, config)) {
+            break;
+        }
+        benchmark::DoNotOptimize(config);
+    }
+    ReportIoStats(state, start);
+}
+BENCHMARK(BM_LoadConfig)->Apply(PayloadArgs)->UseRealTime();
+
+// Args: number of system apexes
+void BM_LoadSystemApexes(benchmark::State& state) {
+    auto apex_info_list = readApexInfoList("/apex/apex-info-list.xml");
+    if (!apex_info_list.has_value()) {
+        state.SkipWithError("Can't read /apex/apex-info-list.xml");
+        return;
+    }
+    Config config;
+    for (const auto& apex_info : apex_info_list->getApexInfo()) {
+        if (apex_info.getIsActive() &&
+            static_cast<int64_t>(config.system_apexes.size()) < state.range(0)) {
+            config.system_apexes.push_back(apex_info.getModuleName());
+        }
+    }
+    IoStats start = GetIoStats();
+    for (auto _ : state) {
+        Config copy = config;
+        if (!CheckResult(state, LoadSystemApexes(copy))) {
+            break;
+        }
+        benchmark::DoNotOptimize(copy);
+    }
+    ReportIoStats(state, start);
+}
+BENCHMARK(BM_LoadSystemApexes)->ArgName("apexes")->Arg(1)->Arg(4)->Arg(16)->Arg(64)->UseRealTime();
+
+void BM_LoadPayloads(benchmark::State& state) {
+    auto payload = CreatePayload(state);
+    auto config = LoadConfig(payload.ConfigFile());
+    if (!CheckResult(state, config)) {
+        return;
+    }
+    IoStats start = GetIoStats();
+    for (auto _ : state) {
+        auto payloads = LoadPayloads(*config);
+        if (!CheckResult(state, payloads)) {
+            break;
+        }
+        benchmark::DoNotOptimize(payloads);
+    }
+    ReportIoStats(state, start);
+}
+BENCHMARK(BM_LoadPayloads)->Apply(PayloadArgs)->UseRealTime();
+
+void BM_MakeSignature(benchmark::State& state) {
+    auto payload = CreatePayload(state);
+    auto config = LoadConfig(payload.ConfigFile());
+    if (!CheckResult(state, config)) {
+        return;
+    }
+    auto payloads = LoadPayloads(*config);
+    if (!CheckResult(state, payloads)) {
+        return;
+    }
+    IoStats start = GetIoStats();
+    for (auto _ : state) {
+        if (!CheckResult(state, MakeSignature(*config, *payloads, payload.SignatureFile()))) {
+            break;
+        }
+    }
+    ReportIoStats(state, start);
+}
+BENCHMARK(BM_MakeSignature)->Apply(PayloadArgs)->UseRealTime();
+
+// Measures full builds or, with `incremental`, rebuilds of unchanged payloads.
+void MakePayloadBenchmark(benchmark::State& state, bool incremental) {
+    auto payload = CreatePayload(state);
+    auto config = LoadConfig(payload.ConfigFile());
+    if (!CheckResult(state, config)) {
+        return;
+    }
+    auto payloads = LoadPayloads(*config);
+    if (!CheckResult(state, payloads)) {
+        return;
+    }
+    if (!CheckResult(state, MakeSignature(*config, *payloads, payload.SignatureFile()))) {
+        return;
+    }
+
+    Manifest manifest;
+    Manifest* manifest_ptr = incremental ? &manifest : nullptr;
+    auto make_payload = [&]() {
+        return MakePayload(*payloads, payload.SignatureFile(), payload.OutputFile(), manifest_ptr);
+    };
+    if (incremental && !CheckResult(state, make_payload())) {
+        return;
+    }
+
+    IoStats start = GetIoStats();
+    for (auto _ : state) {
+        if (!CheckResult(state, make_payload())) {
+            break;
+        }
+    }
+    ReportIoStats(state, start);
+}
+
+void BM_MakePayload(benchmark::State& state) {
+    MakePayloadBenchmark(state, /*incremental=*/false);
+}
+BENCHMARK(BM_MakePayload)->Apply(PayloadArgs)->UseRealTime();
+
+void BM_MakePayloadIncremental(benchmark::State& state) {
+    MakePayloadBenchmark(state, /*incremental=*/true);
+}
+BENCHMARK(BM_MakePayloadIncremental)->Apply(PayloadArgs)->UseRealTime();
+
+} // namespace
+
+BENCHMARK_MAIN();
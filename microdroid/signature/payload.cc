@@ -0,0 +1,908 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/endian.h>
+#include <android-base/file.h>
+#include <android-base/hex.h>
+#include <android-base/logging.h>
+#include <android-base/mapped_file.h>
+#include <android-base/result.h>
+#include <com_android_apex.h>
+#include <image_aggregator.h>
+#include <json/json.h>
+#include <libavb/libavb.h>
+#include <ziparchive/zip_archive.h>
+
+#include "microdroid/signature.h"
+#include "payload.h"
+
+using android::base::Dirname;
+using android::base::ErrnoError;
+using android::base::Error;
+using android::base::HexString;
+using android::base::MappedFile;
+using android::base::Result;
+using android::base::unique_fd;
+using android::base::WriteFully;
+using android::microdroid::ApexSignature;
+using android::microdroid::ApkSignature;
+using android::microdroid::MicrodroidSignature;
+using android::microdroid::WriteMicrodroidSignature;
+
+using com::android::apex::ApexInfoList;
+using com::android::apex::readApexInfoList;
+
+using cuttlefish::AlignToPartitionSize;
+using cuttlefish::CreateCompositeDisk;
+using cuttlefish::kLinuxFilesystem;
+using cuttlefish::MultipleImagePartition;
+
+Result<FileInfo> GetFileInfo(const std::string& path) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) == -1) {
+        return ErrnoError() << "Can't lstat " << path;
+    }
+    return FileInfo{
+            .size = static_cast<uint64_t>(st.st_size),
+            .mtime = st.st_mtim.tv_sec * 1'000'000'000LL + st.st_mtim.tv_nsec,
+    };
+}
+
+std::string ToAbsolute(const std::string& path, const std::string& dirname) {
+    bool is_absolute = !path.empty() && path[0] == '/';
+    if (is_absolute) {
+        return path;
+    } else {
+        return dirname + "/" + path;
+    }
+}
+
+std::string AppendFileName(const std::string& filename, const std::string& append) {
+    size_t pos = filename.find_last_of('.');
+    if (pos == std::string::npos) {
+        return filename + append;
+    } else {
+        return filename.substr(0, pos) + append + filename.substr(pos);
+    }
+}
+
+#define DO(expr) \
+    if (auto res = (expr); !res.ok()) return res.error()
+
+Result<void> ParseJson(const Json::Value& value, std::string& s) {
+    if (!value.isString()) {
+        return Error() << "should be a string: " << value;
+    }
+    s = value.asString();
+    return {};
+}
+
+template <typename T>
+Result<void> ParseJson(const Json::Value& value, std::optional<T>& s) {
+    if (value.isNull()) {
+        s.reset();
+        return {};
+    }
+    s.emplace();
+    return ParseJson(value, *s);
+}
+
+Result<void> ParseJson(const Json::Value& value, ApexConfig& apex_config) {
+    DO(ParseJson(value["name"], apex_config.name));
+    DO(ParseJson(value["path"], apex_config.path));
+    DO(ParseJson(value["publicKey"], apex_config.public_key));
+    DO(ParseJson(value["rootDigest"], apex_config.root_digest));
+    return {};
+}
+
+Result<void> ParseJson(const Json::Value& value, ApkConfig& apk_config) {
+    DO(ParseJson(value["name"], apk_config.name));
+    DO(ParseJson(value["path"], apk_config.path));
+    DO(ParseJson(value["idsig"], apk_config.idsig_path));
+    return {};
+}
+
+template <typename T>
+Result<void> ParseJson(const Json::Value& values, std::vector<T>& parsed) {
+    for (const Json::Value& value : values) {
+        T t;
+        DO(ParseJson(value, t));
+        parsed.push_back(std::move(t));
+    }
+    return {};
+}
+
+Result<void> ParseJson(const Json::Value& value, Config& config) {
+    DO(ParseJson(value["system_apexes"], config.system_apexes));
+    DO(ParseJson(value["apexes"], config.apexes));
+    DO(ParseJson(value["apk"], config.apk));
+    return {};
+}
+
+Result<Config> LoadConfig(const std::string& config_file) {
+    std::ifstream in(config_file);
+    Json::CharReaderBuilder builder;
+    Json::Value root;
+    Json::String errs;
+    if (!parseFromStream(builder, in, &root, &errs)) {
+        return Error() << "bad config: " << errs;
+    }
+
+    Config config;
+    config.dirname = Dirname(config_file);
+    DO(ParseJson(root, config));
+    return config;
+}
+
+Result<void> ParseJson(const Json::Value& value, uint64_t& n) {
+    if (!value.isUInt64()) {
+        return Error() << "should be an unsigned integer: " << value;
+    }
+    n = value.asUInt64();
+    return {};
+}
+
+Result<void> ParseJson(const Json::Value& value, int64_t& n) {
+    if (!value.isInt64()) {
+        return Error() << "should be an integer: " << value;
+    }
+    n = value.asInt64();
+    return {};
+}
+
+Result<void> ParseJson(const Json::Value& value, uint32_t& n) {
+    if (!value.isUInt()) {
+        return Error() << "should be an unsigned integer: " << value;
+    }
+    n = value.asUInt();
+    return {};
+}
+
+Result<void> ParseJson(const Json::Value& value, bool& b) {
+    if (!value.isBool()) {
+        return Error() << "should be a boolean: " << value;
+    }
+    b = value.asBool();
+    return {};
+}
+
+Result<void> ParseJson(const Json::Value& value, FileInfo& file_info) {
+    DO(ParseJson(value["size"], file_info.size));
+    DO(ParseJson(value["mtime"], file_info.mtime));
+    return {};
+}
+
+Result<void> ParseJson(const Json::Value& value, RootDigestInfo& root_digest_info) {
+    DO(ParseJson(value, root_digest_info.file_info));
+    DO(ParseJson(value["digest"], root_digest_info.root_digest));
+    return {};
+}
+
+Result<void> ParseJson(const Json::Value& value, PartitionInfo& partition_info) {
+    DO(ParseJson(value["label"], partition_info.label));
+    DO(ParseJson(value["images"], partition_info.image_file_paths));
+    return {};
+}
+
+template <typename T>
+Result<void> ParseJson(const Json::Value& values, std::map<std::string, T>& parsed) {
+    if (values.isNull()) {
+        return {};
+    }
+    if (!values.isObject()) {
+        return Error() << "should be an object: " << values;
+    }
+    for (const auto& key : values.getMemberNames()) {
+        DO(ParseJson(values[key], parsed[key]));
+    }
+    return {};
+}
+
+Result<void> ParseJson(const Json::Value& value, Manifest& manifest) {
+    DO(ParseJson(value["files"], manifest.files));
+    DO(ParseJson(value["fillers"], manifest.fillers));
+    DO(ParseJson(value["partitions"], manifest.partitions));
+    DO(ParseJson(value["root_digests"], manifest.root_digests));
+    return {};
+}
+
+Result<Manifest> LoadManifest(const std::string& manifest_file) {
+    Manifest manifest;
+    if (access(manifest_file.c_str(), F_OK) == -1) {
+        return manifest;
+    }
+
+    std::ifstream in(manifest_file);
+    Json::CharReaderBuilder builder;
+    Json::Value root;
+    Json::String errs;
+    if (!parseFromStream(builder, in, &root, &errs)) {
+        return Error() << "bad manifest: " << errs;
+    }
+    DO(ParseJson(root, manifest));
+    return manifest;
+}
+
+#undef DO
+
+Result<void> SaveManifest(const Manifest& manifest, const std::string& manifest_file) {
+    Json::Value root(Json::objectValue);
+    Json::Value& files = root["files"];
+    for (const auto& [path, file_info] : manifest.files) {
+        files[path]["size"] = Json::UInt64(file_info.size);
+        files[path]["mtime"] = Json::Int64(file_info.mtime);
+    }
+    Json::Value& fillers = root["fillers"];
+    for (const auto& [path, size] : manifest.fillers) {
+        fillers[path] = Json::UInt(size);
+    }
+    Json::Value& partitions = root["partitions"];
+    for (const auto& partition_info : manifest.partitions) {
+        Json::Value partition;
+        partition["label"] = partition_info.label;
+        for (const auto& path : partition_info.image_file_paths) {
+            partition["images"].append(path);
+        }
+        partitions.append(std::move(partition));
+    }
+    Json::Value& root_digests = root["root_digests"];
+    for (const auto& [path, root_digest_info] : manifest.root_digests) {
+        root_digests[path]["size"] = Json::UInt64(root_digest_info.file_info.size);
+        root_digests[path]["mtime"] = Json::Int64(root_digest_info.file_info.mtime);
+        root_digests[path]["digest"] = root_digest_info.root_digest;
+    }
+
+    std::ofstream out(manifest_file);
+    out << Json::writeString(Json::StreamWriterBuilder(), root);
+    if (!out) {
+        return Error() << "Failed to write " << manifest_file;
+    }
+    return {};
+}
+
+// Active apex name to its path
+using ApexIndex = std::unordered_map<std::string, std::string>;
+
+// Returns the index of the active apexes in /apex/apex-info-list.xml. The index is built once and
+// kept across calls until the file is modified.
+Result<std::shared_ptr<const ApexIndex>> GetActiveApexIndex() {
+    static const char* kApexInfoListFile = "/apex/apex-info-list.xml";
+    static std::mutex mutex;
+    static std::shared_ptr<const ApexIndex> cached_index;
+    static FileInfo cached_file_info;
+
+    auto file_info = GetFileInfo(kApexInfoListFile);
+    if (!file_info.ok()) {
+        return Error() << "Failed to read " << kApexInfoListFile << ": " << file_info.error();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (cached_index != nullptr && cached_file_info == *file_info) {
+        return cached_index;
+    }
+
+    std::optional<ApexInfoList> apex_info_list = readApexInfoList(kApexInfoListFile);
+    if (!apex_info_list.has_value()) {
+        return Error() << "Failed to read " << kApexInfoListFile;
+    }
+    auto index = std::make_shared<ApexIndex>();
+    for (const auto& apex_info : apex_info_list->getApexInfo()) {
+        if (apex_info.getIsActive()) {
+            index->emplace(apex_info.getModuleName(), apex_info.getModulePath());
+        }
+    }
+    cached_index = index;
+    cached_file_info = *file_info;
+    return cached_index;
+}
+
+Result<void> LoadSystemApexes(Config& config) {
+    auto index = GetActiveApexIndex();
+    if (!index.ok()) {
+        return index.error();
+    }
+    for (const auto& apex_name : config.system_apexes) {
+        auto it = (*index)->find(apex_name);
+        if (it == (*index)->end()) {
+            return Error() << "Can't find the system apex: " << apex_name;
+        }
+        config.apexes.push_back(ApexConfig{
+                .name = apex_name,
+                .path = it->second,
+                .public_key = std::nullopt,
+                .root_digest = std::nullopt,
+        });
+    }
+    return {};
+}
+
+// Runs `fn(0)`, ..., `fn(n - 1)` on a pool of worker threads. Returns the first error, if any.
+Result<void> ParallelFor(size_t n, const std::function<Result<void>(size_t)>& fn) {
+    const size_t num_workers =
+            std::min<size_t>(n, std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<Result<void>> results(n);
+    std::atomic<size_t> next_index = 0;
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < num_workers; i++) {
+        workers.emplace_back([&]() {
+            for (size_t index; (index = next_index++) < n;) {
+                results[index] = fn(index);
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    for (auto& result : results) {
+        if (!result.ok()) {
+            return result.error();
+        }
+    }
+    return {};
+}
+
+Result<std::vector<Payload>> LoadPayloads(const Config& config) {
+    std::vector<Payload> payloads;
+    for (size_t i = 0; i < config.apexes.size(); i++) {
+        payloads.push_back(Payload{
+                .partition_name = "microdroid-apex-" + std::to_string(i),
+                .path = ToAbsolute(config.apexes[i].path, config.dirname),
+                .file_info = {},
+        });
+    }
+    // TODO(jooyung): partition name("microdroid-apk") is TBD
+    if (config.apk.has_value()) {
+        const std::string apk_path = ToAbsolute(config.apk->path, config.dirname);
+        payloads.push_back(Payload{
+                .partition_name = kApkPartitionName,
+                .path = apk_path,
+                .file_info = {},
+        });
+        // the idsig is only packed when the config asks for it
+        if (config.apk->idsig_path.has_value()) {
+            payloads.push_back(Payload{
+                    .partition_name = kApkIdsigPartitionName,
+                    .path = ToAbsolute(*config.apk->idsig_path, config.dirname),
+                    .file_info = {},
+            });
+        }
+    }
+
+    auto stat_payload = [&](size_t i) -> Result<void> {
+        auto file_info = GetFileInfo(payloads[i].path);
+        if (!file_info.ok()) {
+            return Error() << "I/O error: " << file_info.error();
+        }
+        payloads[i].file_info = *file_info;
+        return {};
+    };
+    if (auto ret = ParallelFor(payloads.size(), stat_payload); !ret.ok()) {
+        return ret.error();
+    }
+    return payloads;
+}
+
+// Reads the root digest of the apex from the AVB hashtree descriptor of its apex_payload.img. The
+// root digest is signed into the vbmeta of the image, so there is no need to hash the image itself;
+// the returned value is what apexd compares against ApexSignature.rootDigest.
+Result<std::string> ReadApexRootDigest(const std::string& apex_path) {
+    unique_fd fd(TEMP_FAILURE_RETRY(open(apex_path.c_str(), O_RDONLY | O_CLOEXEC)));
+    if (fd.get() == -1) {
+        return ErrnoError() << "open(" << apex_path << ") failed.";
+    }
+
+    ZipArchiveHandle handle;
+    if (int32_t ret = OpenArchiveFd(fd.get(), apex_path.c_str(), &handle,
+                                    /*assume_ownership=*/false);
+        ret != 0) {
+        return Error() << "Failed to open " << apex_path << ": " << ErrorCodeString(ret);
+    }
+    std::unique_ptr<ZipArchive, decltype(&CloseArchive)> archive(handle, CloseArchive);
+
+    ZipEntry entry;
+    if (int32_t ret = FindEntry(handle, "apex_payload.img", &entry); ret != 0) {
+        return Error() << "Can't find apex_payload.img in " << apex_path << ": "
+                       << ErrorCodeString(ret);
+    }
+    if (entry.method != kCompressStored) {
+        return Error() << "apex_payload.img in " << apex_path << " is compressed";
+    }
+
+    // Only the pages of the footer and the vbmeta are actually read.
+    auto image = MappedFile::FromFd(fd.get(), entry.offset, entry.uncompressed_length, PROT_READ);
+    if (!image) {
+        return ErrnoError() << "Failed to mmap " << apex_path;
+    }
+    const auto* image_data = reinterpret_cast<const uint8_t*>(image->data());
+    const size_t image_size = image->size();
+
+    AvbFooter footer;
+    if (image_size < AVB_FOOTER_SIZE ||
+        !avb_footer_validate_and_byteswap(reinterpret_cast<const AvbFooter*>(
+                                                  image_data + image_size - AVB_FOOTER_SIZE),
+                                          &footer)) {
+        return Error() << "Invalid AVB footer in " << apex_path;
+    }
+    if (footer.vbmeta_offset > image_size ||
+        footer.vbmeta_size > image_size - footer.vbmeta_offset) {
+        return Error() << "Invalid vbmeta in " << apex_path;
+    }
+
+    std::optional<std::string> root_digest;
+    auto find_root_digest = [](const AvbDescriptor* descriptor, void* user_data) {
+        if (avb_be64toh(descriptor->tag) != AVB_DESCRIPTOR_TAG_HASHTREE) {
+            return true; // continue
+        }
+        AvbHashtreeDescriptor hashtree;
+        if (!avb_hashtree_descriptor_validate_and_byteswap(
+                    reinterpret_cast<const AvbHashtreeDescriptor*>(descriptor), &hashtree)) {
+            return false;
+        }
+        // partition name, salt and root digest follow the descriptor
+        const auto* digest = reinterpret_cast<const uint8_t*>(descriptor) +
+                sizeof(AvbHashtreeDescriptor) + hashtree.partition_name_len + hashtree.salt_len;
+        *static_cast<std::optional<std::string>*>(user_data) =
+                HexString(digest, hashtree.root_digest_len);
+        return false; // found
+    };
+    avb_descriptor_foreach(image_data + footer.vbmeta_offset, footer.vbmeta_size, find_root_digest,
+                           &root_digest);
+    if (!root_digest.has_value()) {
+        return Error() << "Can't find the hashtree descriptor in " << apex_path;
+    }
+    return *root_digest;
+}
+
+Result<void> ComputeRootDigests(Config& config, const std::vector<Payload>& payloads,
+                                Manifest* manifest) {
+    std::vector<std::optional<std::string>> root_digests(config.apexes.size());
+    auto compute_root_digest = [&](size_t i) -> Result<void> {
+        if (config.apexes[i].root_digest.has_value()) {
+            return {};
+        }
+        const auto& payload = payloads[i];
+        if (manifest != nullptr) {
+            auto it = manifest->root_digests.find(payload.path);
+            if (it != manifest->root_digests.end() && it->second.file_info == payload.file_info) {
+                root_digests[i] = it->second.root_digest;
+                return {};
+            }
+        }
+        auto root_digest = ReadApexRootDigest(payload.path);
+        if (!root_digest.ok()) {
+            return root_digest.error();
+        }
+        root_digests[i] = *root_digest;
+        return {};
+    };
+    if (auto ret = ParallelFor(config.apexes.size(), compute_root_digest); !ret.ok()) {
+        return ret.error();
+    }
+
+    std::map<std::string, RootDigestInfo> cache;
+    for (size_t i = 0; i < config.apexes.size(); i++) {
+        if (!root_digests[i].has_value()) {
+            continue;
+        }
+        config.apexes[i].root_digest = root_digests[i];
+        cache[payloads[i].path] = RootDigestInfo{
+                .file_info = payloads[i].file_info,
+                .root_digest = *root_digests[i],
+        };
+    }
+    if (manifest != nullptr) {
+        manifest->root_digests = std::move(cache);
+    }
+    return {};
+}
+
+// The layout of the zip index. See MakeZipIndex().
+struct ZipIndexHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t archive_size;
+    uint32_t num_entries;
+    uint32_t names_size;
+};
+static_assert(sizeof(ZipIndexHeader) == 24);
+
+struct ZipIndexEntry {
+    uint64_t data_offset;
+    uint64_t compressed_size;
+    uint64_t size;
+    uint32_t name_offset;
+    uint32_t name_size;
+    uint32_t mode;
+    uint16_t method;
+    uint16_t flags;
+};
+static_assert(sizeof(ZipIndexEntry) == 40);
+
+constexpr uint32_t kZipIndexVersion = 1;
+constexpr uint16_t kZipIndexHasMode = 1;
+
+// Returns the unix mode of the entry like the zip crate, which zipfuse otherwise reads the
+// archive with, does: the mode is known for archives made on unix and on MS-DOS.
+std::optional<uint32_t> GetUnixMode(const ZipEntry& entry) {
+    const uint32_t attributes = entry.external_file_attributes;
+    switch (entry.version_made_by >> 8) {
+        case 0: { // MS-DOS
+            uint32_t mode = (attributes & 0x10) != 0 ? S_IFDIR | 0775 : S_IFREG | 0664;
+            if ((attributes & 0x01) != 0) { // read-only
+                mode &= 0555;
+            }
+            return mode;
+        }
+        case 3: // unix
+            return attributes >> 16;
+        default:
+            return std::nullopt;
+    }
+}
+
+Result<bool> MakeZipIndex(const std::string& zip_path, const std::string& index_file) {
+    auto zip_info = GetFileInfo(zip_path);
+    if (!zip_info.ok()) {
+        return Error() << "I/O error: " << zip_info.error();
+    }
+
+    ZipArchiveHandle handle;
+    int32_t ret = OpenArchive(zip_path.c_str(), &handle);
+    // the handle is to be closed even when the archive fails to open
+    std::unique_ptr<ZipArchive, decltype(&CloseArchive)> archive(handle, CloseArchive);
+    if (ret != 0) {
+        return Error() << "Failed to open " << zip_path << ": " << ErrorCodeString(ret);
+    }
+
+    void* cookie;
+    if (ret = StartIteration(handle, &cookie); ret != 0) {
+        return Error() << "Failed to iterate " << zip_path << ": " << ErrorCodeString(ret);
+    }
+    std::unique_ptr<void, decltype(&EndIteration)> iteration(cookie, EndIteration);
+
+    // libziparchive iterates the entries in no particular order
+    std::map<std::string, ZipEntry> entries;
+    ZipEntry entry;
+    std::string name;
+    while ((ret = Next(cookie, &entry, &name)) == 0) {
+        if (entry.method != kCompressStored && entry.method != kCompressDeflated) {
+            // zipfuse can still mount the archive by parsing its central directory
+            LOG(INFO) << "Not indexing " << zip_path << ": " << name
+                      << " is compressed with an unsupported method: " << entry.method;
+            return false;
+        }
+        entries.emplace(std::move(name), entry);
+    }
+    if (ret != -1) { // the end of the iteration
+        return Error() << "Failed to iterate " << zip_path << ": " << ErrorCodeString(ret);
+    }
+
+    std::string names;
+    std::vector<ZipIndexEntry> index_entries;
+    index_entries.reserve(entries.size());
+    for (const auto& [entry_name, zip_entry] : entries) {
+        const auto mode = GetUnixMode(zip_entry);
+        index_entries.push_back(ZipIndexEntry{
+                .data_offset = htole64(zip_entry.offset),
+                .compressed_size = htole64(zip_entry.compressed_length),
+                .size = htole64(zip_entry.uncompressed_length),
+                .name_offset = htole32(static_cast<uint32_t>(names.size())),
+                .name_size = htole32(static_cast<uint32_t>(entry_name.size())),
+                .mode = htole32(mode.value_or(0)),
+                .method = htole16(zip_entry.method),
+                .flags = htole16(mode.has_value() ? kZipIndexHasMode : 0),
+        });
+        names += entry_name;
+    }
+    ZipIndexHeader header = {
+            .magic = {'Z', 'F', 'I', 'X'},
+            .version = htole32(kZipIndexVersion),
+            .archive_size = htole64(zip_info->size),
+            .num_entries = htole32(static_cast<uint32_t>(index_entries.size())),
+            .names_size = htole32(static_cast<uint32_t>(names.size())),
+    };
+
+    unique_fd fd(TEMP_FAILURE_RETRY(
+            open(index_file.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644)));
+    if (fd.get() == -1) {
+        return ErrnoError() << "open(" << index_file << ") failed.";
+    }
+    if (!WriteFully(fd.get(), &header, sizeof(header)) ||
+        !WriteFully(fd.get(), index_entries.data(),
+                    index_entries.size() * sizeof(ZipIndexEntry)) ||
+        !WriteFully(fd.get(), names.data(), names.size())) {
+        return ErrnoError() << "write(" << index_file << ") failed.";
+    }
+    return true;
+}
+
+Result<void> AddApkZipIndex(std::vector<Payload>& payloads, const std::string& index_file,
+                            const Manifest* manifest) {
+    auto apk = std::find_if(payloads.begin(), payloads.end(), [](const auto& payload) {
+        return payload.partition_name == kApkPartitionName;
+    });
+    if (apk == payloads.end()) {
+        return Error() << "No apk in the payloads";
+    }
+    const std::string apk_path = apk->path;
+    const bool reuse_index = manifest != nullptr && manifest->IsUpToDate(apk_path) &&
+            manifest->IsUpToDate(index_file);
+    if (!reuse_index) {
+        auto ret = MakeZipIndex(apk_path, index_file);
+        if (!ret.ok()) {
+            return ret.error();
+        }
+        if (!*ret) {
+            return {};
+        }
+    }
+    auto file_info = GetFileInfo(index_file);
+    if (!file_info.ok()) {
+        return Error() << "I/O error: " << file_info.error();
+    }
+    payloads.push_back(Payload{
+            .partition_name = kApkZipIndexPartitionName,
+            .path = index_file,
+            .file_info = *file_info,
+    });
+    return {};
+}
+
+Result<void> MakeSignature(const Config& config, const std::vector<Payload>& payloads,
+                           const std::string& filename) {
+    MicrodroidSignature signature;
+    signature.set_version(1);
+
+    for (size_t i = 0; i < config.apexes.size(); i++) {
+        const auto& apex_config = config.apexes[i];
+        ApexSignature* apex_signature = signature.add_apexes();
+
+        // name
+        apex_signature->set_name(apex_config.name);
+
+        // size
+        apex_signature->set_size(static_cast<uint32_t>(payloads[i].file_info.size));
+
+        // publicKey
+        if (apex_config.public_key.has_value()) {
+            apex_signature->set_publickey(apex_config.public_key.value());
+        }
+
+        // rootDigest
+        if (apex_config.root_digest.has_value()) {
+            apex_signature->set_rootdigest(apex_config.root_digest.value());
+        }
+    }
+
+    if (config.apk.has_value()) {
+        ApkSignature* apk_signature = signature.mutable_apk();
+        apk_signature->set_name(config.apk->name);
+        // the apk and its companions follow the apexes
+        for (size_t i = config.apexes.size(); i < payloads.size(); i++) {
+            const auto& payload = payloads[i];
+            if (payload.partition_name == kApkPartitionName) {
+                apk_signature->set_size(static_cast<uint32_t>(payload.file_info.size));
+                apk_signature->set_payload_partition_name(payload.partition_name);
+            } else if (payload.partition_name == kApkIdsigPartitionName) {
+                apk_signature->set_idsig_partition_name(payload.partition_name);
+            } else if (payload.partition_name == kApkZipIndexPartitionName) {
+                apk_signature->set_zip_index_partition_name(payload.partition_name);
+            }
+        }
+    }
+
+    // the signature is padded so that it fills up the signature partition.
+    unique_fd fd(TEMP_FAILURE_RETRY(
+            open(filename.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644)));
+    if (fd.get() == -1) {
+        return ErrnoError() << "open(" << filename << ") failed.";
+    }
+    const uint64_t padded_size = AlignToPartitionSize(sizeof(uint32_t) + signature.ByteSizeLong());
+    return WriteMicrodroidSignature(signature, fd.get(), padded_size);
+}
+
+uint64_t GetFillerSize(uint32_t file_size) {
+    return AlignToPartitionSize(file_size + sizeof(uint32_t)) - file_size;
+}
+
+// Generates a filler, which is a hole followed by the size trailer.
+Result<void> GenerateFiller(uint32_t file_size, const std::string& filler_path) {
+    unique_fd fd(TEMP_FAILURE_RETRY(open(filler_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0600)));
+    if (fd.get() == -1) {
+        return ErrnoError() << "open(" << filler_path << ") failed.";
+    }
+    if (ftruncate(fd.get(), GetFillerSize(file_size)) == -1) {
+        return ErrnoError() << "ftruncate(" << filler_path << ") failed.";
+    }
+    uint32_t size = htobe32(file_size);
+    if (lseek(fd.get(), -sizeof(size), SEEK_END) == -1) {
+        return ErrnoError() << "lseek(" << filler_path << ") failed.";
+    }
+    if (write(fd.get(), &size, sizeof(size)) <= 0) {
+        return ErrnoError() << "write(" << filler_path << ") failed.";
+    }
+    return {};
+}
+
+Result<void> MakePayload(const std::vector<Payload>& payloads, const std::string& signature_file,
+                         const std::string& output_file, Manifest* manifest) {
+    std::vector<MultipleImagePartition> partitions;
+    Manifest new_manifest;
+
+    // records the size/mtime of the file in the new manifest
+    auto record = [&](const std::string& path) -> Result<void> {
+        auto file_info = GetFileInfo(path);
+        if (!file_info.ok()) {
+            return Error() << "I/O error: " << file_info.error();
+        }
+        new_manifest.files[path] = *file_info;
+        return {};
+    };
+
+    if (auto ret = record(signature_file); !ret.ok()) {
+        return ret.error();
+    }
+
+    // put signature at the first partition
+    partitions.push_back(MultipleImagePartition{
+            .label = "signature",
+            .image_file_paths = {signature_file},
+            .type = kLinuxFilesystem,
+            .read_only = true,
+    });
+
+    // generate fillers for the payloads in parallel
+    std::vector<std::string> filler_paths(payloads.size());
+    std::vector<FileInfo> filler_infos(payloads.size());
+    auto generate_filler = [&](size_t i) -> Result<void> {
+        const auto file_size = static_cast<uint32_t>(payloads[i].file_info.size);
+        const std::string& filler_path = filler_paths[i] = output_file + "." + std::to_string(i);
+
+        // the filler is still valid if it was generated for the same payload size
+        bool reuse_filler = false;
+        if (manifest != nullptr) {
+            auto it = manifest->fillers.find(filler_path);
+            reuse_filler = it != manifest->fillers.end() && it->second == file_size &&
+                    manifest->IsUpToDate(filler_path);
+        }
+        if (!reuse_filler) {
+            if (auto ret = GenerateFiller(file_size, filler_path); !ret.ok()) {
+                return ret.error();
+            }
+        }
+        auto filler_info = GetFileInfo(filler_path);
+        if (!filler_info.ok()) {
+            return Error() << "I/O error: " << filler_info.error();
+        }
+        filler_infos[i] = *filler_info;
+        return {};
+    };
+    if (auto ret = ParallelFor(payloads.size(), generate_filler); !ret.ok()) {
+        return ret.error();
+    }
+
+    // put apexes and apk at the subsequent partitions with their fillers
+    for (size_t i = 0; i < payloads.size(); i++) {
+        const auto& payload = payloads[i];
+        new_manifest.files[payload.path] = payload.file_info;
+        const auto& filler_path = filler_paths[i];
+        new_manifest.files[filler_path] = filler_infos[i];
+        new_manifest.fillers[filler_path] = static_cast<uint32_t>(payload.file_info.size);
+        partitions.push_back(MultipleImagePartition{
+                .label = payload.partition_name,
+                .image_file_paths = {payload.path, filler_path},
+                .type = kLinuxFilesystem,
+                .read_only = true,
+        });
+    }
+
+    for (const auto& partition : partitions) {
+        new_manifest.partitions.push_back(PartitionInfo{
+                .label = partition.label,
+                .image_file_paths = partition.image_file_paths,
+        });
+    }
+
+    const std::string gpt_header = AppendFileName(output_file, "-header");
+    const std::string gpt_footer = AppendFileName(output_file, "-footer");
+
+    // The composite disk is still valid if the partitions are backed by the same images of the
+    // same sizes and if none of the generated files has been touched since.
+    auto is_composite_disk_up_to_date = [&]() {
+        if (manifest == nullptr || manifest->partitions != new_manifest.partitions) {
+            return false;
+        }
+        for (const auto& partition : new_manifest.partitions) {
+            for (const auto& path : partition.image_file_paths) {
+                auto it = manifest->files.find(path);
+                if (it == manifest->files.end() ||
+                    it->second.size != new_manifest.files[path].size) {
+                    return false;
+                }
+            }
+        }
+        return manifest->IsUpToDate(gpt_header) && manifest->IsUpToDate(gpt_footer) &&
+                manifest->IsUpToDate(output_file);
+    };
+    if (!is_composite_disk_up_to_date()) {
+        CreateCompositeDisk(partitions, gpt_header, gpt_footer, output_file);
+    }
+
+    for (const auto& path : {gpt_header, gpt_footer, output_file}) {
+        if (auto ret = record(path); !ret.ok()) {
+            return ret.error();
+        }
+    }
+    if (manifest != nullptr) {
+        // root digests are maintained by ComputeRootDigests
+        new_manifest.root_digests = std::move(manifest->root_digests);
+        *manifest = std::move(new_manifest);
+    }
+    return {};
+}
+
+std::string GetManifestFile(const std::string& output_file) {
+    return output_file + ".manifest";
+}
+
+Result<void> BuildPayload(Config config, const std::string& output_file,
+                          const BuildOptions& options, Manifest* manifest) {
+    if (auto ret = LoadSystemApexes(config); !ret.ok()) {
+        return ret.error();
+    }
+
+    auto payloads = LoadPayloads(config);
+    if (!payloads.ok()) {
+        return payloads.error();
+    }
+
+    if (options.compute_root_digests) {
+        if (auto ret = ComputeRootDigests(config, *payloads, manifest); !ret.ok()) {
+            return ret.error();
+        }
+    }
+
+    if (options.apk_zip_index && config.apk.has_value()) {
+        const std::string index_file = AppendFileName(output_file, "-apk-index");
+        if (auto ret = AddApkZipIndex(*payloads, index_file, manifest); !ret.ok()) {
+            return ret.error();
+        }
+    }
+
+    const std::string signature_file = AppendFileName(output_file, "-signature");
+    if (auto ret = MakeSignature(config, *payloads, signature_file); !ret.ok()) {
+        return ret.error();
+    }
+    return MakePayload(*payloads, signature_file, output_file, manifest);
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <android-base/result.h>
+
+struct FileInfo {
+    uint64_t size;
+    int64_t mtime; // in nanoseconds
+
+    bool operator==(const FileInfo& other) const {
+        return size == other.size && mtime == other.mtime;
+    }
+};
+
+android::base::Result<FileInfo> GetFileInfo(const std::string& path);
+
+// Returns `append` is appended to the end of filename preserving the extension.
+std::string AppendFileName(const std::string& filename, const std::string& append);
+
+struct ApexConfig {
+    std::string name; // the apex name
+    std::string path; // the path to the apex file
+                      // absolute or relative to the config file
+    std::optional<std::string> public_key;
+    std::optional<std::string> root_digest;
+};
+
+struct ApkConfig {
+    std::string name;
+    // TODO(jooyung): find path/idsig with name
+    std::string path;
+    // the path to the v4 signature (.idsig) of the apk, absolute or relative to the config file.
+    // Optional: the idsig is packed only when it is given.
+    std::optional<std::string> idsig_path;
+};
+
+// The partitions of the apk and its companions, which follow the partitions of the apexes.
+inline constexpr char kApkPartitionName[] = "microdroid-apk";
+inline constexpr char kApkIdsigPartitionName[] = "microdroid-apk-idsig";
+inline constexpr char kApkZipIndexPartitionName[] = "microdroid-apk-index";
+
+struct Config {
+    std::string dirname; // config file's direname to resolve relative paths in the config
+
+    std::vector<std::string> system_apexes;
+    std::vector<ApexConfig> apexes;
+    std::optional<ApkConfig> apk;
+};
+
+struct PartitionInfo {
+    std::string label;
+    std::vector<std::string> image_file_paths;
+
+    bool operator==(const PartitionInfo& other) const {
+        return label == other.label && image_file_paths == other.image_file_paths;
+    }
+};
+
+struct RootDigestInfo {
+    FileInfo file_info; // of the apex the root digest was read from
+    std::string root_digest;
+};
+
+// Manifest of an incremental build. It is kept next to the output so that the next build can
+// tell which of the generated files are still valid. Note that fillers and the composite disk
+// depend only on the sizes of the inputs, not on their contents.
+struct Manifest {
+    // size/mtime of the inputs and the generated files
+    std::map<std::string, FileInfo> files;
+    // filler path to the size of the payload it was generated for
+    std::map<std::string, uint32_t> fillers;
+    // the partitions of the composite disk
+    std::vector<PartitionInfo> partitions;
+    // apex path to its root digest (with --compute-root-digests)
+    std::map<std::string, RootDigestInfo> root_digests;
+
+    // Returns true if the file is unchanged since it was recorded in the manifest.
+    bool IsUpToDate(const std::string& path) const {
+        auto it = files.find(path);
+        if (it == files.end()) {
+            return false;
+        }
+        auto file_info = GetFileInfo(path);
+        return file_info.ok() && *file_info == it->second;
+    }
+};
+
+// A payload file (APEX or APK) which goes to its own partition of the payload disk.
+struct Payload {
+    std::string partition_name;
+    std::string path; // absolute path to the file
+    FileInfo file_info;
+};
+
+android::base::Result<Config> LoadConfig(const std::string& config_file);
+
+// Resolves `config.system_apexes` to the active apexes and adds them to `config.apexes`. The list
+// of the active apexes is parsed once and cached until /apex/apex-info-list.xml is modified.
+android::base::Result<void> LoadSystemApexes(Config& config);
+
+// Loads the manifest of the previous build. Returns an empty manifest when there is none.
+android::base::Result<Manifest> LoadManifest(const std::string& manifest_file);
+
+android::base::Result<void> SaveManifest(const Manifest& manifest,
+                                         const std::string& manifest_file);
+
+// Resolves and stats the payload files of the config: the apexes first and then the apk and its
+// idsig, in the order of the partitions. The files are stat-ed once here, in parallel, so that the
+// signature and the fillers are generated from the same result.
+android::base::Result<std::vector<Payload>> LoadPayloads(const Config& config);
+
+// Fills in the root digests of the apexes which don't have one in the config. When `manifest` is
+// given, root digests are cached in it by the (path, size, mtime) of the apexes.
+android::base::Result<void> ComputeRootDigests(Config& config,
+                                               const std::vector<Payload>& payloads,
+                                               Manifest* manifest);
+
+// Generates `index_file`, the index of the entries of the zip archive `zip_path`, which zipfuse can
+// mmap instead of parsing the central directory of the archive. All the integers are little-endian:
+//
+//   header:  magic "ZFIX", version (u32, 1), size of the archive (u64), number of entries (u32),
+//            size of the names (u32)
+//   entries: offset of the data (u64), compressed size (u64), size (u64), offset of the name in
+//            the names (u32), size of the name (u32), unix mode (u32), compression method (u16),
+//            flags (u16, 1: the unix mode is known)
+//   names:   the names of the entries, not terminated. Names of directories end with '/'.
+//
+// The entries are sorted by name. Only stored and deflated entries are supported: returns false
+// without generating `index_file` when the archive has other entries.
+android::base::Result<bool> MakeZipIndex(const std::string& zip_path,
+                                         const std::string& index_file);
+
+// Adds the partition "microdroid-apk-index", the zip index of the apk (see MakeZipIndex()) to
+// `payloads`, which should have the apk. The partition is left out when the apk can't be indexed.
+// When `manifest` is given, the index of the previous build is reused if neither the apk nor the
+// index has been modified since.
+android::base::Result<void> AddApkZipIndex(std::vector<Payload>& payloads,
+                                           const std::string& index_file,
+                                           const Manifest* manifest);
+
+android::base::Result<void> MakeSignature(const Config& config,
+                                          const std::vector<Payload>& payloads,
+                                          const std::string& filename);
+
+// Creates the payload composite disk. When `manifest` is given, it should hold the manifest of the
+// previous build: generated files which are still valid are reused, and `manifest` is updated to
+// describe the new build.
+android::base::Result<void> MakePayload(const std::vector<Payload>& payloads,
+                                        const std::string& signature_file,
+                                        const std::string& output_file, Manifest* manifest);
+
+struct BuildOptions {
+    // see ComputeRootDigests()
+    bool compute_root_digests = false;
+    // see AddApkZipIndex()
+    bool apk_zip_index = false;
+};
+
+// Returns the path of the manifest of incremental builds of `output_file`.
+std::string GetManifestFile(const std::string& output_file);
+
+// Builds the payload disk `output_file`, the signature and the fillers next to it from `config`,
+// which is taken by value because system apexes and root digests are added to it. When `manifest`
+// is given, the build is incremental (see MakePayload()).
+android::base::Result<void> BuildPayload(Config config, const std::string& output_file,
+                                         const BuildOptions& options, Manifest* manifest);
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <android-base/endian.h>
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+#include <ziparchive/zip_writer.h>
+
+#include "payload.h"
+
+using android::base::ReadFileToString;
+using android::base::WriteStringToFile;
+
+namespace {
+
+constexpr size_t kHeaderSize = 24;
+constexpr size_t kEntrySize = 40;
+
+constexpr uint16_t kStored = 0;
+constexpr uint16_t kDeflated = 8;
+constexpr uint16_t kBzip2 = 12;
+
+uint16_t ReadU16(const std::string& buf, size_t offset) {
+    uint16_t value;
+    memcpy(&value, buf.data() + offset, sizeof(value));
+    return le16toh(value);
+}
+
+uint32_t ReadU32(const std::string& buf, size_t offset) {
+    uint32_t value;
+    memcpy(&value, buf.data() + offset, sizeof(value));
+    return le32toh(value);
+}
+
+uint64_t ReadU64(const std::string& buf, size_t offset) {
+    uint64_t value;
+    memcpy(&value, buf.data() + offset, sizeof(value));
+    return le64toh(value);
+}
+
+struct ZipContent {
+    std::string name;
+    std::string data;
+    bool compress;
+};
+
+void WriteZip(const std::string& path, const std::vector<ZipContent>& contents) {
+    FILE* file = fopen(path.c_str(), "wb");
+    ASSERT_NE(file, nullptr);
+    ZipWriter writer(file);
+    for (const auto& content : contents) {
+        ASSERT_EQ(writer.StartEntry(content.name, content.compress ? ZipWriter::kCompress : 0), 0);
+        ASSERT_EQ(writer.WriteBytes(content.data.data(), content.data.size()), 0);
+        ASSERT_EQ(writer.FinishEntry(), 0);
+    }
+    ASSERT_EQ(writer.Finish(), 0);
+    ASSERT_EQ(fclose(file), 0);
+}
+
+// An entry of the index, as zipfuse reads it.
+struct IndexEntry {
+    std::string name;
+    uint64_t data_offset;
+    uint64_t compressed_size;
+    uint64_t size;
+    uint16_t method;
+};
+
+std::vector<IndexEntry> ParseIndex(const std::string& index, uint64_t archive_size) {
+    EXPECT_GE(index.size(), kHeaderSize);
+    EXPECT_EQ(index.substr(0, 4), "ZFIX");
+    EXPECT_EQ(ReadU32(index, 4), 1u);
+    EXPECT_EQ(ReadU64(index, 8), archive_size);
+    const uint32_t num_entries = ReadU32(index, 16);
+    const uint32_t names_size = ReadU32(index, 20);
+    const size_t names_offset = kHeaderSize + num_entries * kEntrySize;
+    EXPECT_EQ(index.size(), names_offset + names_size);
+
+    std::vector<IndexEntry> entries;
+    for (uint32_t i = 0; i < num_entries; i++) {
+        const size_t offset = kHeaderSize + i * kEntrySize;
+        const uint32_t name_offset = ReadU32(index, offset + 24);
+        const uint32_t name_size = ReadU32(index, offset + 28);
+        EXPECT_LE(name_offset + name_size, names_size);
+        entries.push_back(IndexEntry{
+                .name = index.substr(names_offset + name_offset, name_size),
+                .data_offset = ReadU64(index, offset),
+                .compressed_size = ReadU64(index, offset + 8),
+                .size = ReadU64(index, offset + 16),
+                .method = ReadU16(index, offset + 36),
+        });
+    }
+    return entries;
+}
+
+// Sets the compression method of every entry of the zip archive `path` to `method`, in both the
+// local file headers and the central directory.
+void SetCompressionMethod(const std::string& path, uint16_t method) {
+    std::string zip;
+    ASSERT_TRUE(ReadFileToString(path, &zip));
+    const uint16_t le_method = htole16(method);
+    for (const auto& [signature, method_offset] :
+         {std::pair<std::string, size_t>{"PK\x03\x04", 8}, {"PK\x01\x02", 10}}) {
+        for (size_t pos = zip.find(signature); pos != std::string::npos;
+             pos = zip.find(signature, pos + 1)) {
+            memcpy(zip.data() + pos + method_offset, &le_method, sizeof(le_method));
+        }
+    }
+    ASSERT_TRUE(WriteStringToFile(zip, path));
+}
+
+class ZipIndexTest : public testing::Test {
+protected:
+    TemporaryDir dir_;
+    const std::string zip_path_ = std::string(dir_.path) + "/archive.zip";
+    const std::string index_path_ = std::string(dir_.path) + "/archive-index.img";
+};
+
+TEST_F(ZipIndexTest, IndexesStoredAndDeflatedEntries) {
+    const std::string compressible(4096, 'a');
+    const std::vector<ZipContent> contents = {
+            {.name = "lib/", .data = "", .compress = false},
+            {.name = "classes.dex", .data = compressible, .compress = true},
+            {.name = "lib/libfoo.so", .data = "stored", .compress = false},
+    };
+    ASSERT_NO_FATAL_FAILURE(WriteZip(zip_path_, contents));
+
+    auto ret = MakeZipIndex(zip_path_, index_path_);
+    ASSERT_TRUE(ret.ok()) << ret.error();
+    ASSERT_TRUE(*ret);
+
+    std::string zip;
+    ASSERT_TRUE(ReadFileToString(zip_path_, &zip));
+    std::string index;
+    ASSERT_TRUE(ReadFileToString(index_path_, &index));
+    const auto entries = ParseIndex(index, zip.size());
+
+    // sorted by name
+    ASSERT_EQ(entries.size(), 3u);
+    EXPECT_EQ(entries[0].name, "classes.dex");
+    EXPECT_EQ(entries[1].name, "lib/");
+    EXPECT_EQ(entries[2].name, "lib/libfoo.so");
+
+    EXPECT_EQ(entries[0].method, kDeflated);
+    EXPECT_EQ(entries[0].size, compressible.size());
+    EXPECT_LT(entries[0].compressed_size, compressible.size());
+    EXPECT_LE(entries[0].data_offset + entries[0].compressed_size, zip.size());
+
+    EXPECT_EQ(entries[1].size, 0u);
+
+    EXPECT_EQ(entries[2].method, kStored);
+    EXPECT_EQ(entries[2].size, 6u);
+    EXPECT_EQ(entries[2].compressed_size, 6u);
+    EXPECT_EQ(zip.substr(entries[2].data_offset, 6), "stored");
+}
+
+TEST_F(ZipIndexTest, SkipsUnsupportedMethods) {
+    ASSERT_NO_FATAL_FAILURE(
+            WriteZip(zip_path_, {{.name = "classes.dex", .data = "dex", .compress = false}}));
+    ASSERT_NO_FATAL_FAILURE(SetCompressionMethod(zip_path_, kBzip2));
+
+    auto ret = MakeZipIndex(zip_path_, index_path_);
+    ASSERT_TRUE(ret.ok()) << ret.error();
+    EXPECT_FALSE(*ret);
+    EXPECT_NE(access(index_path_.c_str(), F_OK), 0);
+
+    auto apk_info = GetFileInfo(zip_path_);
+    ASSERT_TRUE(apk_info.ok()) << apk_info.error();
+    std::vector<Payload> payloads = {
+            {.partition_name = kApkPartitionName, .path = zip_path_, .file_info = *apk_info},
+    };
+    auto added = AddApkZipIndex(payloads, index_path_, nullptr);
+    ASSERT_TRUE(added.ok()) << added.error();
+    EXPECT_EQ(payloads.size(), 1u);
+}
+
+} // namespace
@@ -18,55 +18,93 @@
 
 #include <android-base/endian.h>
 #include <android-base/file.h>
+#include <android-base/mapped_file.h>
+#include <android-base/unique_fd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <limits>
 
 using android::base::ErrnoError;
 using android::base::Error;
+using android::base::MappedFile;
 using android::base::Result;
+using android::base::unique_fd;
 
 namespace android {
 namespace microdroid {
 
 Result<MicrodroidSignature> ReadMicrodroidSignature(const std::string& path) {
-    std::string content;
-    if (!base::ReadFileToString(path, &content)) {
-        return ErrnoError() << "Failed to read " << path;
+    unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+    if (fd.get() == -1) {
+        return ErrnoError() << "Failed to open " << path;
+    }
+    auto signature = ReadMicrodroidSignatureFromFd(fd.get());
+    if (!signature.ok()) {
+        return Error() << "Failed to read " << path << ": " << signature.error();
+    }
+    return signature;
+}
+
+Result<MicrodroidSignature> ReadMicrodroidSignatureFromFd(int fd) {
+    // This may be a block device, whose size can't be told by fstat().
+    off64_t file_size = lseek64(fd, 0, SEEK_END);
+    if (file_size == -1) {
+        return ErrnoError() << "Failed to get the size";
     }
 
     // read length prefix (4-byte, big-endian)
     uint32_t size;
     const size_t length_prefix_bytes = sizeof(size);
-    if (content.size() < length_prefix_bytes) {
-        return Error() << "Invalid signature: size == " << content.size();
+    if (static_cast<uint64_t>(file_size) < length_prefix_bytes) {
+        return Error() << "Invalid signature: size == " << file_size;
+    }
+    if (!base::ReadFullyAtOffset(fd, &size, length_prefix_bytes, 0)) {
+        return ErrnoError() << "Failed to read the length prefix";
     }
-    size = be32toh(*reinterpret_cast<uint32_t*>(content.data()));
-    if (content.size() < length_prefix_bytes + size) {
+    size = be32toh(size);
+    if (static_cast<uint64_t>(file_size) < length_prefix_bytes + size) {
         return Error() << "Invalid signature: size(" << size << ") mimatches to the content size("
-                       << content.size() - length_prefix_bytes << ")";
+                       << file_size - length_prefix_bytes << ")";
     }
-    content = content.substr(length_prefix_bytes, size);
 
-    // parse content
+    // parse content in place. The rest of the partition (padding) is never read.
     MicrodroidSignature signature;
-    if (!signature.ParseFromString(content)) {
-        return Error() << "Can't parse MicrodroidSignature from " << path;
+    if (size == 0) {
+        return signature;
+    }
+    auto content = MappedFile::FromFd(fd, length_prefix_bytes, size, PROT_READ);
+    if (!content) {
+        return ErrnoError() << "Failed to mmap the content";
+    }
+    if (!signature.ParseFromArray(content->data(), size)) {
+        return Error() << "Can't parse MicrodroidSignature";
     }
     return signature;
 }
 
-Result<void> WriteMicrodroidSignature(const MicrodroidSignature& signature, std::ostream& out) {
-    // prepare content
-    std::string content;
-    if (!signature.SerializeToString(&content)) {
-        return Error() << "Failed to write protobuf.";
-    }
-
+Result<void> WriteMicrodroidSignature(const MicrodroidSignature& signature, int fd,
+                                      uint64_t padded_size) {
     // write length prefix (4-byte, big-endian)
-    uint32_t size = htobe32(static_cast<uint32_t>(content.size()));
-    out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    const size_t content_size = signature.ByteSizeLong();
+    if (content_size > std::numeric_limits<uint32_t>::max()) {
+        return Error() << "Signature is too big: " << content_size;
+    }
+    uint32_t size = htobe32(static_cast<uint32_t>(content_size));
+    if (!base::WriteFully(fd, &size, sizeof(size))) {
+        return ErrnoError() << "Failed to write the length prefix";
+    }
 
-    // write content
-    out << content;
+    // write content, serializing it directly to the file
+    if (!signature.SerializeToFileDescriptor(fd)) {
+        return Error() << "Failed to write protobuf.";
+    }
 
+    // pad with zeros (a hole, if the file system supports it)
+    if (padded_size > sizeof(size) + content_size && ftruncate(fd, padded_size) == -1) {
+        return ErrnoError() << "Failed to pad the signature to " << padded_size;
+    }
     return {};
 }
 
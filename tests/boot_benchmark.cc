@@ -0,0 +1,367 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "virt/BootBenchmark.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <optional>
+#include <set>
+#include <thread>
+
+#include "android-base/file.h"
+#include "android-base/logging.h"
+#include "android-base/stringprintf.h"
+#include "android-base/strings.h"
+#include "android-base/unique_fd.h"
+#include "binder/ProcessState.h"
+#include "virt/DeathRecorder.h"
+#include "virt/FileTransfer.h"
+#include "virt/VsockServer.h"
+
+using namespace android::base;
+using namespace android::os;
+
+namespace virt {
+
+static constexpr int kGuestPort = 45678;
+static constexpr const char kVmConfigPath[] = "/data/local/tmp/virt-test/vsock_config.json";
+// A config with a warm pool, whose guest waits for the host to connect on kWarmGuestPort.
+static constexpr const char kWarmVmConfigPath[] =
+        "/data/local/tmp/virt-test/vsock_warm_config.json";
+static constexpr int kWarmGuestPort = 45679;
+static constexpr const char kTestMessage[] = "HelloWorld";
+static constexpr int kIterations = 5;
+static constexpr size_t kConcurrentVms[] = {1, 2, 4};
+static constexpr size_t kScalingVms[] = {1, 2, 4, 8};
+static constexpr std::chrono::seconds kBootTimeout(60);
+// How long the Virt Manager is given to boot the next VM of a warm pool.
+static constexpr std::chrono::seconds kWarmPoolRefillTime(10);
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct VmBoot {
+    binder::Status status;
+    Clock::time_point start;
+    Clock::time_point started;
+    Clock::time_point got_cid;
+    int32_t cid = -1;
+    sp<IVirtualMachine> vm;
+    sp<DeathRecorder> death_recorder;
+};
+
+// Returns a file with the content of a config, to pass to startVm.
+Result<unique_fd> CreateConfigFile(const std::string& config) {
+    auto config_fd = CreateMemoryFile("vm_config", 0);
+    if (!config_fd.ok()) {
+        return config_fd.error();
+    }
+    if (!WriteStringToFd(config, *config_fd)) {
+        return ErrnoError() << "Failed to write the config";
+    }
+    if (lseek(*config_fd, 0, SEEK_SET) != 0) {
+        return ErrnoError() << "lseek failed";
+    }
+    return std::move(*config_fd);
+}
+
+void StartVm(IVirtManager* virt_manager, unique_fd config_fd, VmBoot* boot) {
+    boot->start = Clock::now();
+    boot->status = virt_manager->startVm(ParcelFileDescriptor(std::move(config_fd)), std::nullopt,
+                                         &boot->vm);
+    boot->started = Clock::now();
+    if (!boot->status.isOk()) {
+        return;
+    }
+    boot->status = boot->vm->getCid(&boot->cid);
+    boot->got_cid = Clock::now();
+    if (!boot->status.isOk()) {
+        return;
+    }
+
+    boot->death_recorder = new DeathRecorder();
+    boot->status = boot->vm->registerCallback(boot->death_recorder);
+    if (!boot->status.isOk()) {
+        return;
+    }
+    // The VM may have died before the callback was registered.
+    bool running;
+    boot->status = boot->vm->isRunning(&running);
+    if (boot->status.isOk() && !running) {
+        boot->death_recorder->onDied(boot->cid);
+    }
+}
+
+// The intervals measured for a VM whose guest waits for the host to connect.
+struct ListeningVmSample {
+    // From calling startVm to its return.
+    std::chrono::nanoseconds start_vm;
+    // From calling startVm to receiving the message of the guest.
+    std::chrono::nanoseconds first_message;
+};
+
+// Starts a VM whose guest waits for the host to connect on kWarmGuestPort and sends it
+// kTestMessage, like vsock_warm_config.json. The VM is killed once the message is received.
+Result<ListeningVmSample> BootListeningVm(IVirtManager* virt_manager, const std::string& config) {
+    auto config_fd = CreateConfigFile(config);
+    if (!config_fd.ok()) {
+        return config_fd.error();
+    }
+    const auto start = Clock::now();
+    const auto deadline = start + kBootTimeout;
+    sp<IVirtualMachine> vm;
+    auto status = virt_manager->startVm(ParcelFileDescriptor(std::move(*config_fd)), std::nullopt,
+                                        &vm);
+    const auto started = Clock::now();
+    if (!status.isOk()) {
+        return Error() << "Error starting VM: " << status;
+    }
+    int32_t cid;
+    status = vm->getCid(&cid);
+    if (!status.isOk()) {
+        return Error() << "Error getting the CID of the VM: " << status;
+    }
+    auto fd = ConnectToGuest(cid, kWarmGuestPort, deadline);
+    if (!fd.ok()) {
+        return fd.error();
+    }
+    auto message = ReadToEnd(*fd, deadline);
+    if (!message.ok()) {
+        return message.error();
+    }
+    const auto received = Clock::now();
+    if (*message != kTestMessage) {
+        return Error() << "VM " << cid << " sent wrong message: " << *message;
+    }
+    return ListeningVmSample{.start_vm = started - start, .first_message = received - start};
+}
+
+} // namespace
+
+void BootBenchmark::SetUp() {
+    VirtualizationTest::SetUp();
+    // Needed to receive the callbacks of the VMs.
+    ProcessState::self()->startThreadPool();
+}
+
+std::vector<VmSpec> BootBenchmark::MakeVmSpecs(const std::string& config_path,
+                                               const std::string& message, size_t num_vms) {
+    std::string config;
+    EXPECT_TRUE(ReadFileToString(config_path, &config)) << "Failed to read " << config_path;
+    std::vector<VmSpec> vms;
+    for (size_t i = 0; i < num_vms; i++) {
+        const std::string unique_message = message + "_" + std::to_string(i);
+        vms.push_back({
+                .config = StringReplace(config, message, unique_message, true),
+                .message = unique_message,
+        });
+    }
+    return vms;
+}
+
+void BootBenchmark::BootVms(const std::vector<VmSpec>& vms, int port,
+                            std::vector<BootSample>* samples) {
+    auto server = VsockServer::Listen(port);
+    ASSERT_TRUE(server.ok()) << server.error();
+
+    std::vector<unique_fd> config_fds;
+    for (const auto& vm : vms) {
+        auto config_fd = CreateConfigFile(vm.config);
+        ASSERT_TRUE(config_fd.ok()) << config_fd.error();
+        config_fds.push_back(std::move(*config_fd));
+    }
+
+    std::vector<VmBoot> boots(vms.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < vms.size(); i++) {
+        threads.emplace_back(StartVm, mVirtManager.get(), std::move(config_fds[i]), &boots[i]);
+    }
+
+    // The guests are told apart by their CIDs.
+    std::map<int32_t, Clock::time_point> connect_times;
+    std::map<int32_t, Clock::time_point> close_times;
+    std::map<int32_t, std::string> messages;
+    std::map<int32_t, VirtualMachineMetrics> metrics;
+    const auto deadline = Clock::now() + kBootTimeout;
+    auto served = (*server)->ServeClients(
+            vms.size(), deadline,
+            [&](const VsockClient& client) { connect_times.emplace(client.cid, Clock::now()); },
+            [&](const VsockClient& client, std::string received) {
+                close_times.emplace(client.cid, Clock::now());
+                messages.emplace(client.cid, std::move(received));
+            });
+    // The guests are shutting down, so this is their whole boot and run. The metrics are only
+    // read once all of them are served, so that the binder calls don't delay the guests which are
+    // still connecting. A VM may already be gone, in which case it has no metrics.
+    for (const auto& [cid, close_time] : close_times) {
+        auto vm_metrics = GetVmMetrics(mVirtManager.get(), cid);
+        if (vm_metrics.ok()) {
+            metrics.emplace(cid, std::move(*vm_metrics));
+        } else {
+            LOG(WARNING) << vm_metrics.error();
+        }
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (const auto& boot : boots) {
+        ASSERT_TRUE(boot.status.isOk()) << "Error starting VM: " << boot.status;
+    }
+    ASSERT_TRUE(served.ok()) << served.error();
+
+    for (size_t i = 0; i < vms.size(); i++) {
+        const VmBoot& boot = boots[i];
+        ASSERT_EQ(connect_times.count(boot.cid), 1u) << "VM " << boot.cid << " didn't connect";
+        ASSERT_EQ(close_times.count(boot.cid), 1u) << "VM " << boot.cid << " didn't shut down";
+        EXPECT_EQ(messages[boot.cid], vms[i].message) << "VM " << boot.cid << " sent wrong message";
+        const auto death_time = boot.death_recorder->WaitForDeath(deadline);
+        ASSERT_TRUE(death_time.has_value()) << "VM " << boot.cid << " didn't die";
+        samples->push_back({
+                .cid = boot.cid,
+                .start_vm = boot.started - boot.start,
+                .get_cid = boot.got_cid - boot.started,
+                .first_connect = connect_times[boot.cid] - boot.start,
+                .death = *death_time - close_times[boot.cid],
+                .metrics = metrics.count(boot.cid) ? std::make_optional(metrics[boot.cid])
+                                                   : std::nullopt,
+        });
+    }
+}
+
+void BootBenchmark::ReportInterval(const char* name, std::vector<std::chrono::nanoseconds> samples,
+                                   const std::string& tag) {
+    if (samples.empty()) {
+        return;
+    }
+    std::vector<double> ms;
+    for (const auto& sample : samples) {
+        ms.push_back(std::chrono::duration<double, std::milli>(sample).count());
+    }
+    std::sort(ms.begin(), ms.end());
+    double sum = 0;
+    for (double value : ms) {
+        sum += value;
+    }
+    ReportMetric(StringPrintf("boot_%s_mean_ms_%s", name, tag.c_str()), sum / ms.size());
+    ReportMetric(StringPrintf("boot_%s_p50_ms_%s", name, tag.c_str()), ms[ms.size() / 2]);
+    ReportMetric(StringPrintf("boot_%s_max_ms_%s", name, tag.c_str()), ms.back());
+}
+
+void BootBenchmark::ReportSamples(const std::vector<BootSample>& samples, const std::string& tag) {
+    static constexpr std::pair<const char*, std::chrono::nanoseconds BootSample::*> kIntervals[] = {
+            {"start_vm", &BootSample::start_vm},
+            {"get_cid", &BootSample::get_cid},
+            {"first_connect", &BootSample::first_connect},
+            {"death", &BootSample::death},
+    };
+    if (samples.empty()) {
+        return;
+    }
+    for (const auto& [name, interval] : kIntervals) {
+        std::vector<std::chrono::nanoseconds> values;
+        for (const auto& sample : samples) {
+            values.push_back(sample.*interval);
+        }
+        ReportInterval(name, std::move(values), tag);
+    }
+
+    std::map<std::string, std::vector<double>> vm_metrics;
+    for (const auto& sample : samples) {
+        if (sample.metrics.has_value()) {
+            for (auto& [name, value] : VmMetricValues(*sample.metrics)) {
+                vm_metrics[name].push_back(value);
+            }
+        }
+    }
+    for (const auto& [name, values] : vm_metrics) {
+        double sum = 0;
+        for (double value : values) {
+            sum += value;
+        }
+        ReportMetric(StringPrintf("boot_vm_%s_mean_%s", name.c_str(), tag.c_str()),
+                     sum / values.size());
+    }
+}
+
+TEST_F(BootBenchmark, BootLatency) {
+    for (size_t num_vms : kConcurrentVms) {
+        const std::vector<VmSpec> vms = MakeVmSpecs(kVmConfigPath, kTestMessage, num_vms);
+        std::vector<BootSample> samples;
+        for (int i = 0; i < kIterations; i++) {
+            ASSERT_NO_FATAL_FAILURE(BootVms(vms, kGuestPort, &samples));
+        }
+        ReportSamples(samples, StringPrintf("%zuvm", num_vms));
+    }
+}
+
+// Boots more and more VMs at once, to find contention in Virt Manager, e.g. in CID allocation.
+TEST_F(BootBenchmark, MultiVmScaling) {
+    for (size_t num_vms : kScalingVms) {
+        std::vector<BootSample> samples;
+        ASSERT_NO_FATAL_FAILURE(
+                BootVms(MakeVmSpecs(kVmConfigPath, kTestMessage, num_vms), kGuestPort, &samples));
+
+        std::set<int32_t> cids;
+        for (const auto& sample : samples) {
+            cids.insert(sample.cid);
+        }
+        EXPECT_EQ(cids.size(), num_vms) << "CIDs aren't unique";
+        ReportSamples(samples, StringPrintf("%zuvm_scaling", num_vms));
+    }
+}
+
+// Compares VMs handed out from the warm pool of the Virt Manager to cold boots of the same guest,
+// which waits for the host to connect as the guest of a VM of the pool boots before it is handed
+// out.
+TEST_F(BootBenchmark, WarmPoolLatency) {
+    std::string warm_config;
+    ASSERT_TRUE(ReadFileToString(kWarmVmConfigPath, &warm_config))
+            << "Failed to read " << kWarmVmConfigPath;
+    const std::string cold_config =
+            StringReplace(warm_config, "\"warm_pool_size\": 1", "\"warm_pool_size\": 0", false);
+    ASSERT_NE(cold_config, warm_config);
+
+    std::vector<std::chrono::nanoseconds> cold_start_vm, cold_first_message;
+    for (int i = 0; i < kIterations; i++) {
+        auto sample = BootListeningVm(mVirtManager.get(), cold_config);
+        ASSERT_TRUE(sample.ok()) << sample.error();
+        cold_start_vm.push_back(sample->start_vm);
+        cold_first_message.push_back(sample->first_message);
+    }
+
+    // The first VM of the config boots cold, and has the pool filled.
+    auto first = BootListeningVm(mVirtManager.get(), warm_config);
+    ASSERT_TRUE(first.ok()) << first.error();
+    std::vector<std::chrono::nanoseconds> warm_start_vm, warm_first_message;
+    for (int i = 0; i < kIterations; i++) {
+        std::this_thread::sleep_for(kWarmPoolRefillTime);
+        auto sample = BootListeningVm(mVirtManager.get(), warm_config);
+        ASSERT_TRUE(sample.ok()) << sample.error();
+        warm_start_vm.push_back(sample->start_vm);
+        warm_first_message.push_back(sample->first_message);
+    }
+
+    ReportInterval("start_vm", std::move(cold_start_vm), "cold");
+    ReportInterval("first_message", std::move(cold_first_message), "cold");
+    ReportInterval("start_vm", std::move(warm_start_vm), "warm_pool");
+    ReportInterval("first_message", std::move(warm_first_message), "warm_pool");
+}
+
+} // namespace virt
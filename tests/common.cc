@@ -16,6 +16,9 @@
 
 #include "virt/VirtualizationTest.h"
 
+#include "android-base/logging.h"
+#include "android-base/stringprintf.h"
+
 namespace virt {
 
 void VirtualizationTest::SetUp() {
@@ -23,4 +26,9 @@ void VirtualizationTest::SetUp() {
     ASSERT_EQ(err, 0);
 }
 
+void VirtualizationTest::ReportMetric(const std::string& key, double value) {
+    LOG(INFO) << key << ": " << value;
+    RecordProperty(key, android::base::StringPrintf("%.3f", value));
+}
+
 } // namespace virt
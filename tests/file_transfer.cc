@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "virt/FileTransfer.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "android-base/file.h"
+
+using android::base::ErrnoError;
+using android::base::Error;
+using android::base::Pipe;
+using android::base::Result;
+using android::base::unique_fd;
+
+namespace virt {
+
+// The default limit of the size of a pipe for unprivileged processes, /proc/sys/fs/pipe-max-size.
+static constexpr int kMaxPipeSize = 1024 * 1024;
+
+Result<void> SendFileToSocket(int socket_fd, int file_fd, uint64_t size, size_t chunk_size) {
+    off_t offset = 0;
+    while (static_cast<uint64_t>(offset) < size) {
+        const size_t count = std::min<uint64_t>(chunk_size, size - offset);
+        ssize_t sent = TEMP_FAILURE_RETRY(sendfile(socket_fd, file_fd, &offset, count));
+        if (sent < 0) {
+            return ErrnoError() << "sendfile failed at offset " << offset;
+        }
+        if (sent == 0) {
+            return Error() << "file ended at offset " << offset << " of " << size;
+        }
+    }
+    return {};
+}
+
+Result<void> ReceiveSocketToFile(int socket_fd, int file_fd, uint64_t size) {
+    if (ftruncate(file_fd, size) != 0) {
+        return ErrnoError() << "ftruncate to " << size << " failed";
+    }
+    if (size == 0) {
+        return {};
+    }
+    unique_fd pipe_read, pipe_write;
+    if (!Pipe(&pipe_read, &pipe_write)) {
+        return ErrnoError() << "pipe failed";
+    }
+    // A larger pipe takes fewer splice calls. The default size still works if it can't be grown.
+    fcntl(pipe_write, F_SETPIPE_SZ, kMaxPipeSize);
+    const int pipe_size = fcntl(pipe_write, F_GETPIPE_SZ);
+    if (pipe_size <= 0) {
+        return ErrnoError() << "F_GETPIPE_SZ failed";
+    }
+
+    loff_t offset = 0;
+    while (static_cast<uint64_t>(offset) < size) {
+        const size_t count = std::min<uint64_t>(pipe_size, size - offset);
+        ssize_t in_pipe = TEMP_FAILURE_RETRY(
+                splice(socket_fd, nullptr, pipe_write, nullptr, count, SPLICE_F_MOVE));
+        if (in_pipe < 0) {
+            return ErrnoError() << "splice from the socket failed at offset " << offset;
+        }
+        if (in_pipe == 0) {
+            return Error() << "socket closed at offset " << offset << " of " << size;
+        }
+        while (in_pipe > 0) {
+            ssize_t written = TEMP_FAILURE_RETRY(
+                    splice(pipe_read, nullptr, file_fd, &offset, in_pipe, SPLICE_F_MOVE));
+            if (written < 0) {
+                return ErrnoError() << "splice to the file failed at offset " << offset;
+            }
+            if (written == 0) {
+                return Error() << "the file took no data at offset " << offset;
+            }
+            in_pipe -= written;
+        }
+    }
+    return {};
+}
+
+Result<unique_fd> CreateMemoryFile(const char* name, uint64_t size) {
+    unique_fd fd(memfd_create(name, MFD_CLOEXEC));
+    if (fd < 0) {
+        return ErrnoError() << "memfd_create failed";
+    }
+    if (ftruncate(fd, size) != 0) {
+        return ErrnoError() << "ftruncate to " << size << " failed";
+    }
+    return fd;
+}
+
+} // namespace virt
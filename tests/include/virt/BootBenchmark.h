@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "virt/VirtualizationTest.h"
+#include "virt/VmMetrics.h"
+
+namespace virt {
+
+// The intervals measured for each VM boot.
+struct BootSample {
+    // The CID of the VM.
+    int32_t cid;
+    // From calling startVm to its return.
+    std::chrono::nanoseconds start_vm;
+    // From the return of startVm to the return of getCid.
+    std::chrono::nanoseconds get_cid;
+    // From calling startVm to the first vsock connection from the guest.
+    std::chrono::nanoseconds first_connect;
+    // From the guest closing its connection, when it shuts down, to the VM dying.
+    std::chrono::nanoseconds death;
+    // The metrics of the VM once all the guests booted together closed their connections, if they
+    // could be read.
+    std::optional<VirtualMachineMetrics> metrics;
+};
+
+// A VM to boot: the content of its config, and the message its guest sends to the host.
+struct VmSpec {
+    std::string config;
+    std::string message;
+};
+
+// Boots VMs whose guest connects to the host on a port, sends a message and shuts down, like
+// vsock_config.json.
+class BootBenchmark : public VirtualizationTest {
+protected:
+    void SetUp() override;
+
+    // Returns `num_vms` specs made from the config at `config_path`, in which the guest sends
+    // `message`. The message is made unique for each VM.
+    std::vector<VmSpec> MakeVmSpecs(const std::string& config_path, const std::string& message,
+                                    size_t num_vms);
+
+    // Boots the VMs concurrently, checks the message each guest sends on `port`, and waits for the
+    // VMs to die. Appends a sample for each of them.
+    void BootVms(const std::vector<VmSpec>& vms, int port, std::vector<BootSample>* samples);
+
+    // Reports the mean, median and maximum in ms of the samples of the interval `name`, suffixing
+    // the keys with `tag`.
+    void ReportInterval(const char* name, std::vector<std::chrono::nanoseconds> samples,
+                        const std::string& tag);
+
+    // Reports the mean, median and maximum of each interval in ms, and the mean of each VM metric,
+    // suffixing the keys with `tag`.
+    void ReportSamples(const std::vector<BootSample>& samples, const std::string& tag);
+};
+
+} // namespace virt
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace virt {
+
+// The guest init marks the phases of the boot on the console, one line per event:
+//
+//   [boot-trace] <event> <CLOCK_MONOTONIC of the guest in ns>[ <detail>]
+//
+// The marker may be preceded by anything else on the line, e.g. a kernel log prefix.
+static constexpr const char kBootTraceMarker[] = "[boot-trace]";
+
+// Events, in the order they happen.
+static constexpr const char kBootEventInit[] = "init";               // init entered
+static constexpr const char kBootEventClearenv[] = "clearenv";       // environment cleared
+static constexpr const char kBootEventModuleDir[] = "module_dir";    // detail: directory probed
+static constexpr const char kBootEventModuleLoaded[] = "module";     // detail: module name
+static constexpr const char kBootEventModulesLoaded[] = "modules";   // modules needed by exec
+static constexpr const char kBootEventBackgroundModulesLoaded[] = "background_modules";
+static constexpr const char kBootEventExec[] = "execv";              // detail: test binary
+
+struct BootTraceEvent {
+    std::string event;
+    uint64_t timestamp_ns;
+    std::string detail;
+};
+
+inline std::string FormatBootTraceEvent(const BootTraceEvent& event) {
+    std::string line = std::string(kBootTraceMarker) + " " + event.event + " " +
+            std::to_string(event.timestamp_ns);
+    if (!event.detail.empty()) {
+        line += " " + event.detail;
+    }
+    return line + "\n";
+}
+
+// Parses a line of the console output. Returns nullopt if it isn't a boot trace event.
+inline std::optional<BootTraceEvent> ParseBootTraceEvent(std::string_view line) {
+    size_t pos = line.find(kBootTraceMarker);
+    if (pos == std::string_view::npos) {
+        return std::nullopt;
+    }
+    line.remove_prefix(pos + sizeof(kBootTraceMarker) - 1);
+    while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) {
+        line.remove_suffix(1);
+    }
+
+    // " <event> <timestamp>[ <detail>]"
+    if (line.empty() || line[0] != ' ') {
+        return std::nullopt;
+    }
+    line.remove_prefix(1);
+    size_t event_end = line.find(' ');
+    if (event_end == 0 || event_end == std::string_view::npos) {
+        return std::nullopt;
+    }
+    BootTraceEvent event{.event = std::string(line.substr(0, event_end)),
+                         .timestamp_ns = 0,
+                         .detail = {}};
+    line.remove_prefix(event_end + 1);
+    size_t timestamp_end = line.find(' ');
+    std::string_view timestamp = line.substr(0, timestamp_end);
+    if (timestamp.empty()) {
+        return std::nullopt;
+    }
+    for (char c : timestamp) {
+        if (c < '0' || c > '9') {
+            return std::nullopt;
+        }
+        event.timestamp_ns = event.timestamp_ns * 10 + (c - '0');
+    }
+    if (timestamp_end != std::string_view::npos) {
+        event.detail = std::string(line.substr(timestamp_end + 1));
+    }
+    return event;
+}
+
+} // namespace virt
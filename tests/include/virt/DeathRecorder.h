@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+
+#include "android/system/virtmanager/BnVirtualMachineCallback.h"
+
+namespace virt {
+
+// Records when the VM died.
+class DeathRecorder : public android::system::virtmanager::BnVirtualMachineCallback {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    android::binder::Status onDied(int32_t /* cid */) override {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mDeathTime.has_value()) {
+            mDeathTime = Clock::now();
+            mCv.notify_all();
+        }
+        return android::binder::Status::ok();
+    }
+
+    std::optional<Clock::time_point> WaitForDeath(Clock::time_point deadline) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCv.wait_until(lock, deadline, [this] { return mDeathTime.has_value(); });
+        return mDeathTime;
+    }
+
+private:
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    std::optional<Clock::time_point> mDeathTime;
+};
+
+} // namespace virt
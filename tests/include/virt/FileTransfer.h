@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "android-base/result.h"
+#include "android-base/unique_fd.h"
+
+namespace virt {
+
+// Bulk transfers of files over sockets which don't copy the data through user space buffers.
+
+// Sends the first `size` bytes of `file_fd` to `socket_fd` with sendfile, `chunk_size` bytes at a
+// time.
+android::base::Result<void> SendFileToSocket(int socket_fd, int file_fd, uint64_t size,
+                                             size_t chunk_size);
+
+// Receives `size` bytes from `socket_fd` into the beginning of `file_fd`, which is resized to
+// `size` bytes. The data is spliced from the socket to the file through a pipe, so it stays in the
+// kernel.
+android::base::Result<void> ReceiveSocketToFile(int socket_fd, int file_fd, uint64_t size);
+
+// Creates an anonymous file of `size` bytes in memory to transfer from or to.
+android::base::Result<android::base::unique_fd> CreateMemoryFile(const char* name, uint64_t size);
+
+} // namespace virt
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <string>
+
 #include "android/system/virtmanager/IVirtManager.h"
 #include "android/system/virtmanager/IVirtualMachine.h"
 #include "binder/IServiceManager.h"
@@ -28,6 +30,10 @@ class VirtualizationTest : public ::testing::Test {
 protected:
     void SetUp() override;
 
+    // Logs a benchmark result and records it as a property of the test, so that it ends up in the
+    // XML output of gtest.
+    void ReportMetric(const std::string& key, double value);
+
     sp<IVirtManager> mVirtManager;
 };
 
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "android-base/result.h"
+#include "android/system/virtmanager/IVirtManager.h"
+#include "android/system/virtmanager/VirtualMachineMetrics.h"
+
+namespace virt {
+
+// Returns the metrics of the running VM `cid`, as the Virt Manager measures them.
+android::base::Result<android::system::virtmanager::VirtualMachineMetrics> GetVmMetrics(
+        android::system::virtmanager::IVirtManager* virt_manager, int32_t cid);
+
+// Returns the metrics as (name, value) pairs to report, with the unit in the name, e.g.
+// {"rss_mib", 12.5}. Durations are in ms and sizes in MiB.
+std::vector<std::pair<std::string, double>> VmMetricValues(
+        const android::system::virtmanager::VirtualMachineMetrics& metrics);
+
+} // namespace virt
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace virt {
+
+// Protocol between the vsock benchmarks on the host and `vsock_client <cid> <port> --bench` in
+// the guest. The guest connects to the host and serves requests on the connection until the host
+// closes it. Host and guest have the same architecture, so the structures are sent as they are.
+enum class VsockBenchOp : uint32_t {
+    // The host sends `count` messages of `size` bytes. The guest replies with the number of bytes
+    // it received as a uint64_t.
+    kSink = 1,
+    // The guest sends `count` messages of `size` bytes.
+    kSource = 2,
+    // The host sends `count` messages of `size` bytes, one at a time, and the guest sends each of
+    // them back.
+    kEcho = 3,
+    // The guest opens `count` more connections to the host, each served like this one. It replies
+    // with the number of connections it opened as a uint64_t.
+    kConnect = 4,
+    // The host sends `count` bytes, which the guest splices into a file in memory with
+    // ReceiveSocketToFile. The guest replies with the number of bytes it received as a uint64_t.
+    kSinkFile = 5,
+    // The guest sends `count` bytes from a file in memory with SendFileToSocket, `size` bytes at a
+    // time.
+    kSourceFile = 6,
+};
+
+struct VsockBenchRequest {
+    VsockBenchOp op;
+    uint32_t size;
+    uint64_t count;
+};
+
+static constexpr uint32_t kVsockBenchMaxMessageSize = 4 * 1024 * 1024;
+
+} // namespace virt
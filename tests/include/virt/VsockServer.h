@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "android-base/result.h"
+#include "android-base/unique_fd.h"
+
+namespace virt {
+
+using Deadline = std::chrono::steady_clock::time_point;
+
+// The address of a client of a VsockServer.
+struct VsockClient {
+    unsigned int cid;
+    unsigned int port;
+};
+
+// A connection accepted by a VsockServer. The socket is blocking.
+struct VsockConnection {
+    android::base::unique_fd fd;
+    VsockClient client;
+};
+
+// Listens for vsock connections from the guests on a port. Nothing waits past the deadline it is
+// given, so that a guest which never connects or never closes its connection fails the test
+// rather than hanging it.
+class VsockServer {
+public:
+    // Listens on `port` for connections from any CID.
+    static android::base::Result<std::unique_ptr<VsockServer>> Listen(unsigned int port);
+
+    // Accepts a connection.
+    android::base::Result<VsockConnection> Accept(Deadline deadline);
+
+    // Called when a client connects.
+    using ConnectCallback = std::function<void(const VsockClient& client)>;
+    // Called when a client closes its connection, with all it sent.
+    using CloseCallback = std::function<void(const VsockClient& client, std::string received)>;
+
+    // Serves many clients at once on an epoll loop: accepts their connections and reads from them
+    // until they close them. Returns once `num_clients` clients have closed their connections.
+    android::base::Result<void> ServeClients(size_t num_clients, Deadline deadline,
+                                             const ConnectCallback& on_connect,
+                                             const CloseCallback& on_close);
+
+private:
+    explicit VsockServer(android::base::unique_fd fd) : mFd(std::move(fd)) {}
+
+    android::base::unique_fd mFd;
+};
+
+// Connects to `port` of the guest `cid`, retrying until the guest listens on it.
+android::base::Result<android::base::unique_fd> ConnectToGuest(unsigned int cid, unsigned int port,
+                                                               Deadline deadline);
+
+// Reads from `fd` until EOF.
+android::base::Result<std::string> ReadToEnd(int fd, Deadline deadline);
+
+// Sends all of `data` on the stream socket `fd`. The socket may be blocking: each send is made not
+// to block, and the socket is polled only when it is full, so that a ready socket costs a single
+// syscall.
+android::base::Result<void> SendFully(int fd, const void* data, size_t size, Deadline deadline);
+
+// Receives exactly `size` bytes from the stream socket `fd`, like SendFully. Fails if the
+// connection is closed before.
+android::base::Result<void> ReceiveFully(int fd, void* data, size_t size, Deadline deadline);
+
+} // namespace virt
@@ -20,26 +20,167 @@
 #include <sys/types.h>
 #include <sys/utsname.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <modprobe/modprobe.h>
 
+#include "android-base/file.h"
 #include "android-base/logging.h"
+#include "android-base/parseint.h"
 #include "android-base/strings.h"
+#include "virt/BootTrace.h"
 
 using namespace android::base;
 
 static constexpr const char MODULE_BASE_DIR[] = "/lib/modules";
 
-bool LoadKernelModules() {
+// Kernel parameters (passed to init as environment variables) controlling module loading.
+// Comma-separated names of the modules which the test binary needs from the start (e.g. vsock).
+// When set, only they (and their dependencies) are loaded before the test binary is executed, and
+// the rest are loaded in the background.
+static constexpr const char CRITICAL_MODULES_ENV[] = "critical_modules";
+// The number of threads to load modules with. Defaults to the number of CPUs.
+static constexpr const char MODULE_LOAD_THREADS_ENV[] = "module_load_threads";
+
+// Prints a boot trace event (see virt/BootTrace.h) to the console. The line is written with a
+// single write so that the events of the module loading threads don't interleave.
+void TraceBootEvent(const char* event, const std::string& detail = "") {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    const uint64_t timestamp_ns = static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    const std::string line = virt::FormatBootTraceEvent(
+            {.event = event, .timestamp_ns = timestamp_ns, .detail = detail});
+    if (write(STDERR_FILENO, line.data(), line.size()) == -1) {
+        PLOG(WARNING) << "Failed to trace boot event " << event;
+    }
+}
+
+struct ModuleLoadOptions {
+    std::vector<std::string> critical_modules;
+    unsigned int num_threads;
+};
+
+// Returns the canonical name of a module in modules.load, e.g. "kernel/foo-bar.ko" -> "foo_bar".
+std::string CanonicalModuleName(const std::string& module_path) {
+    std::string name = Basename(module_path);
+    if (EndsWith(name, ".ko")) {
+        name.resize(name.size() - 3);
+    }
+    std::replace(name.begin(), name.end(), '-', '_');
+    return name;
+}
+
+// Returns the modules listed in modules.load of the directory, in order.
+std::vector<std::string> GetListedModules(const std::string& dir_path) {
+    std::vector<std::string> modules;
+    std::string content;
+    if (!ReadFileToString(dir_path + "/modules.load", &content)) {
+        return modules;
+    }
+    for (const auto& line : Split(content, "\n")) {
+        std::string module_path = Trim(line);
+        if (!module_path.empty() && module_path[0] != '#') {
+            modules.push_back(CanonicalModuleName(module_path));
+        }
+    }
+    return modules;
+}
+
+// Loads the modules on a pool of threads. Each thread has its own Modprobe, which loads the
+// dependencies of a module before the module itself. If more than one thread tries to load the
+// same dependency, the kernel lets only one of them do it and the others get EEXIST, which Modprobe
+// takes as the module being loaded.
+bool LoadModulesInParallel(const std::string& dir_path, const std::vector<std::string>& modules,
+                           unsigned int num_threads) {
+    std::atomic<size_t> next_index = 0;
+    std::atomic<bool> retval = true;
+    auto load_modules = [&]() {
+        Modprobe m({dir_path});
+        for (size_t index; (index = next_index++) < modules.size();) {
+            if (!m.LoadWithAliases(modules[index], true)) {
+                LOG(ERROR) << "Failed to load module " << modules[index];
+                retval = false;
+            } else {
+                TraceBootEvent(virt::kBootEventModuleLoaded, modules[index]);
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < std::min<size_t>(num_threads, modules.size()); i++) {
+        threads.emplace_back(load_modules);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return retval;
+}
+
+// Loads the modules of the directory. If `options.critical_modules` is not empty, only they are
+// loaded before returning, and the rest of the modules are loaded by a child process.
+bool LoadListedModules(const std::string& dir_path, const std::vector<std::string>& modules,
+                       const ModuleLoadOptions& options) {
+    if (options.critical_modules.empty()) {
+        return LoadModulesInParallel(dir_path, modules, options.num_threads);
+    }
+
+    if (!LoadModulesInParallel(dir_path, options.critical_modules, options.num_threads)) {
+        return false;
+    }
+    std::vector<std::string> deferred_modules;
+    for (const auto& module : modules) {
+        if (std::find(options.critical_modules.begin(), options.critical_modules.end(), module) ==
+            options.critical_modules.end()) {
+            deferred_modules.push_back(module);
+        }
+    }
+    LOG(INFO) << "Loading " << deferred_modules.size() << " modules in the background...";
+    // The loader outlives this process image: init execs the test binary, which doesn't expect
+    // children. So the loader is forked by an intermediate child, which exits at once and is
+    // reaped here, and the loader is reparented to init instead.
+    pid_t pid = fork();
+    if (pid == -1) {
+        PLOG(ERROR) << "fork";
+        return LoadModulesInParallel(dir_path, deferred_modules, options.num_threads);
+    }
+    if (pid == 0) {
+        pid_t loader_pid = fork();
+        if (loader_pid == -1) {
+            PLOG(ERROR) << "fork";
+            _exit(EXIT_FAILURE);
+        }
+        if (loader_pid > 0) {
+            _exit(EXIT_SUCCESS);
+        }
+        bool retval = LoadModulesInParallel(dir_path, deferred_modules, options.num_threads);
+        TraceBootEvent(virt::kBootEventBackgroundModulesLoaded);
+        LOG(INFO) << "Background module loading " << (retval ? "done" : "failed");
+        _exit(retval ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    int status;
+    if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) == -1) {
+        PLOG(ERROR) << "waitpid";
+        return false;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        LOG(ERROR) << "Failed to start the background module loader";
+        return LoadModulesInParallel(dir_path, deferred_modules, options.num_threads);
+    }
+    return true;
+}
+
+bool LoadKernelModules(const ModuleLoadOptions& options) {
     struct utsname uts;
     if (uname(&uts)) {
         LOG(ERROR) << "Failed to get kernel version.";
@@ -78,46 +219,75 @@ bool LoadKernelModules() {
     // /lib/modules/5.4-gki.
     std::sort(module_dirs.begin(), module_dirs.end());
 
+    // Modules are loaded from the first directory which lists any.
     for (const auto& module_dir : module_dirs) {
         std::string dir_path(MODULE_BASE_DIR);
         dir_path.append("/");
         dir_path.append(module_dir);
-        Modprobe m({dir_path});
-        bool retval = m.LoadListedModules();
-        int modules_loaded = m.GetModuleCount();
-        if (modules_loaded > 0) {
-            return retval;
+        TraceBootEvent(virt::kBootEventModuleDir, dir_path);
+        if (auto modules = GetListedModules(dir_path); !modules.empty()) {
+            return LoadListedModules(dir_path, modules, options);
         }
     }
 
-    Modprobe m({MODULE_BASE_DIR});
-    bool retval = m.LoadListedModules();
-    int modules_loaded = m.GetModuleCount();
-    if (modules_loaded > 0) {
-        return retval;
+    TraceBootEvent(virt::kBootEventModuleDir, MODULE_BASE_DIR);
+    if (auto modules = GetListedModules(MODULE_BASE_DIR); !modules.empty()) {
+        return LoadListedModules(MODULE_BASE_DIR, modules, options);
     }
 
     return true;
 }
 
+// Reads the module loading options from the environment, which is cleared afterwards.
+ModuleLoadOptions GetModuleLoadOptions() {
+    ModuleLoadOptions options = {
+            .critical_modules = {},
+            .num_threads = std::max(1u, std::thread::hardware_concurrency()),
+    };
+    if (const char* critical_modules = getenv(CRITICAL_MODULES_ENV); critical_modules != nullptr) {
+        for (const auto& module : Split(critical_modules, ",")) {
+            if (!module.empty()) {
+                options.critical_modules.push_back(CanonicalModuleName(module));
+            }
+        }
+    }
+    if (const char* value = getenv(MODULE_LOAD_THREADS_ENV); value != nullptr) {
+        unsigned int num_threads;
+        if (ParseUint(value, &num_threads, 64u) && num_threads > 0) {
+            options.num_threads = num_threads;
+        } else {
+            LOG(WARNING) << "Ignoring invalid " << MODULE_LOAD_THREADS_ENV << ": " << value;
+        }
+    }
+    return options;
+}
+
 int main(int argc, const char* argv[]) {
+    // Before anything else, so that even the failures of the first boot trace event are logged
+    // to the console.
     SetLogger(StderrLogger);
+    TraceBootEvent(virt::kBootEventInit);
 
     LOG(INFO) << "Guest VM init process";
     LOG(INFO) << "Command line: " << Join(std::vector(argv, argv + argc), " ");
 
+    const ModuleLoadOptions module_load_options = GetModuleLoadOptions();
+
     if (clearenv() != EXIT_SUCCESS) {
         PLOG(ERROR) << "clearenv";
         return EXIT_FAILURE;
     }
+    TraceBootEvent(virt::kBootEventClearenv);
 
     LOG(INFO) << "Loading kernel modules...";
-    if (!LoadKernelModules()) {
+    if (!LoadKernelModules(module_load_options)) {
         LOG(ERROR) << "LoadKernelModules failed";
         return EXIT_FAILURE;
     }
+    TraceBootEvent(virt::kBootEventModulesLoaded);
 
     LOG(INFO) << "Executing test binary " << argv[1] << "...";
+    TraceBootEvent(virt::kBootEventExec, argv[1]);
     execv(argv[1], (char**)(argv + 1));
 
     PLOG(ERROR) << "execv";
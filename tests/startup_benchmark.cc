@@ -0,0 +1,563 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "android-base/file.h"
+#include "android-base/logging.h"
+#include "android-base/result.h"
+#include "android-base/stringprintf.h"
+#include "android-base/unique_fd.h"
+#include "binder/ProcessState.h"
+#include "json/json.h"
+#include "virt/BootTrace.h"
+#include "virt/DeathRecorder.h"
+#include "virt/FileTransfer.h"
+#include "virt/VirtualizationTest.h"
+#include "virt/VmMetrics.h"
+#include "virt/VsockServer.h"
+#include "ziparchive/zip_writer.h"
+
+using namespace android::base;
+using namespace android::os;
+
+extern char** environ;
+
+namespace virt {
+
+static constexpr const char kVmConfigPath[] = "/data/local/tmp/virt-test/vsock_config.json";
+static constexpr const char kZipfusePath[] = "/data/local/tmp/virt-test/zipfuse";
+static constexpr const char kMkPayloadPath[] = "/apex/com.android.virt/bin/mk_payload";
+// The timings of the stages are written there as JSON, for regression tracking.
+static constexpr const char kResultsPath[] = "/data/local/tmp/virt-test/startup_benchmark.json";
+static constexpr int kGuestPort = 45678;
+static constexpr const char kTestMessage[] = "HelloWorld";
+static constexpr int kIterations = 5;
+static constexpr std::chrono::seconds kTimeout(60);
+static constexpr std::chrono::milliseconds kMountPollInterval(1);
+
+// The entries of the apk of the payload. Stored entries are page aligned, as they are in apks.
+struct ApkEntry {
+    const char* name;
+    size_t size;
+    bool compressed;
+};
+static constexpr ApkEntry kApkEntries[] = {
+        {"AndroidManifest.xml", 4 * 1024, true},
+        {"classes.dex", 4 * 1024 * 1024, true},
+        {"resources.arsc", 1024 * 1024, false},
+        {"lib/arm64-v8a/libpayload.so", 2 * 1024 * 1024, false},
+};
+
+using Clock = std::chrono::steady_clock;
+
+// The stages of the startup of a VM from its payload, in the order they run. The stages in the
+// guest are measured with the boot trace of its init.
+struct StartupSample {
+    // Building the payload disk with mk_payload.
+    std::chrono::nanoseconds mk_payload;
+    // From starting zipfuse on the apk of the payload to its first entry being read.
+    std::chrono::nanoseconds zipfuse_mount;
+    // From calling startVm to its return.
+    std::chrono::nanoseconds start_vm;
+    // From the start of the guest kernel to its init.
+    std::chrono::nanoseconds guest_kernel;
+    // The loading of the kernel modules by the guest init.
+    std::chrono::nanoseconds guest_modules;
+    // From the start of the guest init to it executing the test binary.
+    std::chrono::nanoseconds guest_init;
+    // From calling startVm to the message of the guest being received over vsock.
+    std::chrono::nanoseconds first_message;
+    // From building the payload to the message of the guest being received.
+    std::chrono::nanoseconds total;
+    // The metrics of the VM once its message was received, if they could be read.
+    std::optional<VirtualMachineMetrics> metrics;
+};
+
+static constexpr std::pair<const char*, std::chrono::nanoseconds StartupSample::*> kStages[] = {
+        {"mk_payload", &StartupSample::mk_payload},
+        {"zipfuse_mount", &StartupSample::zipfuse_mount},
+        {"start_vm", &StartupSample::start_vm},
+        {"guest_kernel", &StartupSample::guest_kernel},
+        {"guest_modules", &StartupSample::guest_modules},
+        {"guest_init", &StartupSample::guest_init},
+        {"first_message", &StartupSample::first_message},
+        {"total", &StartupSample::total},
+};
+
+namespace {
+
+// The files of the payload, in a temporary directory.
+struct PayloadFiles {
+    std::string config;
+    std::string apk;
+    std::string output;
+    // The zip index of the apk, which mk_payload generates next to the output with --apk-index.
+    std::string apk_index;
+    std::string mount_point;
+};
+
+Result<void> CreateApk(const std::string& path) {
+    std::unique_ptr<FILE, decltype(&fclose)> file(fopen(path.c_str(), "wbe"), fclose);
+    if (!file) {
+        return ErrnoError() << "Failed to create " << path;
+    }
+    ZipWriter writer(file.get());
+    for (const auto& entry : kApkEntries) {
+        const int32_t err = entry.compressed
+                ? writer.StartEntry(entry.name, ZipWriter::kCompress)
+                : writer.StartAlignedEntry(entry.name, 0, getpagesize());
+        if (err != 0) {
+            return Error() << "Failed to add " << entry.name << ": "
+                           << ZipWriter::ErrorCodeString(err);
+        }
+        // Not all zeros, so that the compression has something to do.
+        std::string data(entry.size, '\0');
+        for (size_t i = 0; i < data.size(); i++) {
+            data[i] = static_cast<char>(i % 251 + i / 4096);
+        }
+        if (int32_t err = writer.WriteBytes(data.data(), data.size()); err != 0) {
+            return Error() << "Failed to write " << entry.name << ": "
+                           << ZipWriter::ErrorCodeString(err);
+        }
+        if (int32_t err = writer.FinishEntry(); err != 0) {
+            return Error() << "Failed to finish " << entry.name << ": "
+                           << ZipWriter::ErrorCodeString(err);
+        }
+    }
+    if (int32_t err = writer.Finish(); err != 0) {
+        return Error() << "Failed to finish " << path << ": " << ZipWriter::ErrorCodeString(err);
+    }
+    return {};
+}
+
+// Creates a payload config with only an apk in `dir`.
+Result<PayloadFiles> CreatePayloadFiles(const std::string& dir) {
+    PayloadFiles files = {
+            .config = dir + "/payload_config.json",
+            .apk = dir + "/bench.apk",
+            .output = dir + "/payload.img",
+            .apk_index = dir + "/payload-apk-index.img",
+            .mount_point = dir + "/mnt",
+    };
+    if (auto ret = CreateApk(files.apk); !ret.ok()) {
+        return ret.error();
+    }
+    if (mkdir(files.mount_point.c_str(), 0700) == -1) {
+        return ErrnoError() << "Failed to create " << files.mount_point;
+    }
+    Json::Value config;
+    config["apk"]["name"] = "com.android.virt.bench";
+    config["apk"]["path"] = "bench.apk";
+    if (!WriteStringToFile(Json::writeString(Json::StreamWriterBuilder(), config), files.config)) {
+        return ErrnoError() << "Failed to write " << files.config;
+    }
+    return files;
+}
+
+Result<pid_t> Spawn(const std::vector<std::string>& args) {
+    std::vector<char*> argv;
+    for (const auto& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    pid_t pid;
+    if (int err = posix_spawn(&pid, argv[0], nullptr, nullptr, argv.data(), environ); err != 0) {
+        errno = err;
+        return ErrnoError() << "Failed to spawn " << args[0];
+    }
+    return pid;
+}
+
+Result<void> RunCommand(const std::vector<std::string>& args) {
+    auto pid = Spawn(args);
+    if (!pid.ok()) {
+        return pid.error();
+    }
+    int status;
+    if (TEMP_FAILURE_RETRY(waitpid(*pid, &status, 0)) == -1) {
+        return ErrnoError() << "waitpid";
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return Error() << args[0] << " failed with status " << status;
+    }
+    return {};
+}
+
+// Mounts the apk with zipfuse and reads its first entry, as the guest would do first with it.
+// Unmounts it afterwards.
+Result<void> MountApk(const PayloadFiles& files, Deadline deadline) {
+    struct stat parent;
+    if (stat(Dirname(files.mount_point).c_str(), &parent) == -1) {
+        return ErrnoError() << "Failed to stat the parent of " << files.mount_point;
+    }
+    auto pid = Spawn({kZipfusePath, "--index", files.apk_index, files.apk, files.mount_point});
+    if (!pid.ok()) {
+        return pid.error();
+    }
+
+    auto mounted = [&]() -> Result<void> {
+        // The mount point gets the device of the fuse filesystem once it is mounted.
+        while (true) {
+            struct stat st;
+            if (stat(files.mount_point.c_str(), &st) == -1) {
+                return ErrnoError() << "Failed to stat " << files.mount_point;
+            }
+            if (st.st_dev != parent.st_dev) {
+                break;
+            }
+            int status;
+            if (waitpid(*pid, &status, WNOHANG) == *pid) {
+                *pid = -1;
+                return Error() << "zipfuse exited with status " << status;
+            }
+            if (Clock::now() > deadline) {
+                return Error() << "Timed out waiting for zipfuse to mount " << files.apk;
+            }
+            std::this_thread::sleep_for(kMountPollInterval);
+        }
+        const std::string entry_path = files.mount_point + "/" + kApkEntries[0].name;
+        std::string content;
+        if (!ReadFileToString(entry_path, &content)) {
+            return ErrnoError() << "Failed to read " << entry_path;
+        }
+        if (content.size() != kApkEntries[0].size) {
+            return Error() << "Read " << content.size() << " bytes of " << entry_path
+                           << ", expected " << kApkEntries[0].size;
+        }
+        return {};
+    }();
+
+    if (*pid != -1) {
+        if (umount2(files.mount_point.c_str(), MNT_DETACH) == -1 && errno != EINVAL) {
+            PLOG(WARNING) << "Failed to unmount " << files.mount_point;
+        }
+        kill(*pid, SIGKILL);
+        TEMP_FAILURE_RETRY(waitpid(*pid, nullptr, 0));
+    }
+    return mounted;
+}
+
+// Returns the config of the VM of vsock_config.json, with the payload disk attached.
+Result<std::string> MakeVmConfig(const PayloadFiles& files) {
+    std::string content;
+    if (!ReadFileToString(kVmConfigPath, &content)) {
+        return ErrnoError() << "Failed to read " << kVmConfigPath;
+    }
+    Json::Value config;
+    std::string errors;
+    std::unique_ptr<Json::CharReader> reader(Json::CharReaderBuilder().newCharReader());
+    if (!reader->parse(content.data(), content.data() + content.size(), &config, &errors)) {
+        return Error() << "Failed to parse " << kVmConfigPath << ": " << errors;
+    }
+    Json::Value disk;
+    disk["image"] = files.output;
+    disk["writable"] = false;
+    config["disks"].append(disk);
+    return Json::writeString(Json::StreamWriterBuilder(), config);
+}
+
+// Reads the console output of a guest from `fd` until it is closed, or the deadline. Returns the
+// timestamp of the first occurrence of each boot trace event.
+Result<std::map<std::string, uint64_t>> ReadBootTrace(int fd, Deadline deadline) {
+    std::map<std::string, uint64_t> events;
+    std::string pending;
+    char buf[4096];
+    while (true) {
+        const auto remaining =
+                std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+        if (remaining.count() <= 0) {
+            return Error() << "Timed out reading the console output";
+        }
+        struct pollfd pfd = {.fd = fd, .events = POLLIN, .revents = 0};
+        const int ret = TEMP_FAILURE_RETRY(poll(&pfd, 1, remaining.count()));
+        if (ret == -1) {
+            return ErrnoError() << "Failed to poll the console output";
+        }
+        if (ret == 0) {
+            continue;
+        }
+        const ssize_t size = TEMP_FAILURE_RETRY(read(fd, buf, sizeof(buf)));
+        if (size == -1) {
+            return ErrnoError() << "Failed to read the console output";
+        }
+        if (size == 0) {
+            return events;
+        }
+        pending.append(buf, size);
+        size_t end;
+        while ((end = pending.find('\n')) != std::string::npos) {
+            if (auto event = ParseBootTraceEvent(std::string_view(pending).substr(0, end + 1))) {
+                events.emplace(event->event, event->timestamp_ns);
+            }
+            pending.erase(0, end + 1);
+        }
+    }
+}
+
+// Returns the time between the boot trace events `from` and `to`, or from the boot of the guest
+// kernel if `from` is null.
+Result<std::chrono::nanoseconds> BootInterval(const std::map<std::string, uint64_t>& events,
+                                              const char* from, const char* to) {
+    const auto to_it = events.find(to);
+    if (to_it == events.end()) {
+        return Error() << "Missing boot trace event " << to;
+    }
+    uint64_t from_ns = 0;
+    if (from != nullptr) {
+        const auto from_it = events.find(from);
+        if (from_it == events.end()) {
+            return Error() << "Missing boot trace event " << from;
+        }
+        from_ns = from_it->second;
+    }
+    return std::chrono::nanoseconds(to_it->second - from_ns);
+}
+
+struct Summary {
+    double mean;
+    double p50;
+    double max;
+};
+
+Summary Summarize(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    double sum = 0;
+    for (double value : values) {
+        sum += value;
+    }
+    return {.mean = sum / values.size(), .p50 = values[values.size() / 2], .max = values.back()};
+}
+
+double ToMs(std::chrono::nanoseconds duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+} // namespace
+
+// Runs the whole startup of a VM from its payload, one stage after the other: mk_payload, the
+// mount of the apk by zipfuse, startVm, the boot of the guest kernel and init up to the module
+// loading, and the first message of the guest over vsock.
+class StartupBenchmark : public VirtualizationTest {
+protected:
+    void SetUp() override {
+        VirtualizationTest::SetUp();
+        // Needed to receive the callbacks of the VMs.
+        ProcessState::self()->startThreadPool();
+    }
+
+    Result<StartupSample> RunStartup(const PayloadFiles& files);
+
+    // Reports the mean, median and maximum of each stage in ms, and writes them with all the
+    // samples to kResultsPath.
+    void ReportSamples(const std::vector<StartupSample>& samples);
+};
+
+Result<StartupSample> StartupBenchmark::RunStartup(const PayloadFiles& files) {
+    StartupSample sample = {};
+    const auto deadline = Clock::now() + kTimeout;
+
+    const auto payload_start = Clock::now();
+    auto mk_payload = RunCommand({kMkPayloadPath, "--apk-index", files.config, files.output});
+    if (!mk_payload.ok()) {
+        return mk_payload.error();
+    }
+    sample.mk_payload = Clock::now() - payload_start;
+
+    const auto mount_start = Clock::now();
+    if (auto ret = MountApk(files, deadline); !ret.ok()) {
+        return ret.error();
+    }
+    sample.zipfuse_mount = Clock::now() - mount_start;
+
+    auto vm_config = MakeVmConfig(files);
+    if (!vm_config.ok()) {
+        return vm_config.error();
+    }
+    auto config_fd = CreateMemoryFile("vm_config", 0);
+    if (!config_fd.ok()) {
+        return config_fd.error();
+    }
+    if (!WriteStringToFd(*vm_config, *config_fd) || lseek(*config_fd, 0, SEEK_SET) != 0) {
+        return ErrnoError() << "Failed to write the VM config";
+    }
+    auto server = VsockServer::Listen(kGuestPort);
+    if (!server.ok()) {
+        return server.error();
+    }
+
+    // The console output is read as it comes, so that the guest never waits for it. The pipe is
+    // closed once crosvm exits.
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        return ErrnoError() << "Failed to create the console pipe";
+    }
+    unique_fd console_read(pipe_fds[0]);
+    unique_fd console_write(pipe_fds[1]);
+    Result<std::map<std::string, uint64_t>> boot_trace = Error() << "Not read";
+    std::thread console_reader([&] { boot_trace = ReadBootTrace(console_read.get(), deadline); });
+
+    const auto vm_start = Clock::now();
+    sp<IVirtualMachine> vm;
+    binder::Status status = mVirtManager->startVm(ParcelFileDescriptor(std::move(*config_fd)),
+                                                  ParcelFileDescriptor(std::move(console_write)),
+                                                  &vm);
+    sample.start_vm = Clock::now() - vm_start;
+
+    sp<DeathRecorder> death_recorder = new DeathRecorder();
+    int32_t cid = -1;
+    Result<void> result = [&]() -> Result<void> {
+        if (!status.isOk()) {
+            return Error() << "Error starting VM: " << status;
+        }
+        if (status = vm->getCid(&cid); !status.isOk()) {
+            return Error() << "Error getting the CID of the VM: " << status;
+        }
+        if (status = vm->registerCallback(death_recorder); !status.isOk()) {
+            return Error() << "Error registering the callback of the VM: " << status;
+        }
+        // The VM may have died before the callback was registered.
+        bool running;
+        if (status = vm->isRunning(&running); status.isOk() && !running) {
+            death_recorder->onDied(cid);
+        }
+
+        auto connection = (*server)->Accept(deadline);
+        if (!connection.ok()) {
+            return connection.error();
+        }
+        auto message = ReadToEnd(connection->fd.get(), deadline);
+        if (!message.ok()) {
+            return message.error();
+        }
+        sample.first_message = Clock::now() - vm_start;
+        if (connection->client.cid != static_cast<unsigned int>(cid)) {
+            return Error() << "Got a connection from CID " << connection->client.cid
+                           << " instead of " << cid;
+        }
+        if (*message != kTestMessage) {
+            return Error() << "VM " << cid << " sent wrong message: " << *message;
+        }
+        if (auto metrics = GetVmMetrics(mVirtManager.get(), cid); metrics.ok()) {
+            sample.metrics = std::move(*metrics);
+        } else {
+            LOG(WARNING) << metrics.error();
+        }
+        return {};
+    }();
+
+    // The guest shuts down once it has sent its message, which closes the console.
+    console_reader.join();
+    if (!result.ok()) {
+        return result.error();
+    }
+    if (!death_recorder->WaitForDeath(deadline).has_value()) {
+        return Error() << "VM " << cid << " didn't die";
+    }
+    if (!boot_trace.ok()) {
+        return boot_trace.error();
+    }
+
+    auto guest_kernel = BootInterval(*boot_trace, nullptr, kBootEventInit);
+    auto guest_modules = BootInterval(*boot_trace, kBootEventClearenv, kBootEventModulesLoaded);
+    auto guest_init = BootInterval(*boot_trace, kBootEventInit, kBootEventExec);
+    for (const auto* interval : {&guest_kernel, &guest_modules, &guest_init}) {
+        if (!interval->ok()) {
+            return interval->error();
+        }
+    }
+    sample.guest_kernel = *guest_kernel;
+    sample.guest_modules = *guest_modules;
+    sample.guest_init = *guest_init;
+    sample.total = sample.mk_payload + sample.zipfuse_mount + sample.first_message;
+    return sample;
+}
+
+void StartupBenchmark::ReportSamples(const std::vector<StartupSample>& samples) {
+    if (samples.empty()) {
+        return;
+    }
+    Json::Value results;
+    results["iterations"] = static_cast<Json::UInt>(samples.size());
+    for (const auto& [name, stage] : kStages) {
+        std::vector<double> ms;
+        Json::Value stage_results;
+        stage_results["name"] = name;
+        for (const auto& sample : samples) {
+            ms.push_back(ToMs(sample.*stage));
+            stage_results["samples_ms"].append(ms.back());
+        }
+        const Summary summary = Summarize(ms);
+        ReportMetric(StringPrintf("startup_%s_mean_ms", name), summary.mean);
+        ReportMetric(StringPrintf("startup_%s_p50_ms", name), summary.p50);
+        ReportMetric(StringPrintf("startup_%s_max_ms", name), summary.max);
+        stage_results["mean_ms"] = summary.mean;
+        stage_results["p50_ms"] = summary.p50;
+        stage_results["max_ms"] = summary.max;
+        results["stages"].append(stage_results);
+    }
+
+    std::map<std::string, std::vector<double>> vm_metrics;
+    for (const auto& sample : samples) {
+        if (sample.metrics.has_value()) {
+            for (auto& [name, value] : VmMetricValues(*sample.metrics)) {
+                vm_metrics[name].push_back(value);
+            }
+        }
+    }
+    for (const auto& [name, values] : vm_metrics) {
+        const double mean = Summarize(values).mean;
+        ReportMetric(StringPrintf("startup_vm_%s_mean", name.c_str()), mean);
+        results["vm_metrics"][name + "_mean"] = mean;
+    }
+
+    const std::string json = Json::writeString(Json::StreamWriterBuilder(), results);
+    EXPECT_TRUE(WriteStringToFile(json, kResultsPath))
+            << "Failed to write " << kResultsPath << ": " << strerror(errno);
+}
+
+TEST_F(StartupBenchmark, PayloadToFirstMessage) {
+    TemporaryDir dir;
+    auto files = CreatePayloadFiles(dir.path);
+    ASSERT_TRUE(files.ok()) << files.error();
+
+    std::vector<StartupSample> samples;
+    for (int i = 0; i < kIterations; i++) {
+        auto sample = RunStartup(*files);
+        ASSERT_TRUE(sample.ok()) << "Iteration " << i << ": " << sample.error();
+        samples.push_back(std::move(*sample));
+    }
+    ReportSamples(samples);
+}
+
+} // namespace virt
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "virt/VmMetrics.h"
+
+#include <algorithm>
+
+using namespace android::base;
+using namespace android::system::virtmanager;
+
+namespace virt {
+
+static constexpr double kNanosPerMs = 1e6;
+static constexpr double kBytesPerMib = 1 << 20;
+
+Result<VirtualMachineMetrics> GetVmMetrics(IVirtManager* virt_manager, int32_t cid) {
+    std::vector<VirtualMachineMetrics> vms;
+    auto status = virt_manager->debugListVmMetrics(&vms);
+    if (!status.isOk()) {
+        return Error() << "Failed to list the metrics of the VMs: " << status;
+    }
+    auto it = std::find_if(vms.begin(), vms.end(),
+                           [cid](const VirtualMachineMetrics& vm) { return vm.cid == cid; });
+    if (it == vms.end()) {
+        return Error() << "VM " << cid << " isn't running";
+    }
+    return *it;
+}
+
+std::vector<std::pair<std::string, double>> VmMetricValues(const VirtualMachineMetrics& metrics) {
+    return {
+            {"time_to_spawn_ms", metrics.timeToSpawnNanos / kNanosPerMs},
+            {"rss_mib", metrics.rssBytes / kBytesPerMib},
+            {"vcpu_time_ms", metrics.vcpuTimeNanos / kNanosPerMs},
+            {"storage_read_mib", metrics.storageBytesRead / kBytesPerMib},
+            {"read_mib", metrics.bytesRead / kBytesPerMib},
+    };
+}
+
+} // namespace virt
@@ -0,0 +1,324 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "android-base/file.h"
+#include "android-base/logging.h"
+#include "android-base/result.h"
+#include "android-base/stringprintf.h"
+#include "android-base/unique_fd.h"
+#include "virt/FileTransfer.h"
+#include "virt/VirtualizationTest.h"
+#include "virt/VsockBench.h"
+#include "virt/VsockServer.h"
+
+using namespace android::base;
+using namespace android::os;
+
+namespace virt {
+
+static constexpr int kBenchPort = 45679;
+static constexpr const char kVmConfigPath[] = "/data/local/tmp/virt-test/vsock_bench_config.json";
+static constexpr std::chrono::seconds kAcceptTimeout(30);
+// How long each measurement may take before the guest is considered stuck.
+static constexpr std::chrono::seconds kIoTimeout(60);
+
+// Each throughput measurement transfers this many bytes over all the connections.
+static constexpr uint64_t kBytesPerMeasurement = 16 * 1024 * 1024;
+static constexpr uint32_t kMessageSizes[] = {
+        64, 256, 1024, 4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024,
+};
+static constexpr size_t kConnectionCounts[] = {1, 2, 4, 8};
+static constexpr uint32_t kLatencyMessageSizes[] = {64, 4 * 1024, 64 * 1024};
+static constexpr uint64_t kRoundTrips = 1000;
+static constexpr int kConnectRounds = 20;
+static constexpr uint64_t kFileSizes[] = {1024 * 1024, 16 * 1024 * 1024, 64 * 1024 * 1024};
+static constexpr uint32_t kFileChunkSize = 1024 * 1024;
+
+using Clock = std::chrono::steady_clock;
+
+static_assert(kMessageSizes[std::size(kMessageSizes) - 1] <= kVsockBenchMaxMessageSize);
+
+Result<void> SendRequest(int fd, VsockBenchOp op, uint32_t size, uint64_t count,
+                         Deadline deadline) {
+    const VsockBenchRequest request = {.op = op, .size = size, .count = count};
+    return SendFully(fd, &request, sizeof(request), deadline);
+}
+
+// Runs the guest side of the benchmarks (vsock_client --bench) in a VM.
+class VsockBenchmark : public VirtualizationTest {
+protected:
+    void SetUp() override {
+        VirtualizationTest::SetUp();
+        if (HasFatalFailure()) {
+            return;
+        }
+
+        auto server = VsockServer::Listen(kBenchPort);
+        ASSERT_TRUE(server.ok()) << server.error();
+        mServer = std::move(*server);
+
+        unique_fd vm_config_fd(open(kVmConfigPath, O_RDONLY | O_CLOEXEC));
+        binder::Status status =
+                mVirtManager->startVm(ParcelFileDescriptor(std::move(vm_config_fd)), std::nullopt,
+                                      &mVm);
+        ASSERT_TRUE(status.isOk()) << "Error starting VM: " << status;
+
+        auto connection = mServer->Accept(Clock::now() + kAcceptTimeout);
+        ASSERT_TRUE(connection.ok()) << "Guest didn't connect: " << connection.error();
+        mControlFd = std::move(connection->fd);
+    }
+
+    // Makes the guest open `count` connections to the host, and accepts them.
+    void OpenConnections(size_t count, std::vector<unique_fd>* connections) {
+        const Deadline deadline = Clock::now() + kAcceptTimeout;
+        auto sent = SendRequest(mControlFd, VsockBenchOp::kConnect, 0, count, deadline);
+        ASSERT_TRUE(sent.ok()) << sent.error();
+        for (size_t i = 0; i < count; i++) {
+            auto connection = mServer->Accept(deadline);
+            ASSERT_TRUE(connection.ok()) << "Guest didn't connect: " << connection.error();
+            // SendFileToSocket and ReceiveSocketToFile block on the socket, and take no deadline.
+            const struct timeval timeout = {.tv_sec = kIoTimeout.count(), .tv_usec = 0};
+            ASSERT_EQ(setsockopt(connection->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                                 sizeof(timeout)),
+                      0)
+                    << strerror(errno);
+            ASSERT_EQ(setsockopt(connection->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                                 sizeof(timeout)),
+                      0)
+                    << strerror(errno);
+            connections->push_back(std::move(connection->fd));
+        }
+        uint64_t connected;
+        auto received = ReceiveFully(mControlFd, &connected, sizeof(connected), deadline);
+        ASSERT_TRUE(received.ok()) << received.error();
+        ASSERT_EQ(connected, count);
+    }
+
+    // Runs `fn` on each connection in a thread of its own and returns the time it took in seconds.
+    double RunOnConnections(const std::vector<unique_fd>& connections,
+                            const std::function<void(int fd, size_t index)>& fn) {
+        const auto start = Clock::now();
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < connections.size(); i++) {
+            threads.emplace_back(fn, connections[i].get(), i);
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    std::unique_ptr<VsockServer> mServer;
+    sp<IVirtualMachine> mVm;
+    unique_fd mControlFd;
+};
+
+TEST_F(VsockBenchmark, Throughput) {
+    for (size_t num_connections : kConnectionCounts) {
+        std::vector<unique_fd> connections;
+        ASSERT_NO_FATAL_FAILURE(OpenConnections(num_connections, &connections));
+        std::vector<std::vector<char>> bufs(num_connections,
+                                            std::vector<char>(kVsockBenchMaxMessageSize));
+
+        for (uint32_t size : kMessageSizes) {
+            const uint64_t count =
+                    std::max<uint64_t>(1, kBytesPerMeasurement / size / num_connections);
+            const double bytes = static_cast<double>(size) * count * num_connections;
+
+            const double sink_seconds = RunOnConnections(connections, [&](int fd, size_t index) {
+                const Deadline deadline = Clock::now() + kIoTimeout;
+                auto ret = SendRequest(fd, VsockBenchOp::kSink, size, count, deadline);
+                ASSERT_TRUE(ret.ok()) << ret.error();
+                for (uint64_t i = 0; i < count; i++) {
+                    ret = SendFully(fd, bufs[index].data(), size, deadline);
+                    ASSERT_TRUE(ret.ok()) << ret.error();
+                }
+                uint64_t received;
+                ret = ReceiveFully(fd, &received, sizeof(received), deadline);
+                ASSERT_TRUE(ret.ok()) << ret.error();
+                ASSERT_EQ(received, size * count);
+            });
+            ASSERT_FALSE(HasFailure());
+
+            const double source_seconds = RunOnConnections(connections, [&](int fd, size_t index) {
+                const Deadline deadline = Clock::now() + kIoTimeout;
+                auto ret = SendRequest(fd, VsockBenchOp::kSource, size, count, deadline);
+                ASSERT_TRUE(ret.ok()) << ret.error();
+                for (uint64_t i = 0; i < count; i++) {
+                    ret = ReceiveFully(fd, bufs[index].data(), size, deadline);
+                    ASSERT_TRUE(ret.ok()) << ret.error();
+                }
+            });
+            ASSERT_FALSE(HasFailure());
+
+            ReportMetric(StringPrintf("host_to_guest_MBps_%uB_%zuconn", size, num_connections),
+                         bytes / sink_seconds / 1e6);
+            ReportMetric(StringPrintf("guest_to_host_MBps_%uB_%zuconn", size, num_connections),
+                         bytes / source_seconds / 1e6);
+        }
+    }
+}
+
+TEST_F(VsockBenchmark, Latency) {
+    for (size_t num_connections : kConnectionCounts) {
+        std::vector<unique_fd> connections;
+        ASSERT_NO_FATAL_FAILURE(OpenConnections(num_connections, &connections));
+
+        for (uint32_t size : kLatencyMessageSizes) {
+            std::vector<std::vector<uint64_t>> round_trips_ns(num_connections);
+            RunOnConnections(connections, [&](int fd, size_t index) {
+                std::vector<char> buf(size);
+                const Deadline deadline = Clock::now() + kIoTimeout;
+                auto ret = SendRequest(fd, VsockBenchOp::kEcho, size, kRoundTrips, deadline);
+                ASSERT_TRUE(ret.ok()) << ret.error();
+                for (uint64_t i = 0; i < kRoundTrips; i++) {
+                    const auto start = Clock::now();
+                    ret = SendFully(fd, buf.data(), size, deadline);
+                    ASSERT_TRUE(ret.ok()) << ret.error();
+                    ret = ReceiveFully(fd, buf.data(), size, deadline);
+                    ASSERT_TRUE(ret.ok()) << ret.error();
+                    round_trips_ns[index].push_back(
+                            std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                                                 start)
+                                    .count());
+                }
+            });
+            ASSERT_FALSE(HasFailure());
+
+            std::vector<uint64_t> all_ns;
+            for (const auto& ns : round_trips_ns) {
+                all_ns.insert(all_ns.end(), ns.begin(), ns.end());
+            }
+            std::sort(all_ns.begin(), all_ns.end());
+            auto percentile_us = [&](double p) {
+                return all_ns[std::min(all_ns.size() - 1, static_cast<size_t>(all_ns.size() * p))] /
+                        1e3;
+            };
+            ReportMetric(StringPrintf("round_trip_p50_us_%uB_%zuconn", size, num_connections),
+                         percentile_us(0.50));
+            ReportMetric(StringPrintf("round_trip_p99_us_%uB_%zuconn", size, num_connections),
+                         percentile_us(0.99));
+        }
+    }
+}
+
+TEST_F(VsockBenchmark, ConnectionSetup) {
+    for (size_t num_connections : kConnectionCounts) {
+        const auto start = Clock::now();
+        for (int round = 0; round < kConnectRounds; round++) {
+            std::vector<unique_fd> connections;
+            ASSERT_NO_FATAL_FAILURE(OpenConnections(num_connections, &connections));
+        }
+        const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        ReportMetric(StringPrintf("connections_per_s_%zuconn", num_connections),
+                     num_connections * kConnectRounds / seconds);
+    }
+}
+
+// Compares copying through user space buffers with SendFileToSocket and ReceiveSocketToFile, which
+// move the data between the file and the socket in the kernel.
+TEST_F(VsockBenchmark, FileTransfer) {
+    std::vector<unique_fd> connections;
+    ASSERT_NO_FATAL_FAILURE(OpenConnections(1, &connections));
+    const int fd = connections[0];
+    std::vector<char> buf(kFileChunkSize);
+
+    for (uint64_t size : kFileSizes) {
+        const uint64_t count = size / kFileChunkSize;
+        auto measure = [](const std::function<void()>& fn) {
+            const auto start = Clock::now();
+            fn();
+            return std::chrono::duration<double>(Clock::now() - start).count();
+        };
+
+        const double copy_sink_seconds = measure([&]() {
+            const Deadline deadline = Clock::now() + kIoTimeout;
+            auto ret = SendRequest(fd, VsockBenchOp::kSink, kFileChunkSize, count, deadline);
+            ASSERT_TRUE(ret.ok()) << ret.error();
+            for (uint64_t i = 0; i < count; i++) {
+                ret = SendFully(fd, buf.data(), kFileChunkSize, deadline);
+                ASSERT_TRUE(ret.ok()) << ret.error();
+            }
+            uint64_t received;
+            ret = ReceiveFully(fd, &received, sizeof(received), deadline);
+            ASSERT_TRUE(ret.ok()) << ret.error();
+            ASSERT_EQ(received, size);
+        });
+        ASSERT_FALSE(HasFailure());
+
+        auto source_file = CreateMemoryFile("vsock_bench_source", size);
+        ASSERT_TRUE(source_file.ok()) << source_file.error();
+        const double in_kernel_sink_seconds = measure([&]() {
+            const Deadline deadline = Clock::now() + kIoTimeout;
+            auto ret = SendRequest(fd, VsockBenchOp::kSinkFile, kFileChunkSize, size, deadline);
+            ASSERT_TRUE(ret.ok()) << ret.error();
+            ret = SendFileToSocket(fd, *source_file, size, kFileChunkSize);
+            ASSERT_TRUE(ret.ok()) << ret.error();
+            uint64_t received;
+            ret = ReceiveFully(fd, &received, sizeof(received), deadline);
+            ASSERT_TRUE(ret.ok()) << ret.error();
+            ASSERT_EQ(received, size);
+        });
+        ASSERT_FALSE(HasFailure());
+
+        const double copy_source_seconds = measure([&]() {
+            const Deadline deadline = Clock::now() + kIoTimeout;
+            auto ret = SendRequest(fd, VsockBenchOp::kSource, kFileChunkSize, count, deadline);
+            ASSERT_TRUE(ret.ok()) << ret.error();
+            for (uint64_t i = 0; i < count; i++) {
+                ret = ReceiveFully(fd, buf.data(), kFileChunkSize, deadline);
+                ASSERT_TRUE(ret.ok()) << ret.error();
+            }
+        });
+        ASSERT_FALSE(HasFailure());
+
+        auto sink_file = CreateMemoryFile("vsock_bench_sink", 0);
+        ASSERT_TRUE(sink_file.ok()) << sink_file.error();
+        const double in_kernel_source_seconds = measure([&]() {
+            auto ret = SendRequest(fd, VsockBenchOp::kSourceFile, kFileChunkSize, size,
+                                   Clock::now() + kIoTimeout);
+            ASSERT_TRUE(ret.ok()) << ret.error();
+            ret = ReceiveSocketToFile(fd, *sink_file, size);
+            ASSERT_TRUE(ret.ok()) << ret.error();
+        });
+        ASSERT_FALSE(HasFailure());
+
+        const uint64_t size_mb = size / (1024 * 1024);
+        ReportMetric(StringPrintf("host_to_guest_copy_MBps_%" PRIu64 "MB", size_mb),
+                     size / copy_sink_seconds / 1e6);
+        ReportMetric(StringPrintf("host_to_guest_in_kernel_MBps_%" PRIu64 "MB", size_mb),
+                     size / in_kernel_sink_seconds / 1e6);
+        ReportMetric(StringPrintf("guest_to_host_copy_MBps_%" PRIu64 "MB", size_mb),
+                     size / copy_source_seconds / 1e6);
+        ReportMetric(StringPrintf("guest_to_host_in_kernel_MBps_%" PRIu64 "MB", size_mb),
+                     size / in_kernel_source_seconds / 1e6);
+    }
+}
+
+} // namespace virt
@@ -20,28 +20,28 @@
 #include <linux/vm_sockets.h>
 
 #include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "android-base/file.h"
 #include "android-base/logging.h"
 #include "android-base/parseint.h"
 #include "android-base/unique_fd.h"
+#include "virt/FileTransfer.h"
+#include "virt/VsockBench.h"
 
 using namespace android::base;
+using namespace virt;
 
-int main(int argc, const char *argv[]) {
-    SetLogger(StderrLogger);
-
-    unsigned int cid, port;
-    if (argc != 4 || !ParseUint(argv[1], &cid) || !ParseUint(argv[2], &port)) {
-        LOG(ERROR) << "Usage: " << argv[0] << " <cid> <port> <msg>";
-        return EXIT_FAILURE;
-    }
-    std::string msg(argv[3]);
+static constexpr const char kBenchArg[] = "--bench";
+static constexpr const char kListenArg[] = "--listen";
 
+unique_fd ConnectToHost(unsigned int cid, unsigned int port) {
     unique_fd fd(TEMP_FAILURE_RETRY(socket(AF_VSOCK, SOCK_STREAM, 0)));
     if (fd < 0) {
         PLOG(ERROR) << "socket";
-        return EXIT_FAILURE;
+        return {};
     }
 
     struct sockaddr_vm sa = (struct sockaddr_vm){
@@ -50,12 +50,175 @@ int main(int argc, const char *argv[]) {
             .svm_cid = cid,
     };
 
-    LOG(INFO) << "Connecting to CID " << cid << " on port " << port << "...";
     int ret = TEMP_FAILURE_RETRY(connect(fd, (struct sockaddr *)&sa, sizeof(sa)));
     if (ret < 0) {
         PLOG(ERROR) << "connect";
+        return {};
+    }
+    return fd;
+}
+
+// Waits for the host to connect on `port`, for guests which may boot before the host listens
+// (e.g. in the warm pool of the Virt Manager).
+unique_fd AcceptFromHost(unsigned int port) {
+    unique_fd server_fd(TEMP_FAILURE_RETRY(socket(AF_VSOCK, SOCK_STREAM, 0)));
+    if (server_fd < 0) {
+        PLOG(ERROR) << "socket";
+        return {};
+    }
+
+    struct sockaddr_vm sa = (struct sockaddr_vm){
+            .svm_family = AF_VSOCK,
+            .svm_port = port,
+            .svm_cid = VMADDR_CID_ANY,
+    };
+
+    if (TEMP_FAILURE_RETRY(bind(server_fd, (struct sockaddr *)&sa, sizeof(sa))) < 0) {
+        PLOG(ERROR) << "bind";
+        return {};
+    }
+    if (TEMP_FAILURE_RETRY(listen(server_fd, 1)) < 0) {
+        PLOG(ERROR) << "listen";
+        return {};
+    }
+    unique_fd fd(TEMP_FAILURE_RETRY(accept(server_fd, nullptr, nullptr)));
+    if (fd < 0) {
+        PLOG(ERROR) << "accept";
+        return {};
+    }
+    return fd;
+}
+
+// Serves the requests of the host (see virt/VsockBench.h) until it closes the connection.
+bool ServeBenchmark(int fd, unsigned int cid, unsigned int port) {
+    std::vector<char> buf;
+    VsockBenchRequest request;
+    while (ReadFully(fd, &request, sizeof(request))) {
+        if (request.size > kVsockBenchMaxMessageSize) {
+            LOG(ERROR) << "Message too large: " << request.size;
+            return false;
+        }
+        if (buf.size() < request.size) {
+            buf.resize(request.size);
+        }
+        switch (request.op) {
+            case VsockBenchOp::kSink: {
+                uint64_t received = 0;
+                for (uint64_t i = 0; i < request.count; i++) {
+                    if (!ReadFully(fd, buf.data(), request.size)) {
+                        PLOG(ERROR) << "ReadFully";
+                        return false;
+                    }
+                    received += request.size;
+                }
+                if (!WriteFully(fd, &received, sizeof(received))) {
+                    PLOG(ERROR) << "WriteFully";
+                    return false;
+                }
+                break;
+            }
+            case VsockBenchOp::kSource:
+                for (uint64_t i = 0; i < request.count; i++) {
+                    if (!WriteFully(fd, buf.data(), request.size)) {
+                        PLOG(ERROR) << "WriteFully";
+                        return false;
+                    }
+                }
+                break;
+            case VsockBenchOp::kEcho:
+                for (uint64_t i = 0; i < request.count; i++) {
+                    if (!ReadFully(fd, buf.data(), request.size) ||
+                        !WriteFully(fd, buf.data(), request.size)) {
+                        PLOG(ERROR) << "echo";
+                        return false;
+                    }
+                }
+                break;
+            case VsockBenchOp::kConnect: {
+                uint64_t connected = 0;
+                for (; connected < request.count; connected++) {
+                    unique_fd conn = ConnectToHost(cid, port);
+                    if (!conn.ok()) {
+                        break;
+                    }
+                    std::thread([conn = std::move(conn), cid, port]() {
+                        ServeBenchmark(conn, cid, port);
+                    }).detach();
+                }
+                if (!WriteFully(fd, &connected, sizeof(connected))) {
+                    PLOG(ERROR) << "WriteFully";
+                    return false;
+                }
+                break;
+            }
+            case VsockBenchOp::kSinkFile: {
+                auto file = CreateMemoryFile("vsock_bench_sink", 0);
+                if (!file.ok()) {
+                    LOG(ERROR) << file.error();
+                    return false;
+                }
+                if (auto ret = ReceiveSocketToFile(fd, *file, request.count); !ret.ok()) {
+                    LOG(ERROR) << ret.error();
+                    return false;
+                }
+                if (!WriteFully(fd, &request.count, sizeof(request.count))) {
+                    PLOG(ERROR) << "WriteFully";
+                    return false;
+                }
+                break;
+            }
+            case VsockBenchOp::kSourceFile: {
+                auto file = CreateMemoryFile("vsock_bench_source", request.count);
+                if (!file.ok()) {
+                    LOG(ERROR) << file.error();
+                    return false;
+                }
+                if (auto ret = SendFileToSocket(fd, *file, request.count, request.size);
+                    !ret.ok()) {
+                    LOG(ERROR) << ret.error();
+                    return false;
+                }
+                break;
+            }
+            default:
+                LOG(ERROR) << "Unknown request " << static_cast<uint32_t>(request.op);
+                return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, const char *argv[]) {
+    SetLogger(StderrLogger);
+
+    unsigned int cid, port;
+    // The benchmark connects back to the host, so it needs its CID.
+    const bool wait_for_host = argc == 4 && argv[1] == std::string(kListenArg) &&
+            argv[3] != std::string(kBenchArg);
+    if (argc != 4 || (!wait_for_host && !ParseUint(argv[1], &cid)) ||
+        !ParseUint(argv[2], &port)) {
+        LOG(ERROR) << "Usage: " << argv[0] << " <cid> <port> <msg>|" << kBenchArg << "\n"
+                   << "       " << argv[0] << " " << kListenArg << " <port> <msg>";
         return EXIT_FAILURE;
     }
+    std::string msg(argv[3]);
+
+    unique_fd fd;
+    if (wait_for_host) {
+        LOG(INFO) << "Waiting for the host on port " << port << "...";
+        fd = AcceptFromHost(port);
+    } else {
+        LOG(INFO) << "Connecting to CID " << cid << " on port " << port << "...";
+        fd = ConnectToHost(cid, port);
+    }
+    if (!fd.ok()) {
+        return EXIT_FAILURE;
+    }
+
+    if (msg == kBenchArg) {
+        LOG(INFO) << "Serving benchmark requests...";
+        return ServeBenchmark(fd, cid, port) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
     LOG(INFO) << "Sending message to server...";
     if (!WriteStringToFd(msg, fd)) {
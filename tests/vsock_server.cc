@@ -0,0 +1,311 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "virt/VsockServer.h"
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Needs to be included after sys/socket.h
+#include <linux/vm_sockets.h>
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <thread>
+
+using android::base::ErrnoError;
+using android::base::Error;
+using android::base::Result;
+using android::base::unique_fd;
+
+namespace virt {
+
+namespace {
+
+// Connecting to a guest which is still booting would otherwise wait for the default timeout of
+// vsock, 2s.
+constexpr std::chrono::milliseconds kGuestConnectTimeout(100);
+constexpr std::chrono::milliseconds kGuestConnectRetryInterval(10);
+
+// Returns the time left until `deadline` as a timeout for poll and epoll_wait.
+int RemainingMs(Deadline deadline) {
+    const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now());
+    return std::max<int64_t>(0, remaining.count());
+}
+
+// Waits until one of `events` happens on `fd`. Returns false on timeout.
+Result<bool> WaitFor(int fd, short events, Deadline deadline) {
+    struct pollfd pfd = {.fd = fd, .events = events, .revents = 0};
+    int ret = TEMP_FAILURE_RETRY(poll(&pfd, 1, RemainingMs(deadline)));
+    if (ret < 0) {
+        return ErrnoError() << "poll failed";
+    }
+    return ret > 0;
+}
+
+// Waits until `fd` is readable. Returns false on timeout.
+Result<bool> WaitReadable(int fd, Deadline deadline) {
+    return WaitFor(fd, POLLIN, deadline);
+}
+
+// Accepts a connection from the backlog, if there is any.
+Result<std::optional<VsockConnection>> TryAccept(int server_fd, int flags) {
+    struct sockaddr_vm sa;
+    socklen_t sa_len = sizeof(sa);
+    unique_fd fd(TEMP_FAILURE_RETRY(
+            accept4(server_fd, (struct sockaddr *)&sa, &sa_len, flags | SOCK_CLOEXEC)));
+    if (fd < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return std::nullopt;
+        }
+        return ErrnoError() << "accept4 failed";
+    }
+    return VsockConnection{.fd = std::move(fd), .client = {.cid = sa.svm_cid, .port = sa.svm_port}};
+}
+
+} // namespace
+
+Result<std::unique_ptr<VsockServer>> VsockServer::Listen(unsigned int port) {
+    unique_fd fd(TEMP_FAILURE_RETRY(
+            socket(AF_VSOCK, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)));
+    if (fd < 0) {
+        return ErrnoError() << "socket failed";
+    }
+    struct sockaddr_vm sa = (struct sockaddr_vm){
+            .svm_family = AF_VSOCK,
+            .svm_port = port,
+            .svm_cid = VMADDR_CID_ANY,
+    };
+    if (TEMP_FAILURE_RETRY(bind(fd, (struct sockaddr *)&sa, sizeof(sa))) != 0) {
+        return ErrnoError() << "bind to port " << port << " failed";
+    }
+    if (TEMP_FAILURE_RETRY(listen(fd, SOMAXCONN)) != 0) {
+        return ErrnoError() << "listen failed";
+    }
+    return std::unique_ptr<VsockServer>(new VsockServer(std::move(fd)));
+}
+
+Result<VsockConnection> VsockServer::Accept(Deadline deadline) {
+    while (true) {
+        auto readable = WaitReadable(mFd, deadline);
+        if (!readable.ok()) {
+            return readable.error();
+        }
+        if (!*readable) {
+            return Error() << "timed out waiting for a connection";
+        }
+        auto connection = TryAccept(mFd, 0);
+        if (!connection.ok()) {
+            return connection.error();
+        }
+        if (connection->has_value()) {
+            return std::move(**connection);
+        }
+    }
+}
+
+Result<void> VsockServer::ServeClients(size_t num_clients, Deadline deadline,
+                                       const ConnectCallback& on_connect,
+                                       const CloseCallback& on_close) {
+    unique_fd epoll_fd(epoll_create1(EPOLL_CLOEXEC));
+    if (epoll_fd < 0) {
+        return ErrnoError() << "epoll_create1 failed";
+    }
+    auto add = [&](int fd) -> Result<void> {
+        struct epoll_event event = {.events = EPOLLIN, .data = {.fd = fd}};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            return ErrnoError() << "epoll_ctl failed";
+        }
+        return {};
+    };
+    if (auto ret = add(mFd); !ret.ok()) {
+        return ret;
+    }
+
+    struct Client {
+        VsockConnection connection;
+        std::string received;
+    };
+    std::map<int, Client> clients;
+    size_t num_closed = 0;
+    while (num_closed < num_clients) {
+        struct epoll_event events[16];
+        int num_events = TEMP_FAILURE_RETRY(
+                epoll_wait(epoll_fd, events, std::size(events), RemainingMs(deadline)));
+        if (num_events < 0) {
+            return ErrnoError() << "epoll_wait failed";
+        }
+        if (num_events == 0) {
+            return Error() << "timed out with " << num_closed << " of " << num_clients
+                           << " clients served";
+        }
+        for (int i = 0; i < num_events; i++) {
+            if (events[i].data.fd == mFd) {
+                while (true) {
+                    auto connection = TryAccept(mFd, SOCK_NONBLOCK);
+                    if (!connection.ok()) {
+                        return connection.error();
+                    }
+                    if (!connection->has_value()) {
+                        break;
+                    }
+                    const int fd = (*connection)->fd;
+                    if (auto ret = add(fd); !ret.ok()) {
+                        return ret;
+                    }
+                    on_connect((*connection)->client);
+                    clients[fd] = {.connection = std::move(**connection), .received = {}};
+                }
+                continue;
+            }
+
+            auto it = clients.find(events[i].data.fd);
+            if (it == clients.end()) {
+                continue;
+            }
+            Client& client = it->second;
+            char buf[4096];
+            ssize_t n;
+            while ((n = TEMP_FAILURE_RETRY(read(client.connection.fd, buf, sizeof(buf)))) > 0) {
+                client.received.append(buf, n);
+            }
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                return ErrnoError() << "read from CID " << client.connection.client.cid
+                                    << " failed";
+            }
+            if (n == 0) {
+                on_close(client.connection.client, std::move(client.received));
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client.connection.fd, nullptr);
+                clients.erase(it);
+                num_closed++;
+            }
+        }
+    }
+    return {};
+}
+
+Result<unique_fd> ConnectToGuest(unsigned int cid, unsigned int port, Deadline deadline) {
+    struct sockaddr_vm sa = (struct sockaddr_vm){
+            .svm_family = AF_VSOCK,
+            .svm_port = port,
+            .svm_cid = cid,
+    };
+    struct timeval timeout = {
+            .tv_sec = 0,
+            .tv_usec = std::chrono::microseconds(kGuestConnectTimeout).count(),
+    };
+    while (true) {
+        unique_fd fd(TEMP_FAILURE_RETRY(socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0)));
+        if (fd < 0) {
+            return ErrnoError() << "socket failed";
+        }
+        if (setsockopt(fd, AF_VSOCK, SO_VM_SOCKETS_CONNECT_TIMEOUT, &timeout, sizeof(timeout)) !=
+            0) {
+            return ErrnoError() << "setsockopt(SO_VM_SOCKETS_CONNECT_TIMEOUT) failed";
+        }
+        if (TEMP_FAILURE_RETRY(connect(fd, (struct sockaddr *)&sa, sizeof(sa))) == 0) {
+            return fd;
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return ErrnoError() << "connect to CID " << cid << " on port " << port << " failed";
+        }
+        std::this_thread::sleep_for(kGuestConnectRetryInterval);
+    }
+}
+
+Result<std::string> ReadToEnd(int fd, Deadline deadline) {
+    std::string content;
+    char buf[4096];
+    while (true) {
+        auto readable = WaitReadable(fd, deadline);
+        if (!readable.ok()) {
+            return readable.error();
+        }
+        if (!*readable) {
+            return Error() << "timed out after reading " << content.size() << " bytes";
+        }
+        ssize_t n = TEMP_FAILURE_RETRY(read(fd, buf, sizeof(buf)));
+        if (n == 0) {
+            return content;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                continue;
+            }
+            return ErrnoError() << "read failed";
+        }
+        content.append(buf, n);
+    }
+}
+
+Result<void> SendFully(int fd, const void* data, size_t size, Deadline deadline) {
+    const char* p = static_cast<const char*>(data);
+    size_t sent = 0;
+    while (sent < size) {
+        ssize_t n =
+                TEMP_FAILURE_RETRY(send(fd, p + sent, size - sent, MSG_DONTWAIT | MSG_NOSIGNAL));
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return ErrnoError() << "send failed";
+            }
+            auto writable = WaitFor(fd, POLLOUT, deadline);
+            if (!writable.ok()) {
+                return writable.error();
+            }
+            if (!*writable) {
+                return Error() << "timed out after sending " << sent << " of " << size << " bytes";
+            }
+            continue;
+        }
+        sent += n;
+    }
+    return {};
+}
+
+Result<void> ReceiveFully(int fd, void* data, size_t size, Deadline deadline) {
+    char* p = static_cast<char*>(data);
+    size_t received = 0;
+    while (received < size) {
+        ssize_t n = TEMP_FAILURE_RETRY(recv(fd, p + received, size - received, MSG_DONTWAIT));
+        if (n == 0) {
+            return Error() << "connection closed after receiving " << received << " of " << size
+                           << " bytes";
+        }
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return ErrnoError() << "recv failed";
+            }
+            auto readable = WaitReadable(fd, deadline);
+            if (!readable.ok()) {
+                return readable.error();
+            }
+            if (!*readable) {
+                return Error() << "timed out after receiving " << received << " of " << size
+                               << " bytes";
+            }
+            continue;
+        }
+        received += n;
+    }
+    return {};
+}
+
+} // namespace virt
@@ -14,12 +14,9 @@
  * limitations under the License.
  */
 
-#include <sys/socket.h>
 #include <unistd.h>
 
-// Needs to be included after sys/socket.h
-#include <linux/vm_sockets.h>
-
+#include <chrono>
 #include <iostream>
 #include <optional>
 
@@ -28,6 +25,7 @@
 #include "android-base/parseint.h"
 #include "android-base/unique_fd.h"
 #include "virt/VirtualizationTest.h"
+#include "virt/VsockServer.h"
 
 using namespace android::base;
 using namespace android::os;
@@ -37,25 +35,14 @@ namespace virt {
 static constexpr int kGuestPort = 45678;
 static constexpr const char kVmConfigPath[] = "/data/local/tmp/virt-test/vsock_config.json";
 static constexpr const char kTestMessage[] = "HelloWorld";
+static constexpr std::chrono::seconds kTimeout(60);
 
 TEST_F(VirtualizationTest, TestVsock) {
     binder::Status status;
 
-    unique_fd server_fd(TEMP_FAILURE_RETRY(socket(AF_VSOCK, SOCK_STREAM, 0)));
-    ASSERT_GE(server_fd, 0) << strerror(errno);
-
-    struct sockaddr_vm server_sa = (struct sockaddr_vm){
-            .svm_family = AF_VSOCK,
-            .svm_port = kGuestPort,
-            .svm_cid = VMADDR_CID_ANY,
-    };
-
-    int ret = TEMP_FAILURE_RETRY(bind(server_fd, (struct sockaddr *)&server_sa, sizeof(server_sa)));
-    ASSERT_EQ(ret, 0) << strerror(errno);
-
+    auto server = VsockServer::Listen(kGuestPort);
+    ASSERT_TRUE(server.ok()) << server.error();
     LOG(INFO) << "Listening on port " << kGuestPort << "...";
-    ret = TEMP_FAILURE_RETRY(listen(server_fd, 1));
-    ASSERT_EQ(ret, 0) << strerror(errno);
 
     sp<IVirtualMachine> vm;
     unique_fd vm_config_fd(open(kVmConfigPath, O_RDONLY | O_CLOEXEC));
@@ -69,19 +56,18 @@ TEST_F(VirtualizationTest, TestVsock) {
     LOG(INFO) << "VM starting with CID " << cid;
 
     LOG(INFO) << "Accepting connection...";
-    struct sockaddr_vm client_sa;
-    socklen_t client_sa_len = sizeof(client_sa);
-    unique_fd client_fd(
-            TEMP_FAILURE_RETRY(accept(server_fd, (struct sockaddr *)&client_sa, &client_sa_len)));
-    ASSERT_GE(client_fd, 0) << strerror(errno);
-    LOG(INFO) << "Connection from CID " << client_sa.svm_cid << " on port " << client_sa.svm_port;
+    const auto deadline = std::chrono::steady_clock::now() + kTimeout;
+    auto connection = (*server)->Accept(deadline);
+    ASSERT_TRUE(connection.ok()) << connection.error();
+    LOG(INFO) << "Connection from CID " << connection->client.cid << " on port "
+              << connection->client.port;
 
     LOG(INFO) << "Reading message from the client...";
-    std::string msg;
-    ASSERT_TRUE(ReadFdToString(client_fd, &msg));
+    auto msg = ReadToEnd(connection->fd, deadline);
+    ASSERT_TRUE(msg.ok()) << msg.error();
 
-    LOG(INFO) << "Received message: " << msg;
-    ASSERT_EQ(msg, kTestMessage);
+    LOG(INFO) << "Received message: " << *msg;
+    ASSERT_EQ(*msg, kTestMessage);
 }
 
 } // namespace virt
@@ -16,6 +16,7 @@
 
 use crate::config::VmConfig;
 use crate::crosvm::VmInstance;
+use crate::pool::{PoolKey, WarmPool, WarmVm, POOL_IDLE_TIMEOUT};
 use crate::{Cid, FIRST_GUEST_CID};
 use android_system_virtmanager::aidl::android::system::virtmanager::IVirtManager::IVirtManager;
 use android_system_virtmanager::aidl::android::system::virtmanager::IVirtualMachine::{
@@ -23,12 +24,16 @@ use android_system_virtmanager::aidl::android::system::virtmanager::IVirtualMach
 };
 use android_system_virtmanager::aidl::android::system::virtmanager::IVirtualMachineCallback::IVirtualMachineCallback;
 use android_system_virtmanager::aidl::android::system::virtmanager::VirtualMachineDebugInfo::VirtualMachineDebugInfo;
+use android_system_virtmanager::aidl::android::system::virtmanager::VirtualMachineMetrics::VirtualMachineMetrics;
 use android_system_virtmanager::binder::{
     self, BinderFeatures, Interface, ParcelFileDescriptor, StatusCode, Strong, ThreadState,
 };
 use log::{debug, error};
 use std::fs::File;
+use std::mem;
 use std::sync::{Arc, Mutex, Weak};
+use std::thread;
+use std::time::Instant;
 
 pub const BINDER_SERVICE_IDENTIFIER: &str = "android.system.virtmanager";
 
@@ -36,16 +41,23 @@ pub const BINDER_SERVICE_IDENTIFIER: &str = "android.system.virtmanager";
 /// Only processes running with one of these UIDs are allowed to call debug methods.
 const DEBUG_ALLOWED_UIDS: [u32; 2] = [0, 2000];
 
+/// Only the VMs of processes running with one of these UIDs are kept booted in the warm pool, as
+/// the VMs of the pool cost memory and CPU time whether they are used or not.
+const WARM_POOL_ALLOWED_UIDS: [u32; 3] = [0, 1000, 2000];
+
 /// Implementation of `IVirtManager`, the entry point of the AIDL service.
 #[derive(Debug, Default)]
 pub struct VirtManager {
-    state: Mutex<State>,
+    state: Arc<Mutex<State>>,
 }
 
 impl Interface for VirtManager {}
 
 impl IVirtManager for VirtManager {
     /// Create and start a new VM with the given configuration, assigning it the next available CID.
+    /// If the configuration asks for a warm pool and the caller is allowed one, a VM already
+    /// booted with it is handed out instead when there is one, and the pool is filled up again in
+    /// the background.
     ///
     /// Returns a binder `IVirtualMachine` object referring to it, as a handle for the client.
     fn startVm(
@@ -53,6 +65,7 @@ impl IVirtManager for VirtManager {
         config_fd: &ParcelFileDescriptor,
         log_fd: Option<&ParcelFileDescriptor>,
     ) -> binder::Result<Strong<dyn IVirtualMachine>> {
+        let requested_at = Instant::now();
         let state = &mut *self.state.lock().unwrap();
         let log_fd = log_fd
             .map(|fd| fd.as_ref().try_clone().map_err(|_| StatusCode::UNKNOWN_ERROR))
@@ -73,16 +86,28 @@ impl IVirtManager for VirtManager {
             }
         })?;
         let requester_debug_pid = ThreadState::get_calling_pid();
-        let cid = state.allocate_cid()?;
-        let instance = start_vm(
-            config_fd.as_ref(),
-            cid,
-            log_fd,
-            requester_uid,
-            requester_sid,
-            requester_debug_pid,
-        )?;
+        let config = load_config(config_fd.as_ref())?;
+        let pool_key = if WARM_POOL_ALLOWED_UIDS.contains(&requester_uid) {
+            PoolKey::new(&config)
+        } else {
+            None
+        };
+        let warm_vm = pool_key.as_ref().and_then(|key| state.warm_pool.take(key));
+        let instance = if let Some(vm) = warm_vm {
+            debug!("Handing out VM {} from the warm pool", vm.cid);
+            VmInstance::from_warm(vm, log_fd, requester_uid, requester_sid, requester_debug_pid)
+        } else {
+            let cid = state.allocate_cid()?;
+            start_vm(&config, cid, log_fd, requester_uid, requester_sid, requester_debug_pid)?
+        };
+        instance.set_time_to_spawn(requested_at.elapsed());
         state.add_vm(Arc::downgrade(&instance));
+        if let Some(key) = pool_key {
+            refill_warm_pool(self.state.clone(), key);
+            if !mem::replace(&mut state.evicting_warm_pools, true) {
+                evict_idle_warm_pools(self.state.clone());
+            }
+        }
         Ok(VirtualMachine::create(instance))
     }
 
@@ -108,6 +133,36 @@ impl IVirtManager for VirtManager {
         Ok(cids)
     }
 
+    /// Get the resource usage and latency metrics of all currently running VMs. This method is
+    /// only intended for debug purposes, and as such is only permitted from the shell user.
+    fn debugListVmMetrics(&self) -> binder::Result<Vec<VirtualMachineMetrics>> {
+        if !debug_access_allowed() {
+            return Err(StatusCode::PERMISSION_DENIED.into());
+        }
+
+        let vms = self.state.lock().unwrap().vms();
+        let metrics = vms
+            .into_iter()
+            .filter(|vm| vm.running())
+            .filter_map(|vm| {
+                // The VM may have died since it was checked.
+                let process = vm
+                    .process_metrics()
+                    .map_err(|e| debug!("No metrics for VM {}: {:?}", vm.cid, e))
+                    .ok()?;
+                Some(VirtualMachineMetrics {
+                    cid: vm.cid as i32,
+                    timeToSpawnNanos: to_aidl_long(vm.time_to_spawn().as_nanos() as u64),
+                    rssBytes: to_aidl_long(process.rss_bytes),
+                    vcpuTimeNanos: to_aidl_long(process.vcpu_time_nanos),
+                    storageBytesRead: to_aidl_long(process.storage_bytes_read),
+                    bytesRead: to_aidl_long(process.bytes_read),
+                })
+            })
+            .collect();
+        Ok(metrics)
+    }
+
     /// Hold a strong reference to a VM in Virt Manager. This method is only intended for debug
     /// purposes, and as such is only permitted from the shell user.
     fn debugHoldVmRef(&self, vmref: &Strong<dyn IVirtualMachine>) -> binder::Result<()> {
@@ -140,6 +195,11 @@ fn debug_access_allowed() -> bool {
     DEBUG_ALLOWED_UIDS.contains(&uid)
 }
 
+/// Convert a counter to an AIDL `long`, saturating instead of wrapping around.
+fn to_aidl_long(value: u64) -> i64 {
+    value.min(i64::MAX as u64) as i64
+}
+
 /// Implementation of the AIDL `IVirtualMachine` interface. Used as a handle to a VM.
 #[derive(Debug)]
 struct VirtualMachine {
@@ -218,6 +278,12 @@ struct State {
     /// Vector of strong VM references held on behalf of users that cannot hold them themselves.
     /// This is only used for debugging purposes.
     debug_held_vms: Vec<Strong<dyn IVirtualMachine>>,
+
+    /// The VMs booted ahead of the `startVm` calls for their configs.
+    warm_pool: WarmPool,
+
+    /// Whether a thread is dropping the warm pools which become idle.
+    evicting_warm_pools: bool,
 }
 
 impl State {
@@ -258,27 +324,92 @@ impl State {
 
 impl Default for State {
     fn default() -> Self {
-        State { next_cid: FIRST_GUEST_CID, vms: vec![], debug_held_vms: vec![] }
+        State {
+            next_cid: FIRST_GUEST_CID,
+            vms: vec![],
+            debug_held_vms: vec![],
+            warm_pool: WarmPool::default(),
+            evicting_warm_pools: false,
+        }
     }
 }
 
-/// Start a new VM instance from the given VM config file. This assumes the VM is not already
-/// running.
+/// Load the VM config from the given file.
+fn load_config(config_file: &File) -> binder::Result<VmConfig> {
+    Ok(VmConfig::load(config_file).map_err(|e| {
+        error!("Failed to load VM config from {:?}: {:?}", config_file, e);
+        StatusCode::BAD_VALUE
+    })?)
+}
+
+/// Start a new VM instance from the given VM config. This assumes the VM is not already running.
 fn start_vm(
-    config_file: &File,
+    config: &VmConfig,
     cid: Cid,
     log_fd: Option<File>,
     requester_uid: u32,
     requester_sid: String,
     requester_debug_pid: i32,
 ) -> binder::Result<Arc<VmInstance>> {
-    let config = VmConfig::load(config_file).map_err(|e| {
-        error!("Failed to load VM config from {:?}: {:?}", config_file, e);
-        StatusCode::BAD_VALUE
-    })?;
-    Ok(VmInstance::start(&config, cid, log_fd, requester_uid, requester_sid, requester_debug_pid)
+    Ok(VmInstance::start(config, cid, log_fd, requester_uid, requester_sid, requester_debug_pid)
         .map_err(|e| {
-        error!("Failed to start VM from {:?}: {:?}", config_file, e);
-        StatusCode::UNKNOWN_ERROR
-    })?)
+            error!("Failed to start VM {}: {:?}", cid, e);
+            StatusCode::UNKNOWN_ERROR
+        })?)
+}
+
+/// Start VMs for the config of `key` in the background until its warm pool is full. The state is
+/// only locked to reserve a place for each VM and to add it, not while crosvm is spawned.
+fn refill_warm_pool(state: Arc<Mutex<State>>, key: PoolKey) {
+    thread::spawn(move || loop {
+        let cid = {
+            let state = &mut *state.lock().unwrap();
+            if !state.warm_pool.reserve(&key) {
+                return;
+            }
+            match state.allocate_cid() {
+                Ok(cid) => cid,
+                Err(e) => {
+                    error!("Failed to allocate a CID for the warm pool: {:?}", e);
+                    state.warm_pool.cancel(&key);
+                    return;
+                }
+            }
+        };
+        match WarmVm::start(key.config(), cid) {
+            Ok(vm) => {
+                let rejected = state.lock().unwrap().warm_pool.put(&key, vm);
+                if rejected.is_some() {
+                    // The pool was dropped while the VM was starting.
+                    return;
+                }
+            }
+            Err(e) => {
+                error!("Failed to start VM {} for the warm pool: {:?}", cid, e);
+                state.lock().unwrap().warm_pool.cancel(&key);
+                return;
+            }
+        }
+    });
+}
+
+/// Drop the warm pools which haven't been used for `POOL_IDLE_TIMEOUT`, in the background until
+/// there are no pools left. The VMs are killed without holding the state.
+fn evict_idle_warm_pools(state: Arc<Mutex<State>>) {
+    thread::spawn(move || loop {
+        thread::sleep(POOL_IDLE_TIMEOUT / 4);
+        let (idle_vms, done) = {
+            let state = &mut *state.lock().unwrap();
+            let idle_vms = state.warm_pool.evict_idle(Instant::now());
+            state.evicting_warm_pools = !state.warm_pool.is_empty();
+            (idle_vms, !state.evicting_warm_pools)
+        };
+        if !idle_vms.is_empty() {
+            debug!("Dropping {} idle VMs of the warm pool", idle_vms.len());
+        }
+        drop(idle_vms);
+        if done {
+            return;
+        }
+    });
 }
@@ -14,6 +14,7 @@
 
 //! Function and types for VM configuration.
 
+use crate::pool::MAX_WARM_POOL_SIZE;
 use anyhow::{bail, Error};
 use serde::{Deserialize, Serialize};
 use std::fs::File;
@@ -35,6 +36,18 @@ pub struct VmConfig {
     /// Disk images to be made available to the VM.
     #[serde(default)]
     pub disks: Vec<DiskImage>,
+    /// The number of VMs with this config which the Virt Manager keeps booted ahead of the next
+    /// `startVm` calls with it, so that those don't have to wait for a cold boot. The images
+    /// shouldn't change between the calls except by being replaced with new files, and none of
+    /// the disks can be writable. At most `MAX_WARM_POOL_SIZE`, and only honoured for privileged
+    /// callers.
+    ///
+    /// A VM of the pool boots before anyone asks for it, so its guest can't reach its requester
+    /// during boot: the vsock connections it makes to the host before being handed out reach
+    /// nobody, or whoever listens then. The guest should wait for the host to connect to it
+    /// instead. Its console output is kept until it is handed out.
+    #[serde(default)]
+    pub warm_pool_size: usize,
 }
 
 impl VmConfig {
@@ -47,6 +60,12 @@ impl VmConfig {
         if self.bootloader.is_some() && (self.kernel.is_some() || self.initrd.is_some()) {
             bail!("Can't have both bootloader and kernel/initrd image.");
         }
+        if self.warm_pool_size > MAX_WARM_POOL_SIZE {
+            bail!("Can't keep more than {} VMs in the warm pool.", MAX_WARM_POOL_SIZE);
+        }
+        if self.warm_pool_size > 0 && self.disks.iter().any(|disk| disk.writable) {
+            bail!("Can't keep VMs with writable disks in the warm pool.");
+        }
         Ok(())
     }
 
@@ -16,15 +16,18 @@
 
 use crate::aidl::VirtualMachineCallbacks;
 use crate::config::VmConfig;
+use crate::metrics::ProcessMetrics;
+use crate::pool::WarmVm;
 use crate::Cid;
 use anyhow::Error;
 use log::{error, info};
 use shared_child::SharedChild;
 use std::fs::File;
-use std::process::Command;
-use std::sync::atomic::{AtomicBool, Ordering};
+use std::process::{Command, Stdio};
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
 use std::sync::Arc;
 use std::thread;
+use std::time::Duration;
 
 const CROSVM_PATH: &str = "/apex/com.android.virt/bin/crosvm";
 
@@ -44,6 +47,9 @@ pub struct VmInstance {
     pub requester_debug_pid: i32,
     /// Whether the VM is still running.
     running: AtomicBool,
+    /// The nanoseconds from the `startVm` call until crosvm was spawned for the VM, or 0 if not
+    /// recorded yet.
+    time_to_spawn_nanos: AtomicU64,
     /// Callbacks to clients of the VM.
     pub callbacks: VirtualMachineCallbacks,
 }
@@ -64,6 +70,7 @@ impl VmInstance {
             requester_sid,
             requester_debug_pid,
             running: AtomicBool::new(true),
+            time_to_spawn_nanos: AtomicU64::new(0),
             callbacks: Default::default(),
         }
     }
@@ -78,7 +85,31 @@ impl VmInstance {
         requester_sid: String,
         requester_debug_pid: i32,
     ) -> Result<Arc<VmInstance>, Error> {
-        let child = run_vm(config, cid, log_fd)?;
+        let child = run_vm(config, cid, log_fd.map(Stdio::from))?;
+        Ok(VmInstance::monitored(child, cid, requester_uid, requester_sid, requester_debug_pid))
+    }
+
+    /// Hand out `vm` from the warm pool as a new `VmInstance`, whose console output goes to
+    /// `log_fd` from now on. The `crosvm` instance will be killed when the `VmInstance` is dropped.
+    pub fn from_warm(
+        vm: WarmVm,
+        log_fd: Option<File>,
+        requester_uid: u32,
+        requester_sid: String,
+        requester_debug_pid: i32,
+    ) -> Arc<VmInstance> {
+        let (child, cid) = vm.hand_out(log_fd);
+        VmInstance::monitored(child, cid, requester_uid, requester_sid, requester_debug_pid)
+    }
+
+    /// Create a new `VmInstance` for the given process, and a thread monitoring it.
+    fn monitored(
+        child: SharedChild,
+        cid: Cid,
+        requester_uid: u32,
+        requester_sid: String,
+        requester_debug_pid: i32,
+    ) -> Arc<VmInstance> {
         let instance = Arc::new(VmInstance::new(
             child,
             cid,
@@ -92,7 +123,7 @@ impl VmInstance {
             instance_clone.monitor();
         });
 
-        Ok(instance)
+        instance
     }
 
     /// Wait for the crosvm child process to finish, then mark the VM as no longer running and call
@@ -111,6 +142,23 @@ impl VmInstance {
         self.running.load(Ordering::Acquire)
     }
 
+    /// Record the time from the `startVm` call until crosvm was spawned for the VM, or the VM was
+    /// handed out from the warm pool. This doesn't include the boot of the guest.
+    pub fn set_time_to_spawn(&self, time: Duration) {
+        let nanos = time.as_nanos().min(u64::MAX.into()) as u64;
+        self.time_to_spawn_nanos.store(nanos, Ordering::Release);
+    }
+
+    /// Return the time recorded by `set_time_to_spawn`.
+    pub fn time_to_spawn(&self) -> Duration {
+        Duration::from_nanos(self.time_to_spawn_nanos.load(Ordering::Acquire))
+    }
+
+    /// Read the resource usage of the crosvm instance.
+    pub fn process_metrics(&self) -> Result<ProcessMetrics, Error> {
+        ProcessMetrics::read(self.child.id())
+    }
+
     /// Kill the crosvm instance.
     pub fn kill(&self) {
         // TODO: Talk to crosvm to shutdown cleanly.
@@ -120,15 +168,15 @@ impl VmInstance {
     }
 }
 
-/// Start an instance of `crosvm` to manage a new VM.
-fn run_vm(config: &VmConfig, cid: Cid, log_fd: Option<File>) -> Result<SharedChild, Error> {
+/// Start an instance of `crosvm` to manage a new VM. Its console output goes to `console` if given.
+pub fn run_vm(config: &VmConfig, cid: Cid, console: Option<Stdio>) -> Result<SharedChild, Error> {
     config.validate()?;
 
     let mut command = Command::new(CROSVM_PATH);
     // TODO(qwandor): Remove --disable-sandbox.
     command.arg("run").arg("--disable-sandbox").arg("--cid").arg(cid.to_string());
-    if let Some(log_fd) = log_fd {
-        command.stdout(log_fd);
+    if let Some(console) = console {
+        command.stdout(console);
     } else {
         // Ignore console output.
         command.arg("--serial=type=sink");
@@ -17,6 +17,8 @@
 mod aidl;
 mod config;
 mod crosvm;
+mod metrics;
+mod pool;
 
 use crate::aidl::{VirtManager, BINDER_SERVICE_IDENTIFIER};
 use android_system_virtmanager::aidl::android::system::virtmanager::IVirtManager::BnVirtManager;
@@ -0,0 +1,158 @@
+// Copyright 2021, The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Resource usage of the `crosvm` instances, read from procfs.
+
+use anyhow::{anyhow, Context, Error};
+use std::fs;
+
+/// The prefix of the names crosvm gives to the threads running the vCPUs of a VM.
+const VCPU_THREAD_PREFIX: &str = "crosvm_vcpu";
+
+/// Resource usage of a `crosvm` process.
+///
+/// procfs doesn't split the reads of a process by file, so the reads of each disk or partition
+/// aren't known. The vsock traffic isn't either: it goes through vhost-vsock in the kernel of the
+/// host, not through the `crosvm` process.
+#[derive(Clone, Debug, Default, Eq, PartialEq)]
+pub struct ProcessMetrics {
+    /// The resident set size, in bytes.
+    pub rss_bytes: u64,
+    /// The time spent on a CPU by the vCPU threads, in nanoseconds.
+    pub vcpu_time_nanos: u64,
+    /// The bytes fetched from the storage layer, i.e. the reads of the disk images which weren't
+    /// served from the page cache of the host.
+    pub storage_bytes_read: u64,
+    /// The bytes read with read syscalls, from the disk images and any other file or socket.
+    pub bytes_read: u64,
+}
+
+impl ProcessMetrics {
+    /// Read the resource usage of the process `pid`.
+    pub fn read(pid: u32) -> Result<ProcessMetrics, Error> {
+        let status = read_proc(pid, "status")?;
+        let io = read_proc(pid, "io")?;
+        Ok(ProcessMetrics {
+            rss_bytes: parse_field(&status, "VmRSS:")? * 1024,
+            vcpu_time_nanos: vcpu_time_nanos(pid)?,
+            storage_bytes_read: parse_field(&io, "read_bytes:")?,
+            bytes_read: parse_field(&io, "rchar:")?,
+        })
+    }
+}
+
+fn read_proc(pid: u32, name: &str) -> Result<String, Error> {
+    let path = format!("/proc/{}/{}", pid, name);
+    fs::read_to_string(&path).with_context(|| format!("Failed to read {}", path))
+}
+
+/// Returns the first number after `key` on the line of `contents` which starts with it.
+fn parse_field(contents: &str, key: &str) -> Result<u64, Error> {
+    let value = contents
+        .lines()
+        .find_map(|line| line.strip_prefix(key))
+        .and_then(|rest| rest.split_whitespace().next())
+        .ok_or_else(|| anyhow!("Missing {}", key))?;
+    value.parse().with_context(|| format!("Invalid {} {:?}", key, value))
+}
+
+/// Returns the time spent on a CPU by the vCPU threads of the process `pid`, in nanoseconds.
+fn vcpu_time_nanos(pid: u32) -> Result<u64, Error> {
+    let mut tasks = Vec::new();
+    for entry in fs::read_dir(format!("/proc/{}/task", pid))? {
+        let task = entry?.path();
+        // The thread may have exited since the directory was listed.
+        let comm = match fs::read_to_string(task.join("comm")) {
+            Ok(comm) => comm,
+            Err(_) => continue,
+        };
+        if !comm.starts_with(VCPU_THREAD_PREFIX) {
+            continue;
+        }
+        if let Ok(schedstat) = fs::read_to_string(task.join("schedstat")) {
+            tasks.push((comm, schedstat));
+        }
+    }
+    sum_vcpu_time(tasks.iter().map(|(comm, schedstat)| (comm.as_str(), schedstat.as_str())))
+}
+
+/// Returns the total time spent on a CPU by the vCPU threads among `tasks`, which are the `comm`
+/// and the `schedstat` of threads, in nanoseconds.
+fn sum_vcpu_time<'a>(tasks: impl IntoIterator<Item = (&'a str, &'a str)>) -> Result<u64, Error> {
+    let mut total = 0;
+    for (comm, schedstat) in tasks {
+        if !comm.starts_with(VCPU_THREAD_PREFIX) {
+            continue;
+        }
+        // The first field of schedstat is the time spent on a CPU in nanoseconds, so unlike the
+        // fields of stat it doesn't depend on the clock tick.
+        let value = schedstat.split_whitespace().next().unwrap_or_default();
+        total += value
+            .parse::<u64>()
+            .with_context(|| format!("Invalid schedstat of {:?}: {:?}", comm.trim_end(), value))?;
+    }
+    Ok(total)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const STATUS: &str =
+        "Name:\tcrosvm\nUmask:\t0022\nState:\tS (sleeping)\nVmPeak:\t 2250512 kB\n\
+                          VmRSS:\t  123456 kB\nRssAnon:\t   10000 kB\nThreads:\t12\n";
+
+    const IO: &str = "rchar: 8424118\nwchar: 4242\nsyscr: 2730\nsyscw: 11\nread_bytes: 4096000\n\
+                      write_bytes: 0\ncancelled_write_bytes: 0\n";
+
+    #[test]
+    fn parse_field_reads_the_first_number_of_the_line() {
+        assert_eq!(parse_field(STATUS, "VmRSS:").unwrap(), 123456);
+        assert_eq!(parse_field(STATUS, "Threads:").unwrap(), 12);
+        assert_eq!(parse_field(IO, "rchar:").unwrap(), 8424118);
+        assert_eq!(parse_field(IO, "read_bytes:").unwrap(), 4096000);
+    }
+
+    #[test]
+    fn parse_field_matches_the_whole_key() {
+        // A key doesn't match the lines where it's only a suffix of the key.
+        assert_eq!(parse_field(STATUS, "RssAnon:").unwrap(), 10000);
+        assert_eq!(parse_field(IO, "write_bytes:").unwrap(), 0);
+    }
+
+    #[test]
+    fn parse_field_fails_on_missing_or_invalid_values() {
+        assert!(parse_field(STATUS, "VmSwap:").is_err());
+        assert!(parse_field(STATUS, "State:").is_err());
+        assert!(parse_field("VmRSS:\n", "VmRSS:").is_err());
+    }
+
+    #[test]
+    fn sum_vcpu_time_counts_only_vcpu_threads() {
+        let tasks = vec![
+            ("crosvm\n", "900000000 1000 10\n"),
+            ("crosvm_vcpu0\n", "1500000 2000 20\n"),
+            ("v_balloon\n", "7000 3 1\n"),
+            ("crosvm_vcpu1\n", "2500000 3000 30\n"),
+        ];
+        assert_eq!(sum_vcpu_time(tasks).unwrap(), 4000000);
+        assert_eq!(sum_vcpu_time(Vec::new()).unwrap(), 0);
+    }
+
+    #[test]
+    fn sum_vcpu_time_fails_on_invalid_schedstat() {
+        assert!(sum_vcpu_time(vec![("crosvm_vcpu0\n", "garbage 1 2\n")]).is_err());
+        assert!(sum_vcpu_time(vec![("crosvm_vcpu0\n", "")]).is_err());
+    }
+}
@@ -0,0 +1,448 @@
+// Copyright 2021, The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! A pool of VMs which are booted ahead of the `startVm` calls for their configs.
+
+use crate::config::VmConfig;
+use crate::crosvm::run_vm;
+use crate::Cid;
+use anyhow::{anyhow, Error};
+use log::error;
+use shared_child::SharedChild;
+use std::collections::VecDeque;
+use std::fs::{self, File};
+use std::io::{self, Read, Write};
+use std::mem;
+use std::os::unix::fs::MetadataExt;
+use std::process::{ChildStdout, Stdio};
+use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::{Duration, Instant};
+
+/// The maximum number of VMs kept booted for a config.
+pub const MAX_WARM_POOL_SIZE: usize = 4;
+
+/// The maximum number of configs which VMs are kept booted for. The configs which were used the
+/// least recently are dropped first.
+const MAX_POOLED_CONFIGS: usize = 4;
+
+/// How long the VMs of a config are kept booted after it was last used.
+pub const POOL_IDLE_TIMEOUT: Duration = Duration::from_secs(5 * 60);
+
+/// The maximum number of bytes kept of the console output of a VM until it is handed out.
+const MAX_BUFFERED_CONSOLE_OUTPUT: usize = 64 << 10;
+
+/// Identifies a file which a config refers to. It changes when the file is modified or replaced.
+#[derive(Clone, Debug, Eq, PartialEq)]
+struct FileId {
+    dev: u64,
+    ino: u64,
+    size: u64,
+    mtime: i64,
+    mtime_nsec: i64,
+}
+
+/// Identifies the VMs of the pool which can be handed out for a config: the config itself and
+/// the files it refers to, as they were when the VMs were started.
+#[derive(Clone, Debug, Eq, PartialEq)]
+pub struct PoolKey {
+    config: VmConfig,
+    files: Vec<FileId>,
+}
+
+impl PoolKey {
+    /// Returns the key of `config`, or None if no VMs are kept booted for it.
+    pub fn new(config: &VmConfig) -> Option<PoolKey> {
+        if config.warm_pool_size == 0 {
+            return None;
+        }
+        let paths = config
+            .kernel
+            .iter()
+            .chain(&config.initrd)
+            .chain(&config.bootloader)
+            .chain(config.disks.iter().map(|disk| &disk.image));
+        let files = paths
+            .map(|path| {
+                let metadata = fs::metadata(path)?;
+                Ok(FileId {
+                    dev: metadata.dev(),
+                    ino: metadata.ino(),
+                    size: metadata.size(),
+                    mtime: metadata.mtime(),
+                    mtime_nsec: metadata.mtime_nsec(),
+                })
+            })
+            .collect::<io::Result<_>>()
+            .ok()?;
+        Some(PoolKey { config: config.clone(), files })
+    }
+
+    /// Returns the number of VMs to keep booted for the config.
+    pub fn pool_size(&self) -> usize {
+        self.config.warm_pool_size
+    }
+
+    pub fn config(&self) -> &VmConfig {
+        &self.config
+    }
+}
+
+/// Where the console output of a VM of the pool goes.
+#[derive(Debug)]
+enum ConsoleOutput {
+    /// Kept until the VM is handed out.
+    Buffered(Vec<u8>),
+    /// Forwarded to the log of the requester of the VM, if any.
+    Forwarded(Option<File>),
+}
+
+impl ConsoleOutput {
+    fn write(&mut self, data: &[u8]) {
+        match self {
+            ConsoleOutput::Buffered(buf) => {
+                let size = data.len().min(MAX_BUFFERED_CONSOLE_OUTPUT - buf.len());
+                buf.extend_from_slice(&data[..size]);
+            }
+            ConsoleOutput::Forwarded(Some(file)) => {
+                if let Err(e) = file.write_all(data) {
+                    error!("Error forwarding the console output: {}", e);
+                    *self = ConsoleOutput::Forwarded(None);
+                }
+            }
+            ConsoleOutput::Forwarded(None) => {}
+        }
+    }
+
+    fn forward_to(&mut self, log_fd: Option<File>) {
+        if let ConsoleOutput::Buffered(buf) = mem::replace(self, ConsoleOutput::Forwarded(log_fd)) {
+            self.write(&buf);
+        }
+    }
+}
+
+/// Copies the console output of a VM from `stdout` of its crosvm until crosvm exits.
+fn forward_console(mut stdout: ChildStdout, console: &Mutex<ConsoleOutput>) {
+    let mut buf = [0; 4096];
+    loop {
+        match stdout.read(&mut buf) {
+            Ok(0) => break,
+            Ok(size) => console.lock().unwrap().write(&buf[..size]),
+            Err(e) if e.kind() == io::ErrorKind::Interrupted => continue,
+            Err(e) => {
+                error!("Error reading the console output: {}", e);
+                break;
+            }
+        }
+    }
+}
+
+/// A VM of the pool, which has been started but not handed out yet. It is killed if it is
+/// dropped before.
+#[derive(Debug)]
+pub struct WarmVm {
+    /// The crosvm child process. Only None once handed out.
+    child: Option<SharedChild>,
+    /// The CID assigned to the VM for vsock communication.
+    pub cid: Cid,
+    console: Arc<Mutex<ConsoleOutput>>,
+}
+
+impl WarmVm {
+    /// Start an instance of `crosvm` for the pool.
+    pub fn start(config: &VmConfig, cid: Cid) -> Result<WarmVm, Error> {
+        WarmVm::new(run_vm(config, cid, Some(Stdio::piped()))?, cid)
+    }
+
+    /// Create a `WarmVm` for `child`, whose stdout is the console output of the VM.
+    fn new(child: SharedChild, cid: Cid) -> Result<WarmVm, Error> {
+        let stdout = child.take_stdout().ok_or_else(|| anyhow!("Missing the console output"))?;
+        let console = Arc::new(Mutex::new(ConsoleOutput::Buffered(Vec::new())));
+        let console_clone = console.clone();
+        thread::spawn(move || forward_console(stdout, &console_clone));
+        Ok(WarmVm { child: Some(child), cid, console })
+    }
+
+    fn running(&self) -> bool {
+        matches!(self.child.as_ref().map(SharedChild::try_wait), Some(Ok(None)))
+    }
+
+    /// Hand out the VM. Its console output, since it was started, goes to `log_fd` if given.
+    pub fn hand_out(mut self, log_fd: Option<File>) -> (SharedChild, Cid) {
+        self.console.lock().unwrap().forward_to(log_fd);
+        (self.child.take().unwrap(), self.cid)
+    }
+}
+
+impl Drop for WarmVm {
+    fn drop(&mut self) {
+        if let Some(child) = self.child.take() {
+            if let Err(e) = child.kill().and_then(|_| child.wait()) {
+                error!("Error killing crosvm instance of the warm pool: {}", e);
+            }
+        }
+    }
+}
+
+/// The VMs kept booted for a key.
+#[derive(Debug)]
+struct Pool {
+    key: PoolKey,
+    vms: VecDeque<WarmVm>,
+    /// The number of VMs which are being started for the pool.
+    starting: usize,
+    /// When a VM was last taken from the pool, or when it was created.
+    last_used: Instant,
+}
+
+/// The VMs which are booted ahead of the `startVm` calls for their configs. The VMs are started
+/// without holding the pool: a VM is reserved with `reserve`, then either added with `put` or
+/// cancelled with `cancel`.
+#[derive(Debug, Default)]
+pub struct WarmPool {
+    /// The pools for each key, the key used the most recently last.
+    pools: Vec<Pool>,
+}
+
+impl WarmPool {
+    /// Returns the pool for `key`, the pool used the most recently from now, or None if there is
+    /// none. The pools for the same config with older versions of its files are dropped.
+    fn find(&mut self, key: &PoolKey) -> Option<&mut Pool> {
+        self.pools.retain(|pool| pool.key == *key || pool.key.config != key.config);
+        let pos = self.pools.iter().position(|pool| pool.key == *key)?;
+        let pool = self.pools.remove(pos);
+        self.pools.push(pool);
+        self.pools.last_mut()
+    }
+
+    /// Take a running VM for `key`, if any. The VMs for the same config with older versions of
+    /// its files are dropped.
+    pub fn take(&mut self, key: &PoolKey) -> Option<WarmVm> {
+        let pool = self.find(key)?;
+        pool.last_used = Instant::now();
+        pool.vms.retain(WarmVm::running);
+        pool.vms.pop_front()
+    }
+
+    /// Returns the number of VMs for `key` in the pool, including those being started.
+    pub fn len(&self, key: &PoolKey) -> usize {
+        self.pools
+            .iter()
+            .find(|pool| pool.key == *key)
+            .map_or(0, |pool| pool.vms.len() + pool.starting)
+    }
+
+    /// Reserve a place for a VM to be started for `key`. Returns false if the pool of `key` is
+    /// already full. The pool is created if needed, dropping the pool used the least recently if
+    /// there are too many.
+    pub fn reserve(&mut self, key: &PoolKey) -> bool {
+        if self.find(key).is_none() {
+            if self.pools.len() >= MAX_POOLED_CONFIGS {
+                self.pools.remove(0);
+            }
+            self.pools.push(Pool {
+                key: key.clone(),
+                vms: VecDeque::new(),
+                starting: 0,
+                last_used: Instant::now(),
+            });
+        }
+        let pool = self.pools.last_mut().unwrap();
+        if pool.vms.len() + pool.starting >= key.pool_size() {
+            return false;
+        }
+        pool.starting += 1;
+        true
+    }
+
+    /// Add `vm`, which has been started for `key` after a call to `reserve`, to the pool. Returns
+    /// the VM back if the pool of `key` has been dropped since, in which case it should be
+    /// dropped too.
+    pub fn put(&mut self, key: &PoolKey, vm: WarmVm) -> Option<WarmVm> {
+        match self.pools.iter_mut().find(|pool| pool.key == *key) {
+            Some(pool) => {
+                // The pool may have been dropped and created again since the reservation.
+                pool.starting = pool.starting.saturating_sub(1);
+                pool.vms.push_back(vm);
+                None
+            }
+            None => Some(vm),
+        }
+    }
+
+    /// Release the place reserved for a VM of `key` which failed to start.
+    pub fn cancel(&mut self, key: &PoolKey) {
+        if let Some(pool) = self.pools.iter_mut().find(|pool| pool.key == *key) {
+            pool.starting = pool.starting.saturating_sub(1);
+        }
+    }
+
+    /// Remove the pools which weren't used for `POOL_IDLE_TIMEOUT` until `now`, and return their
+    /// VMs, so that they can be dropped without holding the pool.
+    pub fn evict_idle(&mut self, now: Instant) -> Vec<WarmVm> {
+        let (idle, active) = mem::take(&mut self.pools)
+            .into_iter()
+            .partition(|pool| now.duration_since(pool.last_used) >= POOL_IDLE_TIMEOUT);
+        self.pools = active;
+        idle.into_iter().flat_map(|pool: Pool| pool.vms).collect()
+    }
+
+    /// Returns whether there are no pools.
+    pub fn is_empty(&self) -> bool {
+        self.pools.is_empty()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::process::Command;
+
+    fn test_config(kernel: &str, params: &str, warm_pool_size: usize) -> VmConfig {
+        VmConfig {
+            kernel: Some(kernel.to_owned()),
+            initrd: None,
+            params: Some(params.to_owned()),
+            bootloader: None,
+            disks: vec![],
+            warm_pool_size,
+        }
+    }
+
+    fn test_key(params: &str, warm_pool_size: usize) -> PoolKey {
+        PoolKey::new(&test_config("/proc/self/exe", params, warm_pool_size)).unwrap()
+    }
+
+    /// A VM of the pool whose crosvm is a process which runs until it is killed.
+    fn test_vm(cid: Cid) -> WarmVm {
+        let mut command = Command::new("sleep");
+        command.arg("1000").stdout(Stdio::piped());
+        WarmVm::new(SharedChild::spawn(&mut command).unwrap(), cid).unwrap()
+    }
+
+    fn add_vm(pool: &mut WarmPool, key: &PoolKey, cid: Cid) {
+        assert!(pool.reserve(key));
+        assert!(pool.put(key, test_vm(cid)).is_none());
+    }
+
+    #[test]
+    fn no_key_without_pool() {
+        assert!(PoolKey::new(&test_config("/proc/self/exe", "", 0)).is_none());
+        assert!(PoolKey::new(&test_config("/nonexistent", "", 1)).is_none());
+    }
+
+    #[test]
+    fn key_changes_with_files() {
+        let path = std::env::temp_dir().join(format!("virtmanager_pool_{}", std::process::id()));
+        fs::write(&path, b"kernel").unwrap();
+        let config = test_config(path.to_str().unwrap(), "", 1);
+        let key = PoolKey::new(&config).unwrap();
+        assert_eq!(PoolKey::new(&config).unwrap(), key);
+        fs::write(&path, b"new kernel").unwrap();
+        let new_key = PoolKey::new(&config).unwrap();
+        fs::remove_file(&path).unwrap();
+        assert_ne!(new_key, key);
+    }
+
+    #[test]
+    fn oversized_pool_is_rejected() {
+        assert!(test_config("/proc/self/exe", "", MAX_WARM_POOL_SIZE).validate().is_ok());
+        assert!(test_config("/proc/self/exe", "", MAX_WARM_POOL_SIZE + 1).validate().is_err());
+    }
+
+    #[test]
+    fn reserve_counts_starting_vms() {
+        let mut pool = WarmPool::default();
+        let key = test_key("", 2);
+        assert!(pool.reserve(&key));
+        assert!(pool.reserve(&key));
+        assert!(!pool.reserve(&key));
+        assert_eq!(pool.len(&key), 2);
+
+        assert!(pool.put(&key, test_vm(10)).is_none());
+        assert_eq!(pool.len(&key), 2);
+        assert!(!pool.reserve(&key));
+
+        pool.cancel(&key);
+        assert_eq!(pool.len(&key), 1);
+        assert!(pool.reserve(&key));
+    }
+
+    #[test]
+    fn take_hands_out_vms_in_order() {
+        let mut pool = WarmPool::default();
+        let key = test_key("", 2);
+        add_vm(&mut pool, &key, 10);
+        add_vm(&mut pool, &key, 11);
+        assert_eq!(pool.take(&key).map(|vm| vm.cid), Some(10));
+        assert_eq!(pool.take(&key).map(|vm| vm.cid), Some(11));
+        assert!(pool.take(&key).is_none());
+        assert!(pool.take(&test_key("other", 2)).is_none());
+    }
+
+    #[test]
+    fn take_skips_dead_vms() {
+        let mut pool = WarmPool::default();
+        let key = test_key("", 2);
+        let dead = test_vm(10);
+        let child = dead.child.as_ref().unwrap();
+        child.kill().unwrap();
+        child.wait().unwrap();
+        assert!(pool.reserve(&key));
+        assert!(pool.put(&key, dead).is_none());
+        add_vm(&mut pool, &key, 11);
+        assert_eq!(pool.take(&key).map(|vm| vm.cid), Some(11));
+        assert_eq!(pool.len(&key), 0);
+    }
+
+    #[test]
+    fn older_versions_of_config_are_dropped() {
+        let mut pool = WarmPool::default();
+        let old_key = test_key("", 1);
+        add_vm(&mut pool, &old_key, 10);
+        let new_key = PoolKey { files: vec![], ..old_key.clone() };
+        assert!(pool.take(&new_key).is_none());
+        assert_eq!(pool.len(&old_key), 0);
+    }
+
+    #[test]
+    fn least_recently_used_pool_is_dropped() {
+        let mut pool = WarmPool::default();
+        let keys: Vec<_> = (0..=MAX_POOLED_CONFIGS).map(|i| test_key(&i.to_string(), 1)).collect();
+        add_vm(&mut pool, &keys[0], 10);
+        add_vm(&mut pool, &keys[1], 11);
+        // The first pool is used, so the second one is now the least recently used.
+        assert!(pool.take(&keys[0]).is_some());
+        for key in &keys[2..] {
+            assert!(pool.reserve(key));
+        }
+        assert_eq!(pool.len(&keys[1]), 0);
+        // A VM started for a pool which has been dropped is given back.
+        assert!(pool.put(&keys[1], test_vm(12)).is_some());
+    }
+
+    #[test]
+    fn idle_pools_are_evicted() {
+        let mut pool = WarmPool::default();
+        let key = test_key("", 2);
+        add_vm(&mut pool, &key, 10);
+        assert!(pool.evict_idle(Instant::now()).is_empty());
+        assert!(!pool.is_empty());
+
+        let idle_vms = pool.evict_idle(Instant::now() + POOL_IDLE_TIMEOUT);
+        assert_eq!(idle_vms.iter().map(|vm| vm.cid).collect::<Vec<_>>(), vec![10]);
+        assert!(pool.is_empty());
+        assert!(pool.put(&key, test_vm(11)).is_some());
+    }
+}
@@ -47,6 +47,8 @@ enum Opt {
     },
     /// List running virtual machines
     List,
+    /// Show the resource usage and latency metrics of running virtual machines
+    Metrics,
 }
 
 fn main() -> Result<(), Error> {
@@ -63,6 +65,7 @@ fn main() -> Result<(), Error> {
         Opt::Run { config, daemonize } => command_run(virt_manager, &config, daemonize),
         Opt::Stop { cid } => command_stop(virt_manager, cid),
         Opt::List => command_list(virt_manager),
+        Opt::Metrics => command_metrics(virt_manager),
     }
 }
 
@@ -81,3 +84,10 @@ fn command_list(virt_manager: Strong<dyn IVirtManager>) -> Result<(), Error> {
     println!("Running VMs: {:#?}", vms);
     Ok(())
 }
+
+/// Show the metrics of the VMs currently running.
+fn command_metrics(virt_manager: Strong<dyn IVirtManager>) -> Result<(), Error> {
+    let metrics = virt_manager.debugListVmMetrics().context("Failed to get metrics of VMs")?;
+    println!("VM metrics: {:#?}", metrics);
+    Ok(())
+}
@@ -0,0 +1,422 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//! Access to the content of the files in a zip archive, without extracting the whole files when
+//! they are opened.
+
+use flate2::read::DeflateDecoder;
+use fuse::filesystem::ZeroCopyWriter;
+use std::cmp::min;
+use std::collections::{BTreeMap, HashMap, VecDeque};
+use std::fs::File;
+use std::io;
+use std::io::Read;
+use std::ops::RangeInclusive;
+use std::os::unix::fs::FileExt;
+use std::sync::{Arc, RwLock};
+use zip::CompressionMethod;
+
+use crate::inode::{Inode, ZipEntry};
+
+/// The decompressed content of a compressed file is kept in chunks of this size.
+const CHUNK_SIZE: u64 = 256 << 10;
+
+/// The maximum size of the decompressed content kept for an open file. When it is exceeded, the
+/// chunks decompressed first are dropped, and reading them again decompresses the file again from
+/// the beginning.
+const MAX_RETAINED_SIZE: usize = 8 << 20;
+
+/// Reads a range of the archive file. Multiple `ArchiveRange`s can read the same file at the same
+/// time since it is read with `pread`.
+#[derive(Clone)]
+struct ArchiveRange {
+    archive: Arc<File>,
+    offset: u64,
+    end: u64,
+}
+
+impl Read for ArchiveRange {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let size = min(buf.len() as u64, self.end - self.offset) as usize;
+        let size = self.archive.read_at(&mut buf[..size], self.offset)?;
+        self.offset += size as u64;
+        Ok(size)
+    }
+}
+
+/// The content of a file in the zip archive. It can be read by multiple threads at the same time.
+pub enum FileContent {
+    /// A file that is not compressed (store). It is directly read from the archive.
+    Stored { archive: Arc<File>, offset: u64, size: u64 },
+    /// A compressed file, decompressed as it is read. Reads of what is already decompressed only
+    /// need the read lock.
+    Compressed(RwLock<DecompressedFile>),
+}
+
+/// Holds the decompressed content of a compressed file, in chunks of [`CHUNK_SIZE`] bytes.
+///
+/// This is needed because a compressed file is in general not seekable. Deflated files are
+/// decompressed lazily, and at most [`MAX_RETAINED_SIZE`] bytes of them are kept. Files compressed
+/// with the other methods are decompressed at once, and kept as a whole.
+pub struct DecompressedFile {
+    /// The compressed content, to decompress the file again from the beginning. None when the
+    /// file was decompressed at once.
+    compressed: Option<ArchiveRange>,
+    /// Decompresses the file from `decoded`. None when it has to be started (again).
+    decoder: Option<Box<dyn Read + Send + Sync>>,
+    decoded: u64,
+    /// The decompressed chunks, by their index in the file.
+    chunks: HashMap<u64, Vec<u8>>,
+    /// The indices of `chunks`, in the order they were decompressed.
+    order: VecDeque<u64>,
+    retained: usize,
+    size: u64,
+}
+
+impl FileContent {
+    /// Prepares access to the content of the file at `entry` in the `archive` file, which is
+    /// `size` bytes once decompressed. Returns None if the file is compressed with a method that
+    /// needs to be extracted with [`FileContent::extract`] instead.
+    pub fn new(archive: &Arc<File>, entry: &ZipEntry, size: u64) -> Option<FileContent> {
+        let offset = entry.data_start;
+        match entry.compression {
+            CompressionMethod::Stored => {
+                Some(FileContent::Stored { archive: Arc::clone(archive), offset, size })
+            }
+            CompressionMethod::Deflated => {
+                let compressed = ArchiveRange {
+                    archive: Arc::clone(archive),
+                    offset,
+                    end: offset + entry.compressed_size,
+                };
+                Some(FileContent::from(DecompressedFile::deflated(compressed, size)))
+            }
+            _ => None,
+        }
+    }
+
+    /// Extracts the whole content of `zip_file`.
+    pub fn extract(mut zip_file: zip::read::ZipFile) -> io::Result<FileContent> {
+        let size = zip_file.size();
+        let mut buf = Vec::with_capacity(size as usize);
+        zip_file.read_to_end(&mut buf)?;
+        Ok(FileContent::from(DecompressedFile::extracted(buf)))
+    }
+
+    /// Writes up to `size` bytes of the content from `offset` to `w`. Returns the number of bytes
+    /// written, which is less than `size` only at the end of the file.
+    pub fn read_to<W: io::Write + ZeroCopyWriter>(
+        &self,
+        w: &mut W,
+        offset: u64,
+        size: usize,
+    ) -> io::Result<usize> {
+        match self {
+            FileContent::Stored { archive, offset: data_offset, size: file_size } => {
+                let end = min(offset.saturating_add(size as u64), *file_size);
+                if offset >= end {
+                    return Ok(0);
+                }
+                let size = (end - offset) as usize;
+                // Copied from the archive to the request without a buffer in between.
+                let mut archive: &File = archive;
+                w.write_all_from(&mut archive, size, *data_offset + offset)?;
+                Ok(size)
+            }
+            FileContent::Compressed(file) => {
+                {
+                    let file = file.read().unwrap();
+                    if file.is_decompressed(offset, size) {
+                        return file.write_to(w, offset, size);
+                    }
+                }
+                let mut file = file.write().unwrap();
+                file.decompress(offset, size)?;
+                file.write_to(w, offset, size)
+            }
+        }
+    }
+}
+
+impl From<DecompressedFile> for FileContent {
+    fn from(file: DecompressedFile) -> FileContent {
+        FileContent::Compressed(RwLock::new(file))
+    }
+}
+
+impl DecompressedFile {
+    fn deflated(compressed: ArchiveRange, size: u64) -> DecompressedFile {
+        DecompressedFile {
+            compressed: Some(compressed),
+            decoder: None,
+            decoded: 0,
+            chunks: HashMap::new(),
+            order: VecDeque::new(),
+            retained: 0,
+            size,
+        }
+    }
+
+    fn extracted(buf: Vec<u8>) -> DecompressedFile {
+        let size = buf.len() as u64;
+        let mut file = DecompressedFile {
+            compressed: None,
+            decoder: None,
+            decoded: size,
+            chunks: HashMap::new(),
+            order: VecDeque::new(),
+            retained: 0,
+            size,
+        };
+        for (index, chunk) in buf.chunks(CHUNK_SIZE as usize).enumerate() {
+            file.insert(index as u64, chunk.to_vec(), &(0..=0));
+        }
+        file
+    }
+
+    /// The total size of the decompressed content kept.
+    pub fn retained_size(&self) -> usize {
+        self.retained
+    }
+
+    /// The indices of the chunks holding the `size` bytes from `offset`, or None if there are none
+    /// of them in the file.
+    fn chunk_range(&self, offset: u64, size: usize) -> Option<RangeInclusive<u64>> {
+        let end = min(offset.saturating_add(size as u64), self.size);
+        if offset >= end {
+            return None;
+        }
+        Some(offset / CHUNK_SIZE..=(end - 1) / CHUNK_SIZE)
+    }
+
+    /// Returns whether the `size` bytes from `offset` are decompressed.
+    fn is_decompressed(&self, offset: u64, size: usize) -> bool {
+        match self.chunk_range(offset, size) {
+            Some(mut range) => range.all(|index| self.chunks.contains_key(&index)),
+            None => true,
+        }
+    }
+
+    /// Decompresses the chunks holding the `size` bytes from `offset`, unless already done.
+    fn decompress(&mut self, offset: u64, size: usize) -> io::Result<()> {
+        let range = match self.chunk_range(offset, size) {
+            Some(range) => range,
+            None => return Ok(()),
+        };
+        let first_missing = match range.clone().find(|index| !self.chunks.contains_key(index)) {
+            Some(index) => index,
+            None => return Ok(()),
+        };
+        // The decoder only goes forward, so start over if it is already past the missing chunk.
+        if self.decoder.is_none() || self.decoded > first_missing * CHUNK_SIZE {
+            let compressed = self.compressed.clone().ok_or_else(|| {
+                io::Error::new(io::ErrorKind::Other, "decompressed content was dropped")
+            })?;
+            self.decoder = Some(Box::new(DeflateDecoder::new(compressed)));
+            self.decoded = 0;
+        }
+        while self.decoded <= range.end() * CHUNK_SIZE {
+            let index = self.decoded / CHUNK_SIZE;
+            let mut chunk = vec![0; min(CHUNK_SIZE, self.size - self.decoded) as usize];
+            self.decoder.as_mut().unwrap().read_exact(&mut chunk)?;
+            self.decoded += chunk.len() as u64;
+            if !self.chunks.contains_key(&index) {
+                self.insert(index, chunk, &range);
+            }
+        }
+        if self.decoded == self.size {
+            self.decoder = None;
+        }
+        Ok(())
+    }
+
+    /// Keeps `chunk`, dropping the chunks decompressed first if more than [`MAX_RETAINED_SIZE`]
+    /// bytes would be kept. Files decompressed at once, and the chunks in `needed`, are kept as a
+    /// whole.
+    fn insert(&mut self, index: u64, chunk: Vec<u8>, needed: &RangeInclusive<u64>) {
+        if self.compressed.is_some() {
+            for _ in 0..self.order.len() {
+                if self.retained + chunk.len() <= MAX_RETAINED_SIZE {
+                    break;
+                }
+                let oldest = self.order.pop_front().unwrap();
+                if needed.contains(&oldest) {
+                    self.order.push_back(oldest);
+                } else {
+                    self.retained -= self.chunks.remove(&oldest).unwrap().len();
+                }
+            }
+        }
+        self.retained += chunk.len();
+        self.chunks.insert(index, chunk);
+        self.order.push_back(index);
+    }
+
+    /// Writes the decompressed `size` bytes from `offset` to `w`. Returns the number of bytes
+    /// written, which is less than `size` only at the end of the file.
+    fn write_to<W: io::Write>(&self, w: &mut W, offset: u64, size: usize) -> io::Result<usize> {
+        let range = match self.chunk_range(offset, size) {
+            Some(range) => range,
+            None => return Ok(0),
+        };
+        let end = min(offset.saturating_add(size as u64), self.size);
+        for index in range {
+            let chunk = self.chunks.get(&index).ok_or_else(|| {
+                io::Error::new(io::ErrorKind::Other, "reading a chunk not decompressed")
+            })?;
+            let chunk_start = index * CHUNK_SIZE;
+            let from = offset.saturating_sub(chunk_start) as usize;
+            let to = (min(end, chunk_start + CHUNK_SIZE) - chunk_start) as usize;
+            w.write_all(&chunk[from..to])?;
+        }
+        Ok((end - offset) as usize)
+    }
+}
+
+/// Keeps the decompressed content of recently released files, up to a total size, so that they
+/// don't have to be decompressed again when they are opened again.
+pub struct ReleasedFiles {
+    capacity: usize,
+    size: usize,
+    /// The files by inode, with the time they were released.
+    files: HashMap<Inode, (u64, DecompressedFile)>,
+    /// The inodes of `files`, by the time they were released.
+    release_order: BTreeMap<u64, Inode>,
+    /// Increases with every release.
+    time: u64,
+}
+
+impl ReleasedFiles {
+    pub fn new(capacity: usize) -> ReleasedFiles {
+        ReleasedFiles {
+            capacity,
+            size: 0,
+            files: HashMap::new(),
+            release_order: BTreeMap::new(),
+            time: 0,
+        }
+    }
+
+    /// Removes the content of the file `inode` from the cache and returns it, if present.
+    pub fn take(&mut self, inode: Inode) -> Option<DecompressedFile> {
+        let (time, file) = self.files.remove(&inode)?;
+        self.release_order.remove(&time);
+        self.size -= file.retained_size();
+        Some(file)
+    }
+
+    /// Adds the content of the file `inode`, evicting the least recently released files if needed.
+    pub fn put(&mut self, inode: Inode, file: DecompressedFile) {
+        self.take(inode);
+        let file_size = file.retained_size();
+        if file_size > self.capacity {
+            return;
+        }
+        while self.size + file_size > self.capacity {
+            let oldest = match self.release_order.values().next() {
+                Some(inode) => *inode,
+                None => break,
+            };
+            self.take(oldest);
+        }
+        self.size += file_size;
+        self.time += 1;
+        self.files.insert(inode, (self.time, file));
+        self.release_order.insert(self.time, inode);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use flate2::write::DeflateEncoder;
+    use flate2::Compression;
+    use std::io::Write;
+
+    fn content(size: usize) -> Vec<u8> {
+        (0..size).map(|i| (i * 7 / 3) as u8).collect()
+    }
+
+    fn deflated_file(data: &[u8]) -> DecompressedFile {
+        let mut encoder = DeflateEncoder::new(Vec::new(), Compression::default());
+        encoder.write_all(data).unwrap();
+        let compressed = encoder.finish().unwrap();
+        let mut archive = tempfile::tempfile().unwrap();
+        archive.write_all(&compressed).unwrap();
+        let compressed =
+            ArchiveRange { archive: Arc::new(archive), offset: 0, end: compressed.len() as u64 };
+        DecompressedFile::deflated(compressed, data.len() as u64)
+    }
+
+    fn read(file: &mut DecompressedFile, offset: u64, size: usize) -> Vec<u8> {
+        file.decompress(offset, size).unwrap();
+        assert!(file.is_decompressed(offset, size));
+        let mut buf = Vec::new();
+        let written = file.write_to(&mut buf, offset, size).unwrap();
+        assert_eq!(written, buf.len());
+        buf
+    }
+
+    #[test]
+    fn reads_across_chunks() {
+        let data = content(3 * CHUNK_SIZE as usize + 100);
+        let mut file = deflated_file(&data);
+        let offset = CHUNK_SIZE as usize - 10;
+        assert_eq!(read(&mut file, offset as u64, 20), &data[offset..offset + 20]);
+        assert_eq!(read(&mut file, 0, 10), &data[..10]);
+        let end = data.len();
+        assert_eq!(read(&mut file, end as u64 - 50, 4096), &data[end - 50..]);
+        assert!(read(&mut file, end as u64, 4096).is_empty());
+    }
+
+    #[test]
+    fn keeps_at_most_max_retained_size() {
+        let data = content(2 * MAX_RETAINED_SIZE);
+        let mut file = deflated_file(&data);
+        let end = data.len();
+        assert_eq!(read(&mut file, end as u64 - 100, 100), &data[end - 100..]);
+        assert!(file.retained_size() <= MAX_RETAINED_SIZE);
+        assert!(!file.is_decompressed(0, 100));
+
+        // The chunks dropped are decompressed again.
+        assert_eq!(read(&mut file, 0, 100), &data[..100]);
+        assert!(file.retained_size() <= MAX_RETAINED_SIZE);
+    }
+
+    #[test]
+    fn keeps_extracted_files_as_a_whole() {
+        let data = content(2 * MAX_RETAINED_SIZE);
+        let mut file = DecompressedFile::extracted(data.clone());
+        assert_eq!(file.retained_size(), data.len());
+        assert_eq!(read(&mut file, 0, data.len()), data);
+    }
+
+    #[test]
+    fn released_files_evicts_least_recently_released() {
+        let mut released = ReleasedFiles::new(2 * CHUNK_SIZE as usize);
+        for inode in 1..=3 {
+            released.put(inode, DecompressedFile::extracted(content(CHUNK_SIZE as usize)));
+        }
+        assert!(released.take(1).is_none());
+        assert!(released.take(2).is_some());
+        assert!(released.take(2).is_none());
+        assert!(released.take(3).is_some());
+        assert_eq!(released.size, 0);
+
+        released.put(4, DecompressedFile::extracted(content(3 * CHUNK_SIZE as usize)));
+        assert!(released.take(4).is_none());
+    }
+}
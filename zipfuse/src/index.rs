@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//! Reads the index of the entries of a zip archive which mk_payload generates next to the archive
+//! (see `MakeZipIndex` in microdroid/signature/payload.h for the format). With the index, the
+//! inode table is built without parsing the central directory of the archive.
+
+use anyhow::{bail, Result};
+use std::convert::TryInto;
+use std::fs::File;
+use std::io::{Seek, SeekFrom};
+use std::os::unix::io::AsRawFd;
+use std::path::Path;
+use std::ptr;
+use std::slice;
+
+const MAGIC: &[u8] = b"ZFIX";
+const VERSION: u32 = 1;
+const HEADER_SIZE: usize = 24;
+const ENTRY_SIZE: usize = 40;
+const FLAG_HAS_MODE: u16 = 1;
+
+/// A file mapped into the memory, read only.
+pub struct MappedFile {
+    addr: *mut libc::c_void,
+    len: usize,
+}
+
+impl MappedFile {
+    /// Maps the whole file at `path`, which can also be a block device.
+    pub fn open(path: &Path) -> Result<MappedFile> {
+        let mut file = File::open(path)?;
+        // The size of a block device is only known by seeking to its end.
+        let len = file.seek(SeekFrom::End(0))? as usize;
+        if len == 0 {
+            bail!("{:?} is empty", path);
+        }
+        // SAFETY: a new mapping which doesn't alias any memory of this process
+        let addr = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                len,
+                libc::PROT_READ,
+                libc::MAP_PRIVATE,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if addr == libc::MAP_FAILED {
+            bail!("Failed to mmap {:?}: {}", path, std::io::Error::last_os_error());
+        }
+        Ok(MappedFile { addr, len })
+    }
+
+    pub fn as_bytes(&self) -> &[u8] {
+        // SAFETY: the mapping is valid and read only until it is dropped
+        unsafe { slice::from_raw_parts(self.addr as *const u8, self.len) }
+    }
+}
+
+impl Drop for MappedFile {
+    fn drop(&mut self) {
+        // SAFETY: the mapping isn't borrowed any more
+        unsafe {
+            libc::munmap(self.addr, self.len);
+        }
+    }
+}
+
+/// The index of the entries of a zip archive.
+pub struct ArchiveIndex<'a> {
+    archive_size: u64,
+    entries: &'a [u8],
+    names: &'a [u8],
+}
+
+/// An entry of [`ArchiveIndex`].
+#[derive(Debug)]
+pub struct IndexEntry<'a> {
+    /// The name of the entry in the archive. Names of directories end with '/'.
+    pub name: &'a [u8],
+    pub data_start: u64,
+    pub compressed_size: u64,
+    pub size: u64,
+    pub unix_mode: Option<u32>,
+    pub compression: zip::CompressionMethod,
+}
+
+impl<'a> IndexEntry<'a> {
+    pub fn is_file(&self) -> bool {
+        !self.name.ends_with(b"/")
+    }
+}
+
+fn read_u16(buf: &[u8], offset: usize) -> u16 {
+    u16::from_le_bytes(buf[offset..offset + 2].try_into().unwrap())
+}
+
+fn read_u32(buf: &[u8], offset: usize) -> u32 {
+    u32::from_le_bytes(buf[offset..offset + 4].try_into().unwrap())
+}
+
+fn read_u64(buf: &[u8], offset: usize) -> u64 {
+    u64::from_le_bytes(buf[offset..offset + 8].try_into().unwrap())
+}
+
+impl<'a> ArchiveIndex<'a> {
+    /// Parses the index in `buf`. The index may be followed by padding.
+    pub fn parse(buf: &'a [u8]) -> Result<ArchiveIndex<'a>> {
+        if buf.len() < HEADER_SIZE || &buf[..MAGIC.len()] != MAGIC {
+            bail!("Not a zip index");
+        }
+        let version = read_u32(buf, 4);
+        if version != VERSION {
+            bail!("Unsupported zip index version: {}", version);
+        }
+        let archive_size = read_u64(buf, 8);
+        let num_entries = read_u32(buf, 16) as usize;
+        let names_size = read_u32(buf, 20) as usize;
+
+        // the sizes come from the image, so they can't be trusted not to overflow
+        let entries_end =
+            num_entries.checked_mul(ENTRY_SIZE).and_then(|n| n.checked_add(HEADER_SIZE));
+        let names_end = entries_end.and_then(|n| n.checked_add(names_size));
+        let (entries_end, names_end) = match (entries_end, names_end) {
+            (Some(entries_end), Some(names_end)) if names_end <= buf.len() => {
+                (entries_end, names_end)
+            }
+            _ => bail!("The zip index is truncated"),
+        };
+        Ok(ArchiveIndex {
+            archive_size,
+            entries: &buf[HEADER_SIZE..entries_end],
+            names: &buf[entries_end..names_end],
+        })
+    }
+
+    /// The size of the archive that the index was generated from.
+    pub fn archive_size(&self) -> u64 {
+        self.archive_size
+    }
+
+    pub fn len(&self) -> usize {
+        self.entries.len() / ENTRY_SIZE
+    }
+
+    /// Returns the `i`th entry, sorted by name.
+    pub fn get(&self, i: usize) -> Result<IndexEntry<'a>> {
+        let entry = &self.entries[i * ENTRY_SIZE..(i + 1) * ENTRY_SIZE];
+        let name_offset = read_u32(entry, 24) as usize;
+        let name_size = read_u32(entry, 28) as usize;
+        let name = match self.names.get(name_offset..name_offset + name_size) {
+            Some(name) => name,
+            None => bail!("The name of the entry {} is out of the zip index", i),
+        };
+        let compression = match read_u16(entry, 36) {
+            0 => zip::CompressionMethod::Stored,
+            8 => zip::CompressionMethod::Deflated,
+            method => bail!("Unsupported compression method: {}", method),
+        };
+        let flags = read_u16(entry, 38);
+        Ok(IndexEntry {
+            name,
+            data_start: read_u64(entry, 0),
+            compressed_size: read_u64(entry, 8),
+            size: read_u64(entry, 16),
+            unix_mode: if flags & FLAG_HAS_MODE != 0 { Some(read_u32(entry, 32)) } else { None },
+            compression,
+        })
+    }
+}
+
+/// Generates the index of `archive`, like mk_payload does.
+#[cfg(test)]
+pub fn make_index<R: std::io::Read + std::io::Seek>(
+    archive: &mut zip::ZipArchive<R>,
+    archive_size: u64,
+) -> Vec<u8> {
+    let mut entries = Vec::new();
+    for i in 0..archive.len() {
+        let file = archive.by_index(i).unwrap();
+        entries.push((
+            file.name().as_bytes().to_vec(),
+            file.data_start(),
+            file.compressed_size(),
+            file.size(),
+            file.unix_mode(),
+            match file.compression() {
+                zip::CompressionMethod::Stored => 0u16,
+                _ => 8,
+            },
+        ));
+    }
+    entries.sort();
+
+    let mut index = Vec::new();
+    let mut names = Vec::new();
+    index.extend_from_slice(MAGIC);
+    index.extend_from_slice(&VERSION.to_le_bytes());
+    index.extend_from_slice(&archive_size.to_le_bytes());
+    index.extend_from_slice(&(entries.len() as u32).to_le_bytes());
+    let names_size: usize = entries.iter().map(|e| e.0.len()).sum();
+    index.extend_from_slice(&(names_size as u32).to_le_bytes());
+    for (name, data_start, compressed_size, size, mode, method) in entries.iter() {
+        index.extend_from_slice(&data_start.to_le_bytes());
+        index.extend_from_slice(&compressed_size.to_le_bytes());
+        index.extend_from_slice(&size.to_le_bytes());
+        index.extend_from_slice(&(names.len() as u32).to_le_bytes());
+        index.extend_from_slice(&(name.len() as u32).to_le_bytes());
+        index.extend_from_slice(&mode.unwrap_or(0).to_le_bytes());
+        index.extend_from_slice(&method.to_le_bytes());
+        let flags = if mode.is_some() { FLAG_HAS_MODE } else { 0 };
+        index.extend_from_slice(&flags.to_le_bytes());
+        names.extend_from_slice(name);
+    }
+    index.extend_from_slice(&names);
+    index
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn rejects_invalid_index() {
+        assert!(ArchiveIndex::parse(b"").is_err());
+        assert!(ArchiveIndex::parse(&[0; HEADER_SIZE]).is_err());
+
+        let mut index = Vec::new();
+        index.extend_from_slice(MAGIC);
+        index.extend_from_slice(&VERSION.to_le_bytes());
+        index.extend_from_slice(&0u64.to_le_bytes());
+        index.extend_from_slice(&1u32.to_le_bytes()); // one entry, which is missing
+        index.extend_from_slice(&0u32.to_le_bytes());
+        assert!(ArchiveIndex::parse(&index).is_err());
+
+        let mut index = Vec::new();
+        index.extend_from_slice(MAGIC);
+        index.extend_from_slice(&VERSION.to_le_bytes());
+        index.extend_from_slice(&0u64.to_le_bytes());
+        index.extend_from_slice(&u32::MAX.to_le_bytes()); // sizes which overflow on 32-bit
+        index.extend_from_slice(&u32::MAX.to_le_bytes());
+        assert!(ArchiveIndex::parse(&index).is_err());
+    }
+}
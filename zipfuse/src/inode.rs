@@ -15,9 +15,12 @@
  */
 use anyhow::{anyhow, bail, Result};
 use std::collections::HashMap;
-use std::ffi::{CStr, CString};
+use std::ffi::{CStr, CString, OsStr};
 use std::io;
 use std::os::unix::ffi::OsStrExt;
+use std::path::Path;
+
+use crate::index::ArchiveIndex;
 
 /// `InodeTable` is a table of `InodeData` indexed by `Inode`.
 #[derive(Debug)]
@@ -46,14 +49,26 @@ pub struct InodeData {
 
 type ZipIndex = usize;
 
+/// `ZipEntry` tells where the content of a file is in the zip archive, so that it can be read
+/// without going through `ZipArchive`.
+#[derive(Debug)]
+pub struct ZipEntry {
+    /// Index of the file in `ZipArchive`, which can be used to retrieve `ZipFile`. This is the
+    /// index in `ArchiveIndex` instead when the inode table is built from it.
+    pub index: ZipIndex,
+    /// Offset of the (possibly compressed) content in the archive file.
+    pub data_start: u64,
+    pub compressed_size: u64,
+    pub compression: zip::CompressionMethod,
+}
+
 /// `InodeDataData` is the actual data (or a means to access the data) of the file or the directory
 /// that an inode is representing. In case of a directory, this data is the hash table of the
-/// directory entries. In case of a file, this data is the index of the file in `ZipArchive` which
-/// can be used to retrieve `ZipFile` that provides access to the content of the file.
+/// directory entries. In case of a file, this data is the location of the file in the archive.
 #[derive(Debug)]
 enum InodeDataData {
     Directory(HashMap<CString, DirectoryEntry>),
-    File(ZipIndex),
+    File(ZipEntry),
 }
 
 #[derive(Debug, Clone)]
@@ -80,9 +95,9 @@ impl InodeData {
         }
     }
 
-    pub fn get_zip_index(&self) -> Option<ZipIndex> {
+    pub fn get_zip_entry(&self) -> Option<&ZipEntry> {
         match &self.data {
-            InodeDataData::File(zip_index) => Some(*zip_index),
+            InodeDataData::File(entry) => Some(entry),
             _ => None,
         }
     }
@@ -94,12 +109,8 @@ impl InodeData {
         InodeData { mode, size: 0, data: InodeDataData::Directory(HashMap::new()) }
     }
 
-    fn new_file(zip_index: ZipIndex, zip_file: &zip::read::ZipFile) -> InodeData {
-        InodeData {
-            mode: zip_file.unix_mode().unwrap_or(0),
-            size: zip_file.size(),
-            data: InodeDataData::File(zip_index),
-        }
+    fn new_file(mode: u32, size: u64, entry: ZipEntry) -> InodeData {
+        InodeData { mode, size, data: InodeDataData::File(entry) }
     }
 
     fn add_to_directory(&mut self, name: CString, entry: DirectoryEntry) {
@@ -161,70 +172,145 @@ impl InodeTable {
         inode
     }
 
-    /// Constructs `InodeTable` from a zip archive `archive`.
-    pub fn from_zip<R: io::Read + io::Seek>(
-        archive: &mut zip::ZipArchive<R>,
-    ) -> Result<InodeTable> {
+    fn new() -> InodeTable {
         let mut table = InodeTable { table: Vec::new() };
 
         // Add the inodes for the invalid and the root directory
         assert_eq!(INVALID, table.put(InodeData::new_dir(0)));
         assert_eq!(ROOT, table.put(InodeData::new_dir(0)));
+        table
+    }
+
+    /// Constructs `InodeTable` from a zip archive `archive`.
+    pub fn from_zip<R: io::Read + io::Seek>(
+        archive: &mut zip::ZipArchive<R>,
+    ) -> Result<InodeTable> {
+        let mut table = InodeTable::new();
 
-        // For each zip file in the archive, create an inode and add it to the table. If the file's
-        // parent directories don't have corresponding inodes in the table, handle them too.
+        // For each zip file in the archive, create an inode and add it to the table.
         for i in 0..archive.len() {
             let file = archive.by_index(i)?;
             let path = file
                 .enclosed_name()
                 .ok_or_else(|| anyhow!("{} is an invalid name", file.name()))?;
-            // TODO(jiyong): normalize this (e.g. a/b/c/../d -> a/b/d). We can't use
-            // fs::canonicalize as this is a non-existing path yet.
-
-            let mut parent = ROOT;
-            let mut iter = path.iter().peekable();
-            while let Some(name) = iter.next() {
-                // TODO(jiyong): remove this check by canonicalizing `path`
-                if name == ".." {
-                    bail!(".. is not allowed");
-                }
+            let file_data = if file.is_file() {
+                Some((
+                    file.size(),
+                    ZipEntry {
+                        index: i,
+                        data_start: file.data_start(),
+                        compressed_size: file.compressed_size(),
+                        compression: file.compression(),
+                    },
+                ))
+            } else {
+                None
+            };
+            table.add_path(path, file.unix_mode(), file_data)?;
+        }
+        Ok(table)
+    }
 
-                let is_leaf = iter.peek().is_none();
-                let is_file = file.is_file() && is_leaf;
-
-                // The happy path; the inode for `name` is already in the `parent` inode. Move on
-                // to the next path element.
-                let name = CString::new(name.as_bytes()).unwrap();
-                if let Some(found) = table.find(parent, &name) {
-                    parent = found;
-                    // Update the mode if this is a directory leaf.
-                    if !is_file && is_leaf {
-                        let mut inode = table.get_mut(parent).unwrap();
-                        inode.mode = file.unix_mode().unwrap_or(0);
-                    }
-                    continue;
+    /// Constructs `InodeTable` from the index `index` of a zip archive whose size is
+    /// `archive_size`, without reading the archive itself.
+    pub fn from_index(index: &ArchiveIndex, archive_size: u64) -> Result<InodeTable> {
+        if index.archive_size() > archive_size {
+            bail!("The zip index is for a larger archive");
+        }
+        let mut table = InodeTable::new();
+        for i in 0..index.len() {
+            let entry = index.get(i)?;
+            let name = String::from_utf8_lossy(entry.name);
+            // Same checks as `ZipFile::enclosed_name`, plus the ones for the content of the file,
+            // which `ZipArchive` would do when the file is read.
+            let path = Path::new(OsStr::from_bytes(entry.name));
+            if entry.name.contains(&0) || path.has_root() {
+                bail!("{} is an invalid name", name);
+            }
+            let file_data = if entry.is_file() {
+                let data_end = entry.data_start.checked_add(entry.compressed_size);
+                if data_end.map_or(true, |end| end > index.archive_size()) {
+                    bail!("The content of {} is out of the archive", name);
+                }
+                if matches!(entry.compression, zip::CompressionMethod::Stored)
+                    && entry.compressed_size != entry.size
+                {
+                    bail!("{} is stored with a wrong size", name);
                 }
+                Some((
+                    entry.size,
+                    ZipEntry {
+                        index: i,
+                        data_start: entry.data_start,
+                        compressed_size: entry.compressed_size,
+                        compression: entry.compression,
+                    },
+                ))
+            } else {
+                None
+            };
+            table.add_path(path, entry.unix_mode, file_data)?;
+        }
+        Ok(table)
+    }
 
-                const DEFAULT_DIR_MODE: u32 = libc::S_IRUSR | libc::S_IXUSR;
-
-                // No inode found. Create a new inode and add it to the inode table.
-                let inode = if is_file {
-                    InodeData::new_file(i, &file)
-                } else if is_leaf {
-                    InodeData::new_dir(file.unix_mode().unwrap_or(DEFAULT_DIR_MODE))
-                } else {
-                    InodeData::new_dir(DEFAULT_DIR_MODE)
-                };
-                let new = table.add(parent, name, inode);
-                parent = new;
+    /// Adds the inode for `path`, the path of an entry in the zip archive whose size and location
+    /// are given by `file_data` unless it is a directory. If the entry's parent directories don't
+    /// have corresponding inodes in the table, handle them too.
+    fn add_path(
+        &mut self,
+        path: &Path,
+        mode: Option<u32>,
+        mut file_data: Option<(u64, ZipEntry)>,
+    ) -> Result<()> {
+        // TODO(jiyong): normalize this (e.g. a/b/c/../d -> a/b/d). We can't use
+        // fs::canonicalize as this is a non-existing path yet.
+
+        let mut parent = ROOT;
+        let mut iter = path.iter().peekable();
+        while let Some(name) = iter.next() {
+            // TODO(jiyong): remove this check by canonicalizing `path`
+            if name == ".." {
+                bail!(".. is not allowed");
+            }
+
+            let is_leaf = iter.peek().is_none();
+            let is_file = file_data.is_some() && is_leaf;
+
+            // The happy path; the inode for `name` is already in the `parent` inode. Move on
+            // to the next path element.
+            let name = CString::new(name.as_bytes()).unwrap();
+            if let Some(found) = self.find(parent, &name) {
+                parent = found;
+                // Update the mode if this is a directory leaf.
+                if !is_file && is_leaf {
+                    let mut inode = self.get_mut(parent).unwrap();
+                    inode.mode = mode.unwrap_or(0);
+                }
+                continue;
             }
+
+            const DEFAULT_DIR_MODE: u32 = libc::S_IRUSR | libc::S_IXUSR;
+
+            // No inode found. Create a new inode and add it to the inode table.
+            let inode = if is_file {
+                let (size, entry) = file_data.take().unwrap();
+                InodeData::new_file(mode.unwrap_or(0), size, entry)
+            } else if is_leaf {
+                InodeData::new_dir(mode.unwrap_or(DEFAULT_DIR_MODE))
+            } else {
+                InodeData::new_dir(DEFAULT_DIR_MODE)
+            };
+            let new = self.add(parent, name, inode);
+            parent = new;
         }
-        Ok(table)
+        Ok(())
     }
 }
 
 #[cfg(test)]
 mod tests {
+    use crate::index::make_index;
     use crate::inode::*;
     use std::io::{Cursor, Write};
     use zip::write::FileOptions;
@@ -397,6 +483,49 @@ mod tests {
         assert_eq!(2 << 20, f.size);
     }
 
+    #[test]
+    fn from_index() {
+        let mut buf: Cursor<Vec<u8>> = Cursor::new(Vec::new());
+        let mut writer = zip::ZipWriter::new(&mut buf);
+        let stored = FileOptions::default().compression_method(zip::CompressionMethod::Stored);
+        writer.add_directory("a/b1", FileOptions::default()).unwrap();
+        writer.start_file("a/b2/c1", stored.unix_permissions(0o700)).unwrap();
+        writer.write_all(b"0123456789").unwrap();
+        writer.start_file("a/b2/c2", FileOptions::default()).unwrap();
+        writer.write_all(&[0; 1234]).unwrap();
+        writer.start_file("foo", FileOptions::default()).unwrap();
+        assert!(writer.finish().is_ok());
+        drop(writer);
+
+        let archive_size = buf.get_ref().len() as u64;
+        let mut zip = zip::ZipArchive::new(buf).unwrap();
+        let index = make_index(&mut zip, archive_size);
+        let index = ArchiveIndex::parse(&index).unwrap();
+        let it = InodeTable::from_index(&index, archive_size).unwrap();
+        let expected = InodeTable::from_zip(&mut zip).unwrap();
+
+        assert_eq!(expected.table.len(), it.table.len());
+        let a = check_dir(&it, ROOT, "a");
+        let _b1 = check_dir(&it, a, "b1");
+        let b2 = check_dir(&it, a, "b2");
+        let c1 = check_file(&it, b2, "c1");
+        assert_eq!(10, c1.size);
+        assert_eq!(0o700, c1.mode & 0o777);
+        let c1_entry = c1.get_zip_entry().unwrap();
+        assert_eq!(zip.by_name("a/b2/c1").unwrap().data_start(), c1_entry.data_start);
+        assert!(matches!(c1_entry.compression, zip::CompressionMethod::Stored));
+        let c2 = check_file(&it, b2, "c2");
+        assert_eq!(1234, c2.size);
+        assert!(matches!(
+            c2.get_zip_entry().unwrap().compression,
+            zip::CompressionMethod::Deflated
+        ));
+        let _foo = check_file(&it, ROOT, "foo");
+
+        // The index of another archive
+        assert!(InodeTable::from_index(&index, archive_size - 1).is_err());
+    }
+
     #[test]
     fn rejects_invalid_paths() {
         let invalid_paths = [
@@ -18,9 +18,11 @@
 //! in a zip archive. This filesystem does not supporting writing files back to the zip archive.
 //! The filesystem has to be mounted read only.
 
+mod content;
+mod index;
 mod inode;
 
-use anyhow::Result;
+use anyhow::{anyhow, Result};
 use clap::{App, Arg};
 use fuse::filesystem::*;
 use fuse::mount::*;
@@ -29,30 +31,83 @@ use std::convert::TryFrom;
 use std::ffi::{CStr, CString};
 use std::fs::{File, OpenOptions};
 use std::io;
-use std::io::Read;
+use std::io::{Seek, SeekFrom};
 use std::mem::size_of;
+use std::ops::Deref;
 use std::os::unix::io::AsRawFd;
-use std::path::Path;
-use std::sync::Mutex;
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex, RwLock};
+use std::thread;
 
+use crate::content::{FileContent, ReleasedFiles};
+use crate::index::{ArchiveIndex, MappedFile};
 use crate::inode::{DirectoryEntry, Inode, InodeData, InodeKind, InodeTable};
 
 fn main() -> Result<()> {
     let matches = App::new("zipfuse")
         .arg(Arg::with_name("ZIPFILE").required(true))
         .arg(Arg::with_name("MOUNTPOINT").required(true))
+        .arg(
+            Arg::with_name("max-read")
+                .long("max-read")
+                .takes_value(true)
+                .help("Maximum size of a read request from the kernel, in bytes"),
+        )
+        .arg(
+            Arg::with_name("threads")
+                .long("threads")
+                .takes_value(true)
+                .help("Number of threads serving the requests. Defaults to the number of CPUs"),
+        )
+        .arg(
+            Arg::with_name("index")
+                .long("index")
+                .takes_value(true)
+                .help("Index of the zip entries generated by mk_payload, read instead of the zip"),
+        )
         .get_matches();
 
     let zip_file = matches.value_of("ZIPFILE").unwrap().as_ref();
     let mount_point = matches.value_of("MOUNTPOINT").unwrap().as_ref();
-    run_fuse(zip_file, mount_point)?;
+    let mut options = Options::default();
+    if let Some(max_read) = matches.value_of("max-read") {
+        options.max_read = max_read.parse()?;
+    }
+    if let Some(threads) = matches.value_of("threads") {
+        options.num_threads = threads.parse()?;
+    }
+    options.index = matches.value_of("index").map(PathBuf::from);
+    run_fuse(zip_file, mount_point, &options)?;
     Ok(())
 }
 
+/// Options of the filesystem.
+pub struct Options {
+    /// Maximum size of a read request from the kernel, in bytes.
+    pub max_read: u32,
+    /// Number of threads serving the requests from the kernel.
+    pub num_threads: usize,
+    /// The index of the entries of the zip archive, generated by mk_payload. When given, the
+    /// central directory of the archive is not read.
+    pub index: Option<PathBuf>,
+}
+
+impl Default for Options {
+    fn default() -> Options {
+        // SAFETY: a query-only syscall
+        let cpus = unsafe { libc::sysconf(libc::_SC_NPROCESSORS_ONLN) };
+        Options {
+            max_read: 1 << 20,
+            num_threads: if cpus > 0 { cpus as usize } else { 1 },
+            index: None,
+        }
+    }
+}
+
 /// Runs a fuse filesystem by mounting `zip_file` on `mount_point`.
-pub fn run_fuse(zip_file: &Path, mount_point: &Path) -> Result<()> {
-    const MAX_READ: u32 = 1 << 20; // TODO(jiyong): tune this
+pub fn run_fuse(zip_file: &Path, mount_point: &Path, options: &Options) -> Result<()> {
     const MAX_WRITE: u32 = 1 << 13; // This is a read-only filesystem
+    let max_read = options.max_read;
 
     let dev_fuse = OpenOptions::new().read(true).write(true).open("/dev/fuse")?;
 
@@ -66,28 +121,65 @@ pub fn run_fuse(zip_file: &Path, mount_point: &Path) -> Result<()> {
             MountOption::AllowOther,
             MountOption::UserId(0),
             MountOption::GroupId(0),
-            MountOption::MaxRead(MAX_READ),
+            MountOption::MaxRead(max_read),
         ],
     )?;
-    Ok(fuse::worker::start_message_loop(dev_fuse, MAX_READ, MAX_WRITE, ZipFuse::new(zip_file)?)?)
+
+    // All the threads read the requests from the same fuse device. The kernel gives each request
+    // to one of them.
+    let zip_fuse = ZipFuse::new(zip_file, options.index.as_deref())?;
+    let mut workers = Vec::new();
+    for _ in 1..options.num_threads {
+        let dev_fuse = dev_fuse.try_clone()?;
+        let zip_fuse = zip_fuse.clone();
+        workers.push(thread::spawn(move || {
+            fuse::worker::start_message_loop(dev_fuse, max_read, MAX_WRITE, zip_fuse)
+        }));
+    }
+    fuse::worker::start_message_loop(dev_fuse, max_read, MAX_WRITE, zip_fuse)?;
+    for worker in workers {
+        worker.join().map_err(|_| anyhow!("A fuse worker thread panicked"))??;
+    }
+    Ok(())
 }
 
-struct ZipFuse {
-    zip_archive: Mutex<zip::ZipArchive<File>>,
+/// The maximum total size of the decompressed content kept for the files that are not open.
+const RELEASED_FILES_CACHE_SIZE: usize = 16 << 20;
+
+/// The number of parts of the table of open files. Requests for files in different parts don't
+/// wait for each other.
+const OPEN_FILES_SHARDS: usize = 16;
+
+/// The filesystem, shared by all the threads serving the requests.
+#[derive(Clone)]
+struct ZipFuse(Arc<ZipFuseState>);
+
+impl Deref for ZipFuse {
+    type Target = ZipFuseState;
+
+    fn deref(&self) -> &ZipFuseState {
+        &self.0
+    }
+}
+
+struct ZipFuseState {
+    /// Only used when opening files that can't be read directly from `archive_file`. None when
+    /// the inode table is built from an index, which has only such files.
+    zip_archive: Option<Mutex<zip::ZipArchive<File>>>,
+    /// The same file as `zip_archive`, to read the content of the files from.
+    archive_file: Arc<File>,
     inode_table: InodeTable,
-    open_files: Mutex<HashMap<Handle, OpenFileBuf>>,
+    /// The open files, in the part of the table given by `open_files_shard`.
+    open_files: [RwLock<HashMap<Handle, OpenFile>>; OPEN_FILES_SHARDS],
     open_dirs: Mutex<HashMap<Handle, OpenDirBuf>>,
+    released_files: Mutex<ReleasedFiles>,
 }
 
-/// Holds the (decompressed) contents of a [`ZipFile`].
-///
-/// This buf is needed because `ZipFile` is in general not seekable due to the compression.
-///
-/// TODO(jiyong): do this only for compressed `ZipFile`s. Uncompressed (store) files don't need
-/// this; they can be directly read from `zip_archive`.
-struct OpenFileBuf {
-    open_count: u32, // multiple opens share the buf because this is a read-only filesystem
-    buf: Box<[u8]>,
+/// Holds the means to read the content of an open file.
+struct OpenFile {
+    open_count: u32, // multiple opens share the content because this is a read-only filesystem
+    /// Reads keep a reference to the content, so that they don't need to hold a lock on the table.
+    content: Arc<FileContent>,
 }
 
 /// Holds the directory entries in a directory opened by [`opendir`].
@@ -107,18 +199,38 @@ fn timeout_max() -> std::time::Duration {
 }
 
 impl ZipFuse {
-    fn new(zip_file: &Path) -> Result<ZipFuse> {
+    fn new(zip_file: &Path, index: Option<&Path>) -> Result<ZipFuse> {
         // TODO(jiyong): Use O_DIRECT to avoid double caching.
         // `.custom_flags(nix::fcntl::OFlag::O_DIRECT.bits())` currently doesn't work.
-        let f = OpenOptions::new().read(true).open(zip_file)?;
-        let mut z = zip::ZipArchive::new(f)?;
-        let it = InodeTable::from_zip(&mut z)?;
-        Ok(ZipFuse {
-            zip_archive: Mutex::new(z),
+        let mut f = OpenOptions::new().read(true).open(zip_file)?;
+        let archive_file = Arc::new(f.try_clone()?);
+        let (zip_archive, it) = match index {
+            Some(index) => {
+                // The index is only needed until the inode table is built.
+                let archive_size = f.seek(SeekFrom::End(0))?;
+                let index = MappedFile::open(index)?;
+                let it =
+                    InodeTable::from_index(&ArchiveIndex::parse(index.as_bytes())?, archive_size)?;
+                (None, it)
+            }
+            None => {
+                let mut z = zip::ZipArchive::new(f)?;
+                let it = InodeTable::from_zip(&mut z)?;
+                (Some(Mutex::new(z)), it)
+            }
+        };
+        Ok(ZipFuse(Arc::new(ZipFuseState {
+            zip_archive,
+            archive_file,
             inode_table: it,
-            open_files: Mutex::new(HashMap::new()),
+            open_files: Default::default(),
             open_dirs: Mutex::new(HashMap::new()),
-        })
+            released_files: Mutex::new(ReleasedFiles::new(RELEASED_FILES_CACHE_SIZE)),
+        })))
+    }
+
+    fn open_files_shard(&self, handle: Handle) -> &RwLock<HashMap<Handle, OpenFile>> {
+        &self.open_files[handle as usize % OPEN_FILES_SHARDS]
     }
 
     fn find_inode(&self, inode: Inode) -> io::Result<&InodeData> {
@@ -189,27 +301,34 @@ impl fuse::filesystem::FileSystem for ZipFuse {
         inode: Self::Inode,
         _flags: u32,
     ) -> io::Result<(Option<Self::Handle>, fuse::filesystem::OpenOptions)> {
-        let mut open_files = self.open_files.lock().unwrap();
         let handle = inode as Handle;
-
-        // If the file is already opened, just increase the reference counter. If not, read the
-        // entire file content to the buffer. When `read` is called, a portion of the buffer is
-        // copied to the kernel.
-        // TODO(jiyong): do this only for compressed zip files. Files that are not compressed
-        // (store) can be directly read from zip_archive. That will help reduce the memory usage.
-        if let Some(ofb) = open_files.get_mut(&handle) {
-            if ofb.open_count == 0 {
+        let mut open_files = self.open_files_shard(handle).write().unwrap();
+
+        // If the file is already opened, just increase the reference counter. If not, prepare to
+        // read its content: files that are not compressed (store) are directly read from the
+        // archive, compressed ones are decompressed as they are read, or taken from the files
+        // recently released.
+        if let Some(of) = open_files.get_mut(&handle) {
+            if of.open_count == 0 {
                 return Err(ebadf());
             }
-            ofb.open_count += 1;
+            of.open_count += 1;
         } else {
             let inode_data = self.find_inode(inode)?;
-            let zip_index = inode_data.get_zip_index().ok_or_else(ebadf)?;
-            let mut zip_archive = self.zip_archive.lock().unwrap();
-            let mut zip_file = zip_archive.by_index(zip_index)?;
-            let mut buf = Vec::with_capacity(inode_data.size as usize);
-            zip_file.read_to_end(&mut buf)?;
-            open_files.insert(handle, OpenFileBuf { open_count: 1, buf: buf.into_boxed_slice() });
+            let entry = inode_data.get_zip_entry().ok_or_else(ebadf)?;
+            let released = self.released_files.lock().unwrap().take(inode);
+            let content = match released {
+                Some(file) => FileContent::from(file),
+                None => match FileContent::new(&self.archive_file, entry, inode_data.size) {
+                    Some(content) => content,
+                    None => {
+                        let zip_archive = self.zip_archive.as_ref().ok_or_else(ebadf)?;
+                        let mut zip_archive = zip_archive.lock().unwrap();
+                        FileContent::extract(zip_archive.by_index(entry.index)?)?
+                    }
+                },
+            };
+            open_files.insert(handle, OpenFile { open_count: 1, content: Arc::new(content) });
         }
         // Note: we don't return `DIRECT_IO` here, because then applications wouldn't be able to
         // mmap the files.
@@ -226,14 +345,19 @@ impl fuse::filesystem::FileSystem for ZipFuse {
         _flock_release: bool,
         _lock_owner: Option<u64>,
     ) -> io::Result<()> {
-        // Releases the buffer for the `handle` when it is opened for nobody. While this is good
-        // for saving memory, this has a performance implication because we need to decompress
-        // again when the same file is opened in the future.
-        let mut open_files = self.open_files.lock().unwrap();
+        // Releases the content for the `handle` when it is opened for nobody. What has been
+        // decompressed is kept in `released_files` for a while, so that it doesn't need to be
+        // decompressed again if the same file is opened soon.
         let handle = inode as Handle;
-        if let Some(ofb) = open_files.get_mut(&handle) {
-            if ofb.open_count.checked_sub(1).ok_or_else(ebadf)? == 0 {
-                open_files.remove(&handle);
+        let mut open_files = self.open_files_shard(handle).write().unwrap();
+        if let Some(of) = open_files.get_mut(&handle) {
+            of.open_count = of.open_count.checked_sub(1).ok_or_else(ebadf)?;
+            if of.open_count == 0 {
+                let content = open_files.remove(&handle).unwrap().content;
+                // The content can't be kept if a read is still using it.
+                if let Ok(FileContent::Compressed(file)) = Arc::try_unwrap(content) {
+                    self.released_files.lock().unwrap().put(inode, file.into_inner().unwrap());
+                }
             }
             Ok(())
         } else {
@@ -252,16 +376,15 @@ impl fuse::filesystem::FileSystem for ZipFuse {
         _lock_owner: Option<u64>,
         _flags: u32,
     ) -> io::Result<usize> {
-        let open_files = self.open_files.lock().unwrap();
-        let ofb = open_files.get(&handle).ok_or_else(ebadf)?;
-        if ofb.open_count == 0 {
-            return Err(ebadf());
-        }
-        let start = offset as usize;
-        let end = start + size as usize;
-        let end = std::cmp::min(end, ofb.buf.len());
-        let read_len = w.write(&ofb.buf[start..end])?;
-        Ok(read_len)
+        let content = {
+            let open_files = self.open_files_shard(handle).read().unwrap();
+            let of = open_files.get(&handle).ok_or_else(ebadf)?;
+            if of.open_count == 0 {
+                return Err(ebadf());
+            }
+            Arc::clone(&of.content)
+        };
+        content.read_to(&mut w, offset, size as usize)
     }
 
     fn opendir(
@@ -388,7 +511,7 @@ mod tests {
         let zip_path = PathBuf::from(zip_path);
         let mnt_path = PathBuf::from(mnt_path);
         std::thread::spawn(move || {
-            crate::run_fuse(&zip_path, &mnt_path).unwrap();
+            crate::run_fuse(&zip_path, &mnt_path, &crate::Options::default()).unwrap();
         });
     }
 
@@ -609,6 +732,72 @@ mod tests {
         );
     }
 
+    #[test]
+    fn large_stored_file() {
+        run_test(
+            |zip| {
+                let data: Vec<u8> = (0..(2 << 20)).map(|i| i as u8).collect();
+                let opt = FileOptions::default().compression_method(zip::CompressionMethod::Stored);
+                zip.start_file("foo", opt).unwrap();
+                zip.write_all(&data).unwrap();
+            },
+            |root| {
+                let data: Vec<u8> = (0..(2 << 20)).map(|i| i as u8).collect();
+                check_file(root, "foo", &data);
+            },
+        );
+    }
+
+    #[test]
+    fn reopen_file() {
+        run_test(
+            |zip| {
+                let data: Vec<u8> = (0..(2 << 20)).map(|i| (i % 251) as u8).collect();
+                zip.start_file("foo", FileOptions::default()).unwrap();
+                zip.write_all(&data).unwrap();
+            },
+            |root| {
+                let data: Vec<u8> = (0..(2 << 20)).map(|i| (i % 251) as u8).collect();
+                // The second time, the content is served from what was decompressed the first time.
+                check_file(root, "foo", &data);
+                check_file(root, "foo", &data);
+            },
+        );
+    }
+
+    #[test]
+    fn concurrent_reads() {
+        const NUM_FILES: usize = 8;
+        run_test(
+            |zip| {
+                for i in 0..NUM_FILES {
+                    let data = vec![i as u8; 1 << 20];
+                    let opt = if i % 2 == 0 {
+                        FileOptions::default()
+                    } else {
+                        FileOptions::default().compression_method(zip::CompressionMethod::Stored)
+                    };
+                    zip.start_file(format!("{}", i), opt).unwrap();
+                    zip.write_all(&data).unwrap();
+                }
+            },
+            |root| {
+                let threads: Vec<_> = (0..NUM_FILES * 2)
+                    .map(|i| {
+                        let root = root.to_path_buf();
+                        std::thread::spawn(move || {
+                            let file = i % NUM_FILES;
+                            check_file(&root, &format!("{}", file), &vec![file as u8; 1 << 20]);
+                        })
+                    })
+                    .collect();
+                for thread in threads {
+                    assert!(thread.join().is_ok());
+                }
+            },
+        );
+    }
+
     #[test]
     fn large_dir() {
         const NUM_FILES: usize = 1 << 10;